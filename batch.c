@@ -0,0 +1,602 @@
+/*
+ * Batch download of a list of URLs.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE		/* for strerror_r() returning a string */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "http.h"
+#include "url.h"
+#include "util.h"
+#include "batch.h"
+#include "stats.h"
+
+#define BUF_SIZE		65536
+
+#define DEFAULT_OUTPUT_FILE	"index.html"
+
+#define ERROR_MAX		256
+
+struct batch_host {
+	char *name;
+	int port;
+	int active;		/* number of downloads in progress */
+	struct batch_host *next;
+};
+
+enum batch_job_state {
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+struct batch_job {
+	char *url_str;
+	char *output;
+	struct url_struct url;
+	struct batch_host *host;
+
+	enum batch_job_state state;
+	bool failed;
+	char error[ERROR_MAX];
+	size_t bytes;		/* number of bytes written to the output */
+};
+
+/*
+ * State of the batch being downloaded. Lives on the stack of
+ * batch_download(), so that several batches may run at the same time.
+ */
+struct batch {
+	const struct batch_options *opts;
+
+	/* Protected by @lock once worker threads are started */
+	struct batch_job *jobs;
+	int nr_jobs;
+	int first_pending;	/* jobs before this one are not pending */
+	struct batch_host *hosts;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void job_failed(struct batch_job *job, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(job->error, ERROR_MAX, fmt, ap);
+	va_end(ap);
+
+	job->failed = true;
+}
+
+static void job_failed_errno(struct batch_job *job, int err, const char *msg)
+{
+	char buf[64];
+
+	job_failed(job, "%s: %s", msg, strerror_r(err, buf, sizeof(buf)));
+}
+
+static struct batch_host *get_host(struct batch *b, const char *name,
+				    int port)
+{
+	struct batch_host *h;
+
+	for (h = b->hosts; h; h = h->next) {
+		if (h->port == port && strcasecmp(h->name, name) == 0)
+			return h;
+	}
+
+	h = xmalloc(sizeof(*h));
+	h->name = xstrdup(name);
+	h->port = port;
+	h->active = 0;
+	h->next = b->hosts;
+	b->hosts = h;
+	return h;
+}
+
+/*
+ * Parse a JSON string starting at *@s, which must point to the opening
+ * quote. The string is unescaped in place. On success, returns the string
+ * and advances *@s past the closing quote. Returns %NULL on failure.
+ */
+static char *json_string(char **s)
+{
+	char *in = *s, *out, *str;
+
+	if (*in != '"')
+		return NULL;
+
+	str = out = ++in;
+	while (*in != '"') {
+		unsigned int c;
+		char hex[5];
+
+		if (!*in)
+			return NULL;
+		if (*in != '\\') {
+			*out++ = *in++;
+			continue;
+		}
+		in++;
+		switch (*in) {
+		case '"':
+		case '\\':
+		case '/':
+			*out++ = *in;
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'u':
+			/* Surrogate pairs are not supported */
+			memcpy(hex, in + 1, 4);
+			hex[4] = '\0';
+			if (strlen(hex) != 4 || sscanf(hex, "%x", &c) != 1 ||
+			    c == 0 || (c >= 0xd800 && c < 0xe000))
+				return NULL;
+			if (c < 0x80) {
+				*out++ = c;
+			} else if (c < 0x800) {
+				*out++ = 0xc0 | (c >> 6);
+				*out++ = 0x80 | (c & 0x3f);
+			} else {
+				*out++ = 0xe0 | (c >> 12);
+				*out++ = 0x80 | ((c >> 6) & 0x3f);
+				*out++ = 0x80 | (c & 0x3f);
+			}
+			in += 4;
+			break;
+		default:
+			return NULL;
+		}
+		in++;
+	}
+
+	*s = in + 1;
+	*out = '\0';
+	return str;
+}
+
+/*
+ * Parse a manifest line in JSON format, see batch.h.
+ */
+static bool parse_json_line(char *s, char **url, char **output)
+{
+	s = skipspaces(s);
+	if (*s != '{')
+		return false;
+	s = skipspaces(s + 1);
+	if (*s == '}')
+		return true;
+
+	while (1) {
+		char *key, *value = NULL;
+
+		key = json_string(&s);
+		if (!key)
+			return false;
+
+		s = skipspaces(s);
+		if (*s != ':')
+			return false;
+		s = skipspaces(s + 1);
+
+		if (*s == '"') {
+			value = json_string(&s);
+			if (!value)
+				return false;
+		} else {
+			/* Skip a non-string value - we don't need it */
+			while (*s && *s != ',' && *s != '}')
+				s++;
+		}
+
+		if (value && strcmp(key, "url") == 0)
+			*url = value;
+		else if (value && strcmp(key, "output") == 0)
+			*output = value;
+
+		s = skipspaces(s);
+		if (*s == '}')
+			break;
+		if (*s != ',')
+			return false;
+		s = skipspaces(s + 1);
+	}
+
+	return strempty(skipspaces(s + 1));
+}
+
+/*
+ * Parse a manifest line in the plain format, see batch.h.
+ */
+static bool parse_plain_line(char *s, char **url, char **output)
+{
+	char *p;
+
+	*url = s;
+	p = findspace(s);
+	if (!*p)
+		return true;
+
+	*p = '\0';
+	s = skipspaces(p + 1);
+	if (strempty(s))
+		return true;
+
+	*output = s;
+	p = findspace(s);
+	if (!strempty(skipspaces(p)))
+		return false;	/* trailing garbage */
+	*p = '\0';
+	return true;
+}
+
+static void add_job(struct batch *b, char *line, int lineno)
+{
+	struct batch_job *job;
+	char *url = NULL, *output = NULL;
+	bool ok;
+
+	line = strstrip(line);
+	if (strempty(line) || line[0] == '#')
+		return;
+
+	if ((b->nr_jobs & (b->nr_jobs - 1)) == 0)
+		b->jobs = xrealloc(b->jobs, max(b->nr_jobs * 2, 1) *
+				   sizeof(*b->jobs));
+
+	job = &b->jobs[b->nr_jobs++];
+	memset(job, 0, sizeof(*job));
+	job->state = JOB_DONE;
+
+	/* The line is modified by the parser, save it for error reporting */
+	job->url_str = xstrdup(line);
+
+	if (line[0] == '{')
+		ok = parse_json_line(line, &url, &output);
+	else
+		ok = parse_plain_line(line, &url, &output);
+
+	if (!ok || !url) {
+		job_failed(job, "Line %d: Invalid manifest entry", lineno);
+		return;
+	}
+
+	free(job->url_str);
+	job->url_str = xstrdup(url);
+
+	if (!url_parse(url, &job->url)) {
+		job_failed(job, "Failed to parse URL");
+		return;
+	}
+	if (job->url.scheme && strcmp(job->url.scheme, HTTP_URL_SCHEME) != 0) {
+		job_failed(job, "URL scheme not supported: %s",
+			   job->url.scheme);
+		url_destroy(&job->url);
+		return;
+	}
+	if (!job->url.host) {
+		job_failed(job, "Invalid URL: host name missing");
+		url_destroy(&job->url);
+		return;
+	}
+
+	if (!output)
+		output = !strempty(job->url.name) ?
+			job->url.name : DEFAULT_OUTPUT_FILE;
+
+	job->output = xstrdup(output);
+	job->host = get_host(b, job->url.host, job->url.port);
+	job->state = JOB_PENDING;
+}
+
+static bool load_manifest(struct batch *b)
+{
+	FILE *f = stdin;
+	char *line = NULL;
+	size_t size = 0;
+	int lineno = 0;
+
+	if (strcmp(b->opts->manifest, "-") != 0) {
+		f = fopen(b->opts->manifest, "r");
+		if (!f) {
+			fprintf(stderr, "Failed to open manifest: %s\n",
+				strerror(errno));
+			return false;
+		}
+	}
+
+	while (getline(&line, &size, f) >= 0)
+		add_job(b, line, ++lineno);
+
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return true;
+}
+
+static void run_job(struct batch *b, struct batch_job *job, char *buf)
+{
+	struct http_request_info info = {
+		.host		= job->url.host,
+		.port		= job->url.port,
+		.command	= "GET",
+		.path		= job->url.path,
+		.max_redirections = b->opts->max_redirections,
+		.creds		= b->opts->creds,
+		.trusted_location = b->opts->trusted_location,
+		.timeouts	= b->opts->timeouts,
+		.sockopts	= b->opts->sockopts,
+		.max_retries	= b->opts->max_retries,
+		.want_compression = b->opts->want_compression,
+	};
+	struct http_response resp;
+	int fd;
+	ssize_t n;
+
+	if (!http_simple_request(&info, &resp)) {
+		job_failed(job, "%s", http_last_error());
+		if (b->opts->stats)
+			stats_print_json(b->opts->stats, job->url_str, NULL,
+					 job->error);
+		return;
+	}
+
+	if (!HTTP_STATUS_OK(resp.status)) {
+		job_failed(job, "Error %d: %s", resp.status, resp.reason);
+		goto out;
+	}
+
+	fd = open(job->output, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0) {
+		job_failed_errno(job, errno, "Failed to open output file");
+		goto out;
+	}
+
+	while ((n = http_response_read(&resp, buf, BUF_SIZE)) > 0) {
+		char *p = buf;
+
+		while (n > 0) {
+			ssize_t written = write(fd, p, n);
+
+			if (written < 0) {
+				job_failed_errno(job, errno, "Failed to write "
+						 "to output file");
+				goto out_close;
+			}
+			p += written;
+			n -= written;
+			job->bytes += written;
+		}
+	}
+	if (n < 0)
+		job_failed(job, "%s", http_last_error());
+out_close:
+	close(fd);
+out:
+	if (b->opts->stats)
+		stats_print_json(b->opts->stats, job->url_str, &resp,
+				 job->failed ? job->error : NULL);
+	http_response_destroy(&resp);
+}
+
+/*
+ * Find a pending job whose server is not at the concurrency limit.
+ * Must be called with @b->lock held.
+ */
+static struct batch_job *pick_job(struct batch *b)
+{
+	int i;
+
+	while (b->first_pending < b->nr_jobs &&
+	       b->jobs[b->first_pending].state != JOB_PENDING)
+		b->first_pending++;
+
+	for (i = b->first_pending; i < b->nr_jobs; i++) {
+		struct batch_job *job = &b->jobs[i];
+
+		if (job->state != JOB_PENDING)
+			continue;
+		if (b->opts->jobs_per_host > 0 &&
+		    job->host->active >= b->opts->jobs_per_host)
+			continue;
+		return job;
+	}
+	return NULL;
+}
+
+static void report_job(struct batch *b, struct batch_job *job)
+{
+	if (job->failed)
+		fprintf(stderr, "Failed: %s: %s\n", job->url_str, job->error);
+	else if (!b->opts->quiet)
+		fprintf(stderr, "Saved: %s -> `%s' (%zu bytes)\n",
+			job->url_str, job->output, job->bytes);
+}
+
+static void *batch_thread(void *arg)
+{
+	struct batch *b = arg;
+	struct batch_job *job;
+	char *buf;
+
+	buf = xmalloc(BUF_SIZE);
+
+	pthread_mutex_lock(&b->lock);
+	while (1) {
+		job = pick_job(b);
+		if (!job) {
+			if (b->first_pending == b->nr_jobs)
+				break;
+			pthread_cond_wait(&b->cond, &b->lock);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		job->host->active++;
+		pthread_mutex_unlock(&b->lock);
+
+		run_job(b, job, buf);
+
+		pthread_mutex_lock(&b->lock);
+		job->state = JOB_DONE;
+		job->host->active--;
+		report_job(b, job);
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	free(buf);
+	return NULL;
+}
+
+static void print_summary(struct batch *b, double elapsed)
+{
+	size_t bytes = 0;
+	int i, failed = 0;
+
+	for (i = 0; i < b->nr_jobs; i++) {
+		bytes += b->jobs[i].bytes;
+		if (b->jobs[i].failed)
+			failed++;
+	}
+
+	/* Avoid division by zero */
+	elapsed = max(elapsed, 0.001);
+
+	fprintf(stderr, "Downloaded %d of %d files, %zu kB in %.1fs "
+		"(%.0f kB/s, %.1f files/s)",
+		b->nr_jobs - failed, b->nr_jobs, bytes >> 10, elapsed,
+		(bytes >> 10) / elapsed, (b->nr_jobs - failed) / elapsed);
+	if (failed)
+		fprintf(stderr, ", %d failed", failed);
+	fputc('\n', stderr);
+}
+
+static void free_jobs(struct batch *b)
+{
+	struct batch_host *h;
+	int i;
+
+	for (i = 0; i < b->nr_jobs; i++) {
+		struct batch_job *job = &b->jobs[i];
+
+		free(job->url_str);
+		free(job->output);
+		if (job->host)
+			url_destroy(&job->url);
+	}
+	free(b->jobs);
+
+	while (b->hosts) {
+		h = b->hosts;
+		b->hosts = h->next;
+		free(h->name);
+		free(h);
+	}
+}
+
+bool batch_download(const struct batch_options *opts)
+{
+	struct batch batch = {
+		.opts	= opts,
+		.lock	= PTHREAD_MUTEX_INITIALIZER,
+		.cond	= PTHREAD_COND_INITIALIZER,
+	};
+	struct batch *b = &batch;
+	struct timespec begin, end;
+	struct batch_host *h;
+	pthread_t *threads;
+	int i, nr_threads;
+	bool ret = true;
+
+	if (!load_manifest(b))
+		return false;
+
+	/* Report broken manifest entries right away */
+	for (i = 0; i < b->nr_jobs; i++) {
+		if (b->jobs[i].failed)
+			report_job(b, &b->jobs[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	/*
+	 * Resolve all hosts up front and in parallel, so that jobs don't
+	 * have to wait for name resolution one after another.
+	 */
+	for (h = b->hosts; h; h = h->next)
+		http_prefetch_host(h->name, h->port);
+
+	nr_threads = min(opts->jobs, b->nr_jobs);
+	threads = xmalloc(max(nr_threads, 1) * sizeof(*threads));
+	for (i = 0; i < nr_threads; i++) {
+		errno = pthread_create(&threads[i], NULL, batch_thread, b);
+		if (errno) {
+			fprintf(stderr, "Failed to create thread: %s\n",
+				strerror(errno));
+			nr_threads = i;
+			break;
+		}
+	}
+	/* Run the jobs in this thread if we failed to create any */
+	if (!nr_threads)
+		batch_thread(b);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < b->nr_jobs; i++) {
+		if (b->jobs[i].failed)
+			ret = false;
+	}
+
+	if (!opts->quiet)
+		print_summary(b, end.tv_sec - begin.tv_sec +
+			      (end.tv_nsec - begin.tv_nsec) / 1e9);
+
+	free_jobs(b);
+	return ret;
+}
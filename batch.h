@@ -0,0 +1,69 @@
+/*
+ * Batch download of a list of URLs.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "http.h"
+
+/*
+ * A manifest lists files to download, one per line. A line is either
+ *
+ * URL [OUTPUT_FILE]
+ *
+ * or a JSON object with string members "url" and, optionally, "output":
+ *
+ * {"url": "example.com/a.txt", "output": "a.txt"}
+ *
+ * If the output file is omitted, the last component of the URL path is used,
+ * like for a single download. Empty lines and lines starting with `#' are
+ * ignored.
+ */
+struct batch_options {
+	const char *manifest;	/* manifest file name; `-' for stdin */
+	int jobs;		/* max number of concurrent downloads */
+	int jobs_per_host;	/* max number of concurrent downloads from
+				   the same server; 0 for unlimited */
+
+	int max_redirections;	/* see struct http_request_info */
+	char *creds;
+	bool trusted_location;
+	struct http_timeouts timeouts;
+	struct http_sockopts sockopts;
+	int max_retries;
+	bool want_compression;
+
+	bool quiet;		/* do not report finished downloads */
+	FILE *stats;		/* if not %NULL, statistics of each download
+				   are written there, see stats_print_json() */
+};
+
+/**
+ * batch_download - download all files listed in a manifest
+ * @opts: the batch options
+ *
+ * Prints a summary report to stderr when done. Returns %true if all files
+ * were downloaded successfully.
+ */
+bool batch_download(const struct batch_options *opts);
+
+#endif /* _BATCH_H */
@@ -0,0 +1,293 @@
+/*
+ * Throughput and latency benchmarks.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "http.h"
+#include "util.h"
+#include "server.h"
+
+#define BUF_SIZE		65536
+
+/* Range requested by RUN_RANGE scenarios */
+#define RANGE_FIRST		(1 << 20)
+#define RANGE_SIZE		(64 << 10)
+
+enum run_mode {
+	RUN_READ,		/* library, http_response_read() */
+	RUN_SPLICE,		/* library, http_response_splice() */
+	RUN_RANGE,		/* library, range request */
+	RUN_CLI,		/* httpget binary */
+};
+
+struct scenario {
+	const char *name;
+	const char *path;
+	int requests;		/* number of requests to make, scaled by -x */
+	enum run_mode mode;
+	size_t size;		/* body size, for RUN_CLI, which can't tell */
+};
+
+static const struct scenario scenarios[] = {
+	{ "small",		"/size/1024",			5000,	RUN_READ, },
+	{ "large",		"/size/268435456",		8,	RUN_READ, },
+	{ "large-splice",	"/size/268435456",		8,	RUN_SPLICE, },
+	{ "chunked",		"/chunked/268435456/16384",	8,	RUN_READ, },
+	{ "chunked-small",	"/chunked/16777216/256",	8,	RUN_READ, },
+	{ "range",		"/size/16777216",		2000,	RUN_RANGE, },
+	{ "redirect",		"/redirect/5/size/1024",	1000,	RUN_READ, },
+	{ "trickle",		"/slow/262144/1048576",		4,	RUN_READ, },
+	{ "cli-small",		"/size/1024",			200,	RUN_CLI,
+	  1024, },
+	{ "cli-large",		"/size/268435456",		4,	RUN_CLI,
+	  268435456, },
+	{ }, /* terminate */
+};
+
+static double FACTOR = 1;
+static char *HTTPGET = "./httpget";
+
+static int port;
+static char *buf;
+static int null_fd;
+
+static void usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-x FACTOR] [-c HTTPGET] [SCENARIO]...\n"
+		"Options:\n"
+		"  -x FACTOR     scale the number of requests by FACTOR\n"
+		"  -c HTTPGET    path to the httpget binary\n"
+		"                (default is %s)\n"
+		"Scenarios:\n", prog, HTTPGET);
+	for (i = 0; scenarios[i].name; i++)
+		fprintf(stderr, "  %-16s%d x GET %s%s\n", scenarios[i].name,
+			scenarios[i].requests, scenarios[i].path,
+			scenarios[i].mode == RUN_CLI ? " (httpget)" : "");
+	exit(2);
+}
+
+/*
+ * Make a request with the library. Return %true on success and add the
+ * number of body bytes received to *@bytes.
+ */
+static bool run_lib(const struct scenario *sc, size_t *bytes)
+{
+	struct http_request_info info = {
+		.host		= "127.0.0.1",
+		.port		= port,
+		.command	= "GET",
+		.path		= (char *)sc->path,
+		.max_redirections = 10,
+	};
+	struct http_response resp;
+	ssize_t n;
+
+	if (sc->mode == RUN_RANGE) {
+		info.want_range = 1;
+		info.range_first = RANGE_FIRST;
+		info.range_last = RANGE_FIRST + RANGE_SIZE - 1;
+	}
+
+	if (!http_simple_request(&info, &resp)) {
+		fprintf(stderr, "%s: %s\n", sc->name, http_last_error());
+		return false;
+	}
+	if (!HTTP_STATUS_OK(resp.status)) {
+		fprintf(stderr, "%s: error %d: %s\n",
+			sc->name, resp.status, resp.reason);
+		http_response_destroy(&resp);
+		return false;
+	}
+
+	do {
+		if (sc->mode == RUN_SPLICE)
+			n = http_response_splice(&resp, null_fd, NULL,
+						 16 * BUF_SIZE);
+		else
+			n = http_response_read(&resp, buf, BUF_SIZE);
+		if (n > 0)
+			*bytes += n;
+	} while (n > 0);
+
+	if (n < 0)
+		fprintf(stderr, "%s: %s\n", sc->name, http_last_error());
+	http_response_destroy(&resp);
+	return n == 0;
+}
+
+/*
+ * Run httpget. Return %true if it succeeds.
+ */
+static bool run_cli(const struct scenario *sc, size_t *bytes)
+{
+	char url[256];
+	int status;
+	pid_t pid;
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", port, sc->path);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return false;
+	}
+	if (pid == 0) {
+		execl(HTTPGET, HTTPGET, "-q", "-o", "/dev/null", url, NULL);
+		perror(HTTPGET);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: httpget failed\n", sc->name);
+		return false;
+	}
+	*bytes += sc->size;
+	return true;
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Return the @p-th percentile of sorted @lat, in milliseconds */
+static double percentile(const int64_t *lat, int nr, int p)
+{
+	int i = (int)((int64_t)nr * p / 100);
+
+	return lat[i < nr ? i : nr - 1] / 1000.0;
+}
+
+static bool run_scenario(const struct scenario *sc)
+{
+	int nr = sc->requests * FACTOR;
+	int64_t *lat, start, begin, elapsed;
+	size_t bytes = 0;
+	bool ok = true;
+	int i;
+
+	if (nr < 1)
+		nr = 1;
+	lat = xmalloc(nr * sizeof(*lat));
+
+	/* Drop connections a previous scenario may have left in the pool */
+	http_pool_flush();
+
+	begin = now_us();
+	for (i = 0; i < nr && ok; i++) {
+		start = now_us();
+		if (sc->mode == RUN_CLI)
+			ok = run_cli(sc, &bytes);
+		else
+			ok = run_lib(sc, &bytes);
+		lat[i] = now_us() - start;
+	}
+	elapsed = now_us() - begin;
+
+	if (ok) {
+		qsort(lat, nr, sizeof(*lat), cmp_latency);
+		printf("%-16s%7d%9.3f%10.1f%10.1f%9.3f%9.3f%9.3f%9.3f\n",
+		       sc->name, nr, elapsed / 1e6, nr * 1e6 / elapsed,
+		       bytes / (elapsed / 1e6) / (1 << 20),
+		       percentile(lat, nr, 50), percentile(lat, nr, 90),
+		       percentile(lat, nr, 99), lat[nr - 1] / 1000.0);
+		fflush(stdout);
+	}
+
+	free(lat);
+	return ok;
+}
+
+static const struct scenario *find_scenario(const char *name)
+{
+	int i;
+
+	for (i = 0; scenarios[i].name; i++) {
+		if (strcmp(scenarios[i].name, name) == 0)
+			return &scenarios[i];
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct scenario *sc;
+	bool ok = true;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "x:c:h")) != -1) {
+		switch (c) {
+		case 'x':
+			FACTOR = atof(optarg);
+			if (FACTOR <= 0)
+				usage(argv[0]);
+			break;
+		case 'c':
+			HTTPGET = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (!find_scenario(argv[i])) {
+			fprintf(stderr, "Unknown scenario: %s\n", argv[i]);
+			usage(argv[0]);
+		}
+	}
+
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+	buf = xmalloc(BUF_SIZE);
+	port = server_start();
+
+	printf("%-16s%7s%9s%10s%10s%9s%9s%9s%9s\n", "scenario", "reqs",
+	       "time,s", "req/s", "MB/s", "p50,ms", "p90,ms", "p99,ms",
+	       "max,ms");
+
+	if (optind == argc) {
+		for (sc = scenarios; sc->name; sc++)
+			ok = run_scenario(sc) && ok;
+	} else {
+		for (i = optind; i < argc; i++)
+			ok = run_scenario(find_scenario(argv[i])) && ok;
+	}
+
+	free(buf);
+	close(null_fd);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+/*
+ * Replay of captured responses, for measuring the cost of parsing.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+#include "util.h"
+
+#define BUF_SIZE		65536
+
+static int ROUNDS = 100;
+static bool COMPRESSION;
+
+static char *buf;
+
+/*
+ * Results of replaying a capture, summed over all rounds.
+ */
+struct replay_result {
+	size_t responses;
+	size_t headers;
+	size_t head_bytes;	/* bytes taken by response heads */
+	size_t body_bytes;	/* bytes returned by http_response_read() */
+	int64_t head_ns;	/* time spent parsing heads */
+	int64_t body_ns;	/* time spent reading bodies */
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n ROUNDS] [-z] FILE...\n"
+		"Parse responses captured with `httpget -R FILE'\n"
+		"Options:\n"
+		"  -n ROUNDS     replay each capture ROUNDS times\n"
+		"                (default is %d)\n"
+		"  -z            decode compressed bodies\n", prog, ROUNDS);
+	exit(2);
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Read the whole of @path to memory. Return %NULL on failure.
+ */
+static char *read_capture(const char *path, size_t *len)
+{
+	struct stat st;
+	char *data = NULL;
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		goto fail;
+
+	data = xmalloc(st.st_size + 1);
+	while (done < st.st_size) {
+		n = read(fd, data + done, st.st_size - done);
+		if (n <= 0)
+			goto fail;
+		done += n;
+	}
+	close(fd);
+	*len = done;
+	return data;
+fail:
+	perror(path);
+	free(data);
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+/*
+ * Parse all responses stored in @replay, reading their bodies to the end.
+ * Return %true on success.
+ */
+static bool replay_all(const char *path, struct http_replay *replay,
+		       struct replay_result *res)
+{
+	struct http_request_info info = {
+		.command	= "GET",
+		.want_compression = COMPRESSION,
+	};
+	struct http_response resp;
+	const char *field, *value;
+	size_t iter, start;
+	int64_t t;
+	ssize_t n;
+
+	replay->pos = 0;
+	while (replay->pos < replay->len) {
+		start = replay->pos;
+
+		t = now_ns();
+		if (!http_response_replay(&info, replay, &resp)) {
+			fprintf(stderr, "%s: response at byte %zu: %s\n",
+				path, start, http_last_error());
+			return false;
+		}
+		res->head_ns += now_ns() - t;
+		res->head_bytes += resp.stats.bytes_received -
+			(resp.conn.buf_end - resp.conn.buf_begin);
+
+		iter = 0;
+		while (http_response_next_header(&resp, &iter, &field, &value))
+			res->headers++;
+
+		t = now_ns();
+		while ((n = http_response_read(&resp, buf, BUF_SIZE)) > 0)
+			res->body_bytes += n;
+		res->body_ns += now_ns() - t;
+
+		if (n < 0) {
+			fprintf(stderr, "%s: response at byte %zu: %s\n",
+				path, start, http_last_error());
+			http_response_destroy(&resp);
+			return false;
+		}
+
+		http_response_destroy(&resp);
+		res->responses++;
+	}
+	return true;
+}
+
+static bool replay_file(const char *path)
+{
+	struct replay_result res = { };
+	struct http_replay replay = { };
+	char *data;
+	int i;
+
+	data = read_capture(path, &replay.len);
+	if (!data)
+		return false;
+	replay.data = data;
+
+	for (i = 0; i < ROUNDS; i++) {
+		if (!replay_all(path, &replay, &res)) {
+			free(data);
+			return false;
+		}
+	}
+
+	printf("%-24s%7zu%9zu%10.1f%10.3f%11zu%10.3f\n", path,
+	       res.responses / ROUNDS, res.headers / ROUNDS,
+	       res.headers ? (double)res.head_ns / res.headers : 0.0,
+	       res.head_ns ? (double)res.head_bytes / res.head_ns : 0.0,
+	       res.body_bytes / ROUNDS,
+	       res.body_ns ? (double)res.body_bytes / res.body_ns : 0.0);
+	fflush(stdout);
+
+	free(data);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	bool ok = true;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "n:zh")) != -1) {
+		switch (c) {
+		case 'n':
+			ROUNDS = atoi(optarg);
+			if (ROUNDS <= 0)
+				usage(argv[0]);
+			break;
+		case 'z':
+			COMPRESSION = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc)
+		usage(argv[0]);
+
+	buf = xmalloc(BUF_SIZE);
+
+	/* GB/s is the same as bytes/ns */
+	printf("%-24s%7s%9s%10s%10s%11s%10s\n", "capture", "resps",
+	       "headers", "ns/hdr", "head,GB/s", "body,bytes", "body,GB/s");
+
+	for (i = optind; i < argc; i++)
+		ok = replay_file(argv[i]) && ok;
+
+	free(buf);
+	return ok ? 0 : 1;
+}
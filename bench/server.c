@@ -0,0 +1,325 @@
+/*
+ * Loopback http server for benchmarks.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "server.h"
+
+#define HEAD_MAX		8192
+#define DATA_SIZE		(1 << 20)
+
+/* Slow senders write this many times per second */
+#define SLOW_TICKS		20
+
+/* Body data, a repeated pattern */
+static char data[DATA_SIZE];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* Return %false if the client has gone */
+static bool send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Send @len bytes of body data, starting at offset @pos of the body */
+static bool send_data(int fd, size_t pos, size_t len)
+{
+	size_t off, n;
+
+	while (len > 0) {
+		off = pos % DATA_SIZE;
+		n = len < DATA_SIZE - off ? len : DATA_SIZE - off;
+		if (!send_all(fd, data + off, n))
+			return false;
+		pos += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool send_head(int fd, const char *status, bool keep_alive,
+		      const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static bool send_head(int fd, const char *status, bool keep_alive,
+		      const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\n%s", status,
+		       keep_alive ? "" : "Connection: close\r\n");
+	va_start(ap, fmt);
+	len += vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+	va_end(ap);
+	len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+	return send_all(fd, buf, len);
+}
+
+static bool serve_size(int fd, size_t size, const char *range,
+		       bool keep_alive)
+{
+	unsigned long long first, last;
+	int n;
+
+	if (range && size > 0) {
+		n = sscanf(range, "bytes=%llu-%llu", &first, &last);
+		if (n >= 1 && first < size) {
+			if (n < 2 || last >= size)
+				last = size - 1;
+			return send_head(fd, "206 Partial Content", keep_alive,
+					 "Content-Range: bytes %llu-%llu/%zu\r\n"
+					 "Content-Length: %llu\r\n",
+					 first, last, size,
+					 last - first + 1) &&
+				send_data(fd, first, last - first + 1);
+		}
+	}
+
+	return send_head(fd, "200 OK", keep_alive,
+			 "Content-Length: %zu\r\n", size) &&
+		send_data(fd, 0, size);
+}
+
+static bool serve_chunked(int fd, size_t size, size_t chunk, bool keep_alive)
+{
+	char line[32];
+	size_t pos, n;
+
+	if (!send_head(fd, "200 OK", keep_alive,
+		       "Transfer-Encoding: chunked\r\n"))
+		return false;
+
+	for (pos = 0; pos < size; pos += n) {
+		n = size - pos < chunk ? size - pos : chunk;
+		snprintf(line, sizeof(line), "%zx\r\n", n);
+		if (!send_all(fd, line, strlen(line)) ||
+		    !send_data(fd, pos, n) || !send_all(fd, "\r\n", 2))
+			return false;
+	}
+	return send_all(fd, "0\r\n\r\n", 5);
+}
+
+static bool serve_slow(int fd, size_t size, size_t rate, bool keep_alive)
+{
+	struct timespec tick = {
+		.tv_nsec	= 1000000000 / SLOW_TICKS,
+	};
+	size_t step = rate / SLOW_TICKS > 0 ? rate / SLOW_TICKS : 1;
+	size_t pos, n;
+
+	if (!send_head(fd, "200 OK", keep_alive,
+		       "Content-Length: %zu\r\n", size))
+		return false;
+
+	for (pos = 0; pos < size; pos += n) {
+		n = size - pos < step ? size - pos : step;
+		if (!send_data(fd, pos, n))
+			return false;
+		if (pos + n < size)
+			nanosleep(&tick, NULL);
+	}
+	return true;
+}
+
+static bool serve(int fd, char *path, const char *range, bool keep_alive)
+{
+	unsigned long long x, y;
+	char *rest;
+	int n;
+
+	if (sscanf(path, "/size/%llu", &x) == 1)
+		return serve_size(fd, x, range, keep_alive);
+	if (sscanf(path, "/chunked/%llu/%llu", &x, &y) == 2 && y > 0)
+		return serve_chunked(fd, x, y, keep_alive);
+	if (sscanf(path, "/slow/%llu/%llu", &x, &y) == 2)
+		return serve_slow(fd, x, y, keep_alive);
+	if (sscanf(path, "/redirect/%llu/%n", &x, &n) == 1 && x > 0) {
+		rest = path + n;
+		if (x > 1)
+			return send_head(fd, "302 Found", keep_alive,
+					 "Location: /redirect/%llu/%s\r\n"
+					 "Content-Length: 0\r\n", x - 1, rest);
+		return send_head(fd, "302 Found", keep_alive,
+				 "Location: /%s\r\nContent-Length: 0\r\n",
+				 rest);
+	}
+	return send_head(fd, "404 Not Found", keep_alive,
+			 "Content-Length: 0\r\n");
+}
+
+/*
+ * Find a header in a request head whose lines are nul-terminated.
+ */
+static const char *find_header(char *head, char *end, const char *name)
+{
+	size_t len = strlen(name);
+	char *p;
+
+	for (p = head; p < end; p += strlen(p) + 1) {
+		if (strncasecmp(p, name, len) == 0 && p[len] == ':')
+			return p + len + 1 + strspn(p + len + 1, " \t");
+	}
+	return NULL;
+}
+
+static void *conn_thread(void *arg)
+{
+	int fd = (long)arg;
+	char buf[HEAD_MAX + 1];
+	size_t used = 0, len;
+	char *end, *p, *headers, *path, *space;
+	const char *conn_hdr;
+	bool keep_alive;
+	ssize_t n;
+
+	while (1) {
+		/* Receive a request head, which may already be buffered */
+		buf[used] = '\0';
+		while (!(end = strstr(buf, "\r\n\r\n"))) {
+			if (used == HEAD_MAX)
+				goto out;
+			n = recv(fd, buf + used, HEAD_MAX - used, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				goto out;
+			used += n;
+			buf[used] = '\0';
+		}
+		end += 4;
+		len = end - buf;
+
+		/* Split the head into nul-terminated lines */
+		for (p = buf; p < end; p++) {
+			if (*p == '\r' || *p == '\n')
+				*p = '\0';
+		}
+
+		headers = buf + strlen(buf) + 1;
+
+		path = strchr(buf, ' ');
+		if (!path)
+			goto out;
+		path++;
+		space = strchr(path, ' ');
+		if (space)
+			*space = '\0';
+
+		conn_hdr = find_header(headers, end, "Connection");
+		keep_alive = !conn_hdr || strcasecmp(conn_hdr, "close") != 0;
+
+		if (!serve(fd, path, find_header(headers, end, "Range"),
+			   keep_alive) || !keep_alive)
+			goto out;
+
+		/* Keep what the client may have pipelined */
+		memmove(buf, buf + len, used - len);
+		used -= len;
+	}
+out:
+	close(fd);
+	return NULL;
+}
+
+static void *accept_thread(void *arg)
+{
+	int sfd = (long)arg;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd, one = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (1) {
+		fd = accept(sfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			die("accept");
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		errno = pthread_create(&thread, &attr, conn_thread,
+				       (void *)(long)fd);
+		if (errno)
+			die("pthread_create");
+	}
+	return NULL;
+}
+
+int server_start(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family	= AF_INET,
+		.sin_addr	= { htonl(INADDR_LOOPBACK) },
+	};
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	int sfd, i;
+
+	for (i = 0; i < DATA_SIZE; i++)
+		data[i] = 'a' + i % 26;
+
+	sfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sfd < 0)
+		die("socket");
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sfd, 128) < 0 ||
+	    getsockname(sfd, (struct sockaddr *)&addr, &len) < 0)
+		die("bind");
+
+	errno = pthread_create(&thread, NULL, accept_thread,
+			       (void *)(long)sfd);
+	if (errno)
+		die("pthread_create");
+	pthread_detach(thread);
+	return ntohs(addr.sin_port);
+}
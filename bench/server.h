@@ -0,0 +1,43 @@
+/*
+ * Loopback http server for benchmarks.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SERVER_H
+#define _SERVER_H
+
+/*
+ * The server answers GET requests to the following paths:
+ *
+ *  /size/N		N bytes with Content-Length; Range is supported
+ *  /chunked/N/C	N bytes in chunks of C bytes
+ *  /redirect/K/PATH	302 to /redirect/K-1/PATH, or to /PATH if K is 1
+ *  /slow/N/RATE	N bytes with Content-Length, sent at RATE bytes/s
+ *
+ * Connections are kept alive unless the client asks otherwise. Each
+ * connection is served by its own thread.
+ */
+
+/**
+ * server_start - start the server
+ *
+ * Listens on a random port of the loopback interface. Returns the port
+ * number. Exits on failure.
+ */
+int server_start(void);
+
+#endif /* _SERVER_H */
@@ -0,0 +1,434 @@
+/*
+ * Multi-threaded stress test of the http library.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "http.h"
+#include "loop.h"
+#include "util.h"
+#include "server.h"
+
+#define BUF_SIZE		65536
+
+/* Must match the body data of the server, see server.c */
+#define DATA_SIZE		(1 << 20)
+
+/* Number of requests run at once by the event loop of a thread */
+#define LOOP_REQUESTS		4
+
+enum job_kind {
+	JOB_SIZE,		/* plain body */
+	JOB_CHUNKED,		/* chunked body */
+	JOB_REDIRECT,		/* plain body after two redirections */
+	JOB_RANGE,		/* part of a plain body */
+	JOB_REFUSED,		/* must fail to connect */
+	JOB_TIMEOUT,		/* must time out */
+	JOB_LOOP,		/* several requests through an event loop */
+	NR_JOB_KINDS,
+};
+
+/*
+ * Per-thread state. Everything a request may touch is here, so any
+ * cross-talk between threads shows up as a failed check.
+ */
+struct worker {
+	int id;
+	pthread_t thread;
+	unsigned seed;
+	char *buf;
+
+	const char *path;	/* path of the request in progress */
+	bool path_traced;	/* the trace hook has seen it sent */
+	int traces;		/* number of lines traced */
+
+	int requests;
+	int failures;
+};
+
+static int THREADS = 16;
+static int REQUESTS = 500;
+
+static int port;
+static int refused_port;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-t THREADS] [-n REQUESTS]\n"
+		"Options:\n"
+		"  -t THREADS    number of threads (default is %d)\n"
+		"  -n REQUESTS   number of requests per thread\n"
+		"                (default is %d)\n", prog, THREADS, REQUESTS);
+	exit(2);
+}
+
+static void worker_fail(struct worker *w, const char *fmt, ...)
+{
+	va_list ap;
+
+	flockfile(stderr);
+	fprintf(stderr, "thread %d: ", w->id);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	funlockfile(stderr);
+
+	w->failures++;
+}
+
+/*
+ * Trace hook. Checks that it is called for the request of its own thread:
+ * the request line must carry the path of the request in progress.
+ */
+static void trace(void *arg, const char *fmt, va_list ap)
+{
+	struct worker *w = arg;
+	char line[512], expect[128];
+
+	if (w->thread != pthread_self())
+		worker_fail(w, "trace hook called from another thread");
+
+	vsnprintf(line, sizeof(line), fmt, ap);
+	if (w->path) {
+		snprintf(expect, sizeof(expect), "> GET %s ", w->path);
+		if (strncmp(line, expect, strlen(expect)) == 0)
+			w->path_traced = true;
+	}
+	w->traces++;
+}
+
+/* Return %true if @buf holds the server body data at offset @pos */
+static bool check_data(const char *buf, size_t len, size_t pos)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++, pos++) {
+		if (buf[i] != 'a' + pos % DATA_SIZE % 26)
+			return false;
+	}
+	return true;
+}
+
+static void init_info(struct worker *w, struct http_request_info *info,
+		      const char *path)
+{
+	memset(info, 0, sizeof(*info));
+	info->host = "127.0.0.1";
+	info->port = port;
+	info->command = "GET";
+	info->path = (char *)path;
+	info->max_redirections = 10;
+	info->trace = trace;
+	info->trace_arg = w;
+
+	w->path = path;
+	w->path_traced = false;
+}
+
+/*
+ * Make a request that is expected to fail with an error starting with
+ * @error. Since the error is kept per thread, failing requests run by
+ * other threads at the same time must not change it.
+ */
+static void run_failing(struct worker *w, struct http_request_info *info,
+			const char *error)
+{
+	struct http_response resp;
+	ssize_t n = 0;
+
+	if (http_simple_request(info, &resp)) {
+		while ((n = http_response_read(&resp, w->buf, BUF_SIZE)) > 0)
+			;
+		http_response_destroy(&resp);
+		if (n == 0) {
+			worker_fail(w, "%s: expected to fail", info->path);
+			return;
+		}
+	}
+
+	/* Give the other threads a chance to overwrite the error */
+	sched_yield();
+
+	if (strncmp(http_last_error(), error, strlen(error)) != 0)
+		worker_fail(w, "%s: unexpected error: %s",
+			    info->path, http_last_error());
+}
+
+static void run_simple(struct worker *w, enum job_kind kind)
+{
+	struct http_request_info info;
+	struct http_response resp;
+	size_t size, first = 0, last, pos, got = 0;
+	char path[64];
+	ssize_t n;
+
+	size = 1 + rand_r(&w->seed) % (3 * DATA_SIZE);
+	last = size - 1;
+
+	switch (kind) {
+	case JOB_CHUNKED:
+		snprintf(path, sizeof(path), "/chunked/%zu/%d", size,
+			 1 + rand_r(&w->seed) % 32768);
+		break;
+	case JOB_REDIRECT:
+		snprintf(path, sizeof(path), "/redirect/2/size/%zu", size);
+		break;
+	case JOB_REFUSED:
+	case JOB_TIMEOUT:
+		snprintf(path, sizeof(path), "/slow/%zu/1", size);
+		break;
+	default:
+		snprintf(path, sizeof(path), "/size/%zu", size);
+	}
+
+	init_info(w, &info, path);
+
+	if (kind == JOB_REFUSED) {
+		info.port = refused_port;
+		run_failing(w, &info, "Failed to connect");
+		return;
+	}
+	if (kind == JOB_TIMEOUT) {
+		info.timeouts.idle = 20;
+		run_failing(w, &info, "Timed out");
+		return;
+	}
+	if (kind == JOB_RANGE) {
+		first = rand_r(&w->seed) % size;
+		last = first + rand_r(&w->seed) % (size - first);
+		info.want_range = 1;
+		info.range_first = first;
+		info.range_last = last;
+	}
+
+	if (!http_simple_request(&info, &resp)) {
+		worker_fail(w, "%s: %s", path, http_last_error());
+		return;
+	}
+	if (!w->path_traced)
+		worker_fail(w, "%s: request not traced", path);
+	if (resp.status != (kind == JOB_RANGE ? 206 : 200))
+		worker_fail(w, "%s: unexpected status %d", path, resp.status);
+	if (kind == JOB_REDIRECT && resp.stats.redirects != 2)
+		worker_fail(w, "%s: %d redirections", path,
+			    resp.stats.redirects);
+
+	pos = first;
+	while ((n = http_response_read(&resp, w->buf, BUF_SIZE)) > 0) {
+		if (!check_data(w->buf, n, pos)) {
+			worker_fail(w, "%s: corrupted body at %zu", path, pos);
+			break;
+		}
+		pos += n;
+		got += n;
+	}
+	if (n < 0)
+		worker_fail(w, "%s: %s", path, http_last_error());
+	else if (got != last - first + 1)
+		worker_fail(w, "%s: got %zu bytes, expected %zu", path, got,
+			    last - first + 1);
+
+	http_response_destroy(&resp);
+}
+
+struct loop_job {
+	struct http_loop_request req;
+	struct worker *w;
+	char path[64];
+	size_t size;
+	size_t got;
+	bool done;
+	bool ok;
+};
+
+static bool loop_on_data(struct http_loop_request *req,
+			 const char *buf, size_t len)
+{
+	struct loop_job *job = req->priv;
+
+	if (!check_data(buf, len, job->got)) {
+		worker_fail(job->w, "%s: corrupted body at %zu",
+			    job->path, job->got);
+		return false;
+	}
+	job->got += len;
+	return true;
+}
+
+static void loop_on_done(struct http_loop_request *req, bool success)
+{
+	struct loop_job *job = req->priv;
+
+	job->done = true;
+	job->ok = success && job->got == job->size;
+	if (!success)
+		worker_fail(job->w, "%s: %s", job->path, http_last_error());
+	else if (!job->ok)
+		worker_fail(job->w, "%s: got %zu bytes, expected %zu",
+			    job->path, job->got, job->size);
+}
+
+static void run_loop(struct worker *w)
+{
+	struct loop_job jobs[LOOP_REQUESTS];
+	struct http_request_info info;
+	struct http_loop loop;
+	int i, started = 0;
+
+	if (!http_loop_init(&loop)) {
+		worker_fail(w, "failed to init loop");
+		return;
+	}
+
+	for (i = 0; i < LOOP_REQUESTS; i++) {
+		struct loop_job *job = &jobs[i];
+
+		memset(job, 0, sizeof(*job));
+		job->w = w;
+		job->size = 1 + rand_r(&w->seed) % DATA_SIZE;
+		snprintf(job->path, sizeof(job->path), "/size/%zu", job->size);
+		job->req.on_data = loop_on_data;
+		job->req.on_done = loop_on_done;
+		job->req.priv = job;
+
+		init_info(w, &info, job->path);
+		if (!http_loop_start(&loop, &job->req, &info)) {
+			worker_fail(w, "%s: %s", job->path, http_last_error());
+			break;
+		}
+		started++;
+	}
+
+	while (http_loop_run(&loop, -1) > 0)
+		;
+
+	for (i = 0; i < started; i++)
+		http_async_destroy(&jobs[i].req.async);
+	http_loop_destroy(&loop);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	enum job_kind kind;
+	int i;
+
+	w->buf = xmalloc(BUF_SIZE);
+	for (i = 0; i < REQUESTS; i++) {
+		kind = rand_r(&w->seed) % NR_JOB_KINDS;
+		if (kind == JOB_LOOP)
+			run_loop(w);
+		else
+			run_simple(w, kind);
+		w->requests++;
+	}
+	w->path = NULL;
+	free(w->buf);
+	return NULL;
+}
+
+/*
+ * Return a loopback port nobody listens on.
+ */
+static int get_refused_port(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family	= AF_INET,
+		.sin_addr	= { htonl(INADDR_LOOPBACK) },
+	};
+	socklen_t len = sizeof(addr);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	close(fd);
+	return ntohs(addr.sin_port);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	int64_t begin, elapsed;
+	int requests = 0, failures = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:n:h")) != -1) {
+		switch (c) {
+		case 't':
+			THREADS = atoi(optarg);
+			if (THREADS <= 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			REQUESTS = atoi(optarg);
+			if (REQUESTS <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	port = server_start();
+	refused_port = get_refused_port();
+
+	workers = xmalloc(THREADS * sizeof(*workers));
+	memset(workers, 0, THREADS * sizeof(*workers));
+
+	begin = now_us();
+	for (i = 0; i < THREADS; i++) {
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		errno = pthread_create(&workers[i].thread, NULL,
+				       worker_thread, &workers[i]);
+		if (errno) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(workers[i].thread, NULL);
+		requests += workers[i].requests;
+		failures += workers[i].failures;
+	}
+	elapsed = now_us() - begin;
+
+	printf("%d threads, %d requests in %.3fs, %d failures\n",
+	       THREADS, requests, elapsed / 1e6, failures);
+
+	free(workers);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * Local cache of http responses.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE		/* for strptime() and timegm() */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+
+#include "http.h"
+#include "util.h"
+#include "cache.h"
+
+#define COPY_BUF_SIZE		65536
+
+/* FNV-1a, 64 bit */
+static uint64_t url_hash(const char *url)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *url; url++)
+		h = (h ^ (unsigned char)*url) * 1099511628211ULL;
+	return h;
+}
+
+static char *cache_path(const char *dir, const char *url, const char *ext)
+{
+	size_t size = strlen(dir) + strlen(ext) + 18;
+	char *path = xmalloc(size);
+
+	snprintf(path, size, "%s/%016llx%s", dir,
+		 (unsigned long long)url_hash(url), ext);
+	return path;
+}
+
+static void set_str(char **str, const char *val)
+{
+	free(*str);
+	*str = val ? xstrdup(val) : NULL;
+}
+
+/*
+ * Read @entry->meta_path. Return %true if it describes @entry->url and
+ * the body file is in place.
+ */
+static bool read_meta(struct cache_entry *entry)
+{
+	char *line = NULL, *val;
+	char *url = NULL;
+	size_t size = 0;
+	bool have_size = false;
+	long long x;
+	struct stat st;
+	ssize_t len;
+	FILE *f;
+
+	f = fopen(entry->meta_path, "re");
+	if (!f)
+		return false;
+
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		val = strchr(line, ' ');
+		if (!val)
+			continue;
+		*val++ = '\0';
+
+		if (strcmp(line, "url") == 0)
+			set_str(&url, val);
+		else if (strcmp(line, "etag") == 0)
+			set_str(&entry->etag, val);
+		else if (strcmp(line, "last-modified") == 0)
+			set_str(&entry->last_modified, val);
+		else if (strcmp(line, "expires") == 0 &&
+			 strict_strtoll(val, 10, &x))
+			entry->expires = x;
+		else if (strcmp(line, "size") == 0 &&
+			 strict_strtoll(val, 10, &x) && x >= 0) {
+			entry->size = x;
+			have_size = true;
+		}
+	}
+	free(line);
+	fclose(f);
+
+	/* Check for hash collisions and incomplete updates */
+	if (!url || strcmp(url, entry->url) != 0 || !have_size ||
+	    stat(entry->body_path, &st) != 0 || st.st_size != entry->size) {
+		free(url);
+		return false;
+	}
+	free(url);
+	return true;
+}
+
+static bool write_meta(struct cache_entry *entry)
+{
+	char *tmp_path;
+	size_t size;
+	bool ok;
+	FILE *f;
+
+	size = strlen(entry->meta_path) + 5;
+	tmp_path = xmalloc(size);
+	snprintf(tmp_path, size, "%s.tmp", entry->meta_path);
+
+	f = fopen(tmp_path, "we");
+	if (!f) {
+		free(tmp_path);
+		return false;
+	}
+
+	fprintf(f, "url %s\n", entry->url);
+	if (entry->etag)
+		fprintf(f, "etag %s\n", entry->etag);
+	if (entry->last_modified)
+		fprintf(f, "last-modified %s\n", entry->last_modified);
+	fprintf(f, "expires %lld\n", (long long)entry->expires);
+	fprintf(f, "size %zu\n", entry->size);
+
+	ok = !ferror(f);
+	if (fclose(f) != 0)
+		ok = false;
+	if (ok && rename(tmp_path, entry->meta_path) != 0)
+		ok = false;
+	if (!ok)
+		unlink(tmp_path);
+	free(tmp_path);
+	return ok;
+}
+
+void cache_open(struct cache_entry *entry, const char *dir, const char *url)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->url = xstrdup(url);
+	entry->body_path = cache_path(dir, url, ".body");
+	entry->meta_path = cache_path(dir, url, ".meta");
+	entry->valid = read_meta(entry);
+}
+
+void cache_close(struct cache_entry *entry)
+{
+	cache_abort(entry);
+	free(entry->url);
+	free(entry->etag);
+	free(entry->last_modified);
+	free(entry->body_path);
+	free(entry->meta_path);
+}
+
+void cache_abort(struct cache_entry *entry)
+{
+	if (entry->tmp_path) {
+		unlink(entry->tmp_path);
+		free(entry->tmp_path);
+		entry->tmp_path = NULL;
+	}
+}
+
+bool cache_fresh(const struct cache_entry *entry)
+{
+	return entry->valid && time(NULL) < entry->expires;
+}
+
+void cache_set_validators(const struct cache_entry *entry,
+			  struct http_request_info *info)
+{
+	info->if_none_match = entry->etag;
+	info->if_modified_since = entry->last_modified;
+}
+
+/* Parse a date in the preferred format of RFC 7231. Return 0 on failure. */
+static time_t parse_http_date(const char *s)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (!s || !strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return 0;
+	return timegm(&tm);
+}
+
+/*
+ * Return the time till which @resp, received at @now, is fresh, judging by
+ * Cache-Control and Expires headers, or 0 if it must be revalidated every
+ * time. Set @no_store if the response mustn't be cached at all.
+ */
+static time_t response_expires(const struct http_response *resp, time_t now,
+			       bool *no_store)
+{
+	const char *cc = http_response_header(resp, "Cache-Control");
+	long long max_age = -1, age = 0;
+	bool no_cache = false;
+	char *buf, *tok, *save;
+	time_t expires, date;
+
+	*no_store = false;
+
+	if (cc) {
+		buf = xstrdup(cc);
+		for (tok = strtok_r(buf, ",", &save); tok;
+		     tok = strtok_r(NULL, ",", &save)) {
+			tok = strstrip(tok);
+			if (strcasecmp(tok, "no-store") == 0)
+				*no_store = true;
+			else if (strcasecmp(tok, "no-cache") == 0)
+				no_cache = true;
+			else if (strncasecmp(tok, "max-age=", 8) == 0 &&
+				 !strict_strtoll(tok + 8, 10, &max_age))
+				no_cache = true;	/* be safe */
+		}
+		free(buf);
+	}
+
+	if (no_cache)
+		return 0;
+
+	if (max_age >= 0) {
+		const char *s = http_response_header(resp, "Age");
+
+		if (s && !strict_strtoll(s, 10, &age))
+			age = 0;
+		return max_age > age ? now + max_age - age : 0;
+	}
+
+	/* Expires is relative to the server clock, which may differ */
+	expires = parse_http_date(http_response_header(resp, "Expires"));
+	date = parse_http_date(http_response_header(resp, "Date"));
+	if (expires && date)
+		return expires > date ? now + (expires - date) : 0;
+	return expires > now ? expires : 0;
+}
+
+bool cache_storable(const struct http_response *resp)
+{
+	bool no_store;
+	time_t now = time(NULL);
+
+	if (resp->status != 200 || resp->ranged)
+		return false;
+	if (response_expires(resp, now, &no_store) > now && !no_store)
+		return true;
+	return !no_store && (http_response_header(resp, "ETag") ||
+			     http_response_header(resp, "Last-Modified"));
+}
+
+int cache_begin(struct cache_entry *entry)
+{
+	size_t size = strlen(entry->body_path) + 8;
+	int fd;
+
+	entry->tmp_path = xmalloc(size);
+	snprintf(entry->tmp_path, size, "%s.XXXXXX", entry->body_path);
+
+	fd = mkostemp(entry->tmp_path, O_CLOEXEC);
+	if (fd < 0) {
+		free(entry->tmp_path);
+		entry->tmp_path = NULL;
+	}
+	return fd;
+}
+
+bool cache_commit(struct cache_entry *entry,
+		  const struct http_response *resp, size_t size)
+{
+	const char *etag = http_response_header(resp, "ETag");
+	const char *last_modified = http_response_header(resp,
+							 "Last-Modified");
+	bool no_store;
+
+	entry->expires = response_expires(resp, time(NULL), &no_store);
+
+	if (resp->status == 304) {
+		/* The validators may be omitted if they didn't change */
+		if (etag)
+			set_str(&entry->etag, etag);
+		if (last_modified)
+			set_str(&entry->last_modified, last_modified);
+	} else {
+		set_str(&entry->etag, etag);
+		set_str(&entry->last_modified, last_modified);
+		entry->size = size;
+
+		if (rename(entry->tmp_path, entry->body_path) != 0)
+			return false;
+		free(entry->tmp_path);
+		entry->tmp_path = NULL;
+	}
+
+	if (!write_meta(entry))
+		return false;
+
+	entry->valid = true;
+	return true;
+}
+
+static bool copy_fd(int in, int out)
+{
+	char buf[COPY_BUF_SIZE];
+	ssize_t n, w;
+
+	while (1) {
+		n = read(in, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n == 0;
+		for (w = 0; w < n; ) {
+			ssize_t k = write(out, buf + w, n - w);
+
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k < 0)
+				return false;
+			w += k;
+		}
+	}
+}
+
+bool cache_copy_body(const struct cache_entry *entry, int fd)
+{
+	bool ok = true;
+	ssize_t n;
+	int in;
+
+	in = open(entry->tmp_path ? entry->tmp_path : entry->body_path,
+		  O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return false;
+
+	/* sendfile(2) copies in kernel and writes to anything since 2.6.33 */
+	while (1) {
+		n = sendfile(fd, in, NULL, COPY_BUF_SIZE * 16);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			ok = copy_fd(in, fd);
+			break;
+		}
+		if (n <= 0) {
+			ok = n == 0;
+			break;
+		}
+	}
+
+	close(in);
+	return ok;
+}
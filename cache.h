@@ -0,0 +1,137 @@
+/*
+ * Local cache of http responses.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "http.h"
+
+/*
+ * A cache is a directory holding two files per cached URL, named after
+ * a hash of the URL: the response body (.body) and its metadata (.meta),
+ * which are the URL itself, the validators, and the expiration time.
+ */
+struct cache_entry {
+	char *url;
+	char *etag;		/* %NULL if none */
+	char *last_modified;	/* %NULL if none */
+	time_t expires;		/* fresh until then; 0 to revalidate always */
+	size_t size;		/* body size */
+	bool valid;		/* there's a cached copy of the URL */
+
+	/* private */
+	char *body_path;
+	char *meta_path;
+	char *tmp_path;		/* body being stored */
+};
+
+/**
+ * cache_open - look up a URL in a cache
+ * @entry: the entry to initialize
+ * @dir: the cache directory
+ * @url: the URL
+ *
+ * Sets @entry->valid if there's a copy of @url in the cache. Either way,
+ * @entry may be used to store the URL and must be destroyed with
+ * cache_close().
+ */
+void cache_open(struct cache_entry *entry, const char *dir, const char *url);
+
+/**
+ * cache_close - destroy a cache entry
+ * @entry: the entry
+ *
+ * Removes the body being stored, unless cache_commit() has been called.
+ */
+void cache_close(struct cache_entry *entry);
+
+/**
+ * cache_abort - give up storing a response body
+ * @entry: the entry
+ *
+ * Removes the body being stored, if any, so that it isn't left behind in
+ * the cache directory. The entry must still be destroyed with cache_close().
+ */
+void cache_abort(struct cache_entry *entry);
+
+/**
+ * cache_fresh - check if a cached copy can be used without revalidation
+ * @entry: the entry
+ */
+bool cache_fresh(const struct cache_entry *entry);
+
+/**
+ * cache_set_validators - make a request conditional
+ * @entry: a valid entry
+ * @info: the request
+ *
+ * Sets If-None-Match and If-Modified-Since headers of @info from @entry,
+ * so that the server replies with 304 (Not Modified) if the cached copy is
+ * up to date. The strings belong to @entry.
+ */
+void cache_set_validators(const struct cache_entry *entry,
+			  struct http_request_info *info);
+
+/**
+ * cache_storable - check if a response may be cached
+ * @resp: the response
+ *
+ * Only complete 200 (OK) responses that either have a validator or are
+ * fresh for a while, and not marked `no-store', are cached.
+ */
+bool cache_storable(const struct http_response *resp);
+
+/**
+ * cache_begin - start storing a response body
+ * @entry: the entry
+ *
+ * Returns a file descriptor to write the body to, or -1 on failure, in which
+ * case errno is set. The file is put in place by cache_commit().
+ */
+int cache_begin(struct cache_entry *entry);
+
+/**
+ * cache_commit - finish storing a response
+ * @entry: the entry
+ * @resp: the response, either the one whose body has been stored, or
+ *        a 304 (Not Modified) one refreshing a valid entry
+ * @size: the body size; ignored for 304 responses
+ *
+ * Returns %true on success. On failure returns %false and sets errno.
+ */
+bool cache_commit(struct cache_entry *entry,
+		  const struct http_response *resp, size_t size);
+
+/**
+ * cache_copy_body - copy a cached body to a file
+ * @entry: a valid entry, or one whose body is being stored
+ * @fd: the file descriptor to write to
+ *
+ * If cache_begin() has been called, copies the body stored so far, so that
+ * it can be done before cache_commit(), which may fail.
+ *
+ * Returns %true on success. On failure returns %false and sets errno.
+ */
+bool cache_copy_body(const struct cache_entry *entry, int fd);
+
+#endif /* _CACHE_H */
@@ -17,9 +17,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE		/* for splice() */
+
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,19 +37,79 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "util.h"
 #include "base64.h"
 #include "url.h"
 #include "http.h"
+#include "uring.h"
+#include "scan.h"
+#include "resolv.h"
 
 #define HTTP_PORT		80
 
 #define HTTP_LINE_MAX		2048
 
-#define BUF_SIZE		4096
+#define BUF_SIZE		16384
+
+/* Size of the buffer for compressed data, see struct http_decoder */
+#define DECODER_BUF_SIZE	16384
+
+/* Size of the pipe used for splicing response body to a file */
+#define SPLICE_PIPE_SIZE	(1 << 20)
+
+/* Initial size of http_response::headers */
+#define HEADERS_SIZE_MIN	512
+
+/*
+ * Size of http_response::arena chunks. Should be enough for the request and
+ * the response head, so that a request makes a single allocation.
+ */
+#define RESPONSE_ARENA_SIZE	4096
+
+/* Max number of receive-write pairs submitted to io_uring at once */
+#define URING_CHAIN_MAX		16
+
+/*
+ * Happy Eyeballs (RFC 8305): delay between starting connection attempts to
+ * different addresses, in ms.
+ */
+#define CONNECT_ATTEMPT_DELAY	250
+
+/* Max number of connection attempts in flight */
+#define CONNECT_ATTEMPTS_MAX	8
+
+/*
+ * Delay before resuming a failed transfer, in ms. Doubles with each attempt
+ * in a row, up to RETRY_DELAY_MAX. The actual delay is picked at random
+ * between a half and the whole of it, so that clients that failed at once
+ * don't come back at once.
+ */
+#define RETRY_DELAY		500
+#define RETRY_DELAY_MAX		30000
+
+/*
+ * Min interval between samples of the tcp state taken to autotune the receive
+ * buffer, in us, see tune_rcvbuf().
+ */
+#define TUNE_INTERVAL		100000
+
+/* Max receive buffer size autotuning may ask for */
+#define TUNE_RCVBUF_MAX		(256 << 20)
+
+/* Max number of idle connections kept open for reuse */
+#define POOL_MAX		16
+
+/*
+ * Max number of bytes we are ready to read and throw away in order to reuse
+ * a connection. Establishing a new connection is cheaper than that.
+ */
+#define DRAIN_MAX		65536
 
 /* Helpers for working with http_connection::buf */
 #define BUF_BEGIN(conn)		((conn)->buf + (conn)->buf_begin)
@@ -49,28 +117,52 @@
 #define BUF_USED(conn)		((conn)->buf_end - (conn)->buf_begin)
 #define BUF_LEFT(conn)		(BUF_SIZE - (conn)->buf_end)
 
+/* Chunked body decoder states, see chunked_read() */
+enum {
+	CHUNK_SIZE,		/* expecting chunk size line */
+	CHUNK_DATA,		/* reading chunk data */
+	CHUNK_CRLF,		/* expecting CRLF terminating chunk data */
+	CHUNK_TRAILER,		/* skipping trailer headers */
+	CHUNK_END,		/* done */
+};
+
+/* Request phases, see http_connection::phase */
+enum {
+	PHASE_SEND,		/* sending the request */
+	PHASE_HEAD,		/* receiving the response head */
+	PHASE_BODY,		/* receiving the response body */
+};
+
+static const char *phase_names[] = {
+	[PHASE_SEND]	= "sending request",
+	[PHASE_HEAD]	= "receiving response head",
+	[PHASE_BODY]	= "receiving response body",
+};
+
 http_dump_fn_t http_dump_fn;
 
-static void dump(const char *fmt, ...)
+/*
+ * Pass debug information on the request @resp is for to its trace hook, or
+ * to http_dump_fn if it has none.
+ */
+static void dump(const struct http_response *resp, const char *fmt, ...)
 {
-	if (http_dump_fn) {
-		va_list ap;
+	va_list ap;
 
-		va_start(ap, fmt);
+	va_start(ap, fmt);
+	if (resp->trace)
+		resp->trace(resp->trace_arg, fmt, ap);
+	else if (http_dump_fn)
 		http_dump_fn(fmt, ap);
-		va_end(ap);
-	}
+	va_end(ap);
 }
 
 /*
  * The last raised error is stored here, see http_last_error() and
- * set_last_error().
- *
- * XXX: This variable is not thread-safe! Consider making it TLS if we ever
- * need multi-threading.
+ * set_last_error(). Each thread has its own copy.
  */
 #define LAST_ERROR_MAX		256
-static char last_error[LAST_ERROR_MAX];
+static __thread char last_error[LAST_ERROR_MAX];
 
 static void set_last_error(const char *fmt, ...)
 {
@@ -85,8 +177,7 @@ static void set_last_error_errno(int err, const char *msg)
 {
 	char buf[64];
 
-	strerror_r(err, buf, sizeof(buf));
-	set_last_error("%s: %s", msg, buf);
+	set_last_error("%s: %s", msg, strerror_r(err, buf, sizeof(buf)));
 }
 
 const char *http_last_error(void)
@@ -94,919 +185,3322 @@ const char *http_last_error(void)
 	return last_error;
 }
 
-static void dump_addrinfo(struct addrinfo *ai)
+/*
+ * getaddrinfo() stores the canonical name in the first entry only, so it is
+ * passed separately as @name.
+ */
+static void dump_addrinfo(const struct http_response *resp,
+			  const char *name, struct addrinfo *ai)
 {
 	char addr[128];
 	int port;
 
-	dump("%s", ai->ai_canonname);
+	dump(resp, "%s", name);
 	if (addrinfo_addr_port(ai, addr, sizeof(addr), &port))
-		dump(" (%s) port %d", addr, port);
+		dump(resp, " (%s) port %d", addr, port);
 }
 
-static void init_response(struct http_response *resp)
+static void init_connection(struct http_connection *conn)
 {
-	struct http_connection *conn = &resp->conn;
+	memset(conn, 0, sizeof(*conn));
+	conn->sockfd = -1;
+}
 
-	memset(resp, 0, sizeof(*resp));
+/*
+ * Return the response @conn is used for. A connection that serves a request
+ * is always embedded in the response.
+ */
+static struct http_response *conn_response(struct http_connection *conn)
+{
+	return container_of(conn, struct http_response, conn);
+}
 
-	conn->sockfd = -1;
-	conn->buf = xmalloc(BUF_SIZE);
+static struct http_stats *conn_stats(struct http_connection *conn)
+{
+	return &conn_response(conn)->stats;
 }
 
-static void destroy_response(struct http_response *resp)
+static void destroy_template(struct http_template *t)
 {
-	struct http_connection *conn = &resp->conn;
+	free(t->data);
+	free(t->host);
+	free(t->creds);
+	memset(t, 0, sizeof(*t));
+}
 
+static void close_connection(struct http_connection *conn)
+{
 	if (conn->sockfd >= 0)
 		close(conn->sockfd);
 	free(conn->buf);
+	free(conn->host);
+	destroy_template(&conn->tmpl);
 
-	free(resp->reason);
-	url_free(resp->location);
+	init_connection(conn);
 }
 
 /*
- * Try to establish a tcp connection to be used for http session.
- * Return %true and set conn->sockfd on success.
+ * Idle keep-alive connections, the most recently used last. When the pool is
+ * full, the oldest connection is closed to make room for a new one.
+ *
+ * The pool is shared by all threads and protected by @pool_lock.
  */
-static bool do_connect(const char *host, int port,
-		       struct http_connection *conn)
+static struct http_connection pool[POOL_MAX];
+static int pool_size;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Check that an idle connection hasn't been closed by the server. There must
+ * be nothing to read from an idle connection, neither data nor EOF.
+ */
+static bool connection_alive(struct http_connection *conn)
 {
-	struct addrinfo ai_hint;
-	struct addrinfo *ai_result, *ai;
-	char port_str[16];
-	int sockfd;
-	int err;
+	ssize_t n;
+	char c;
 
-	memset(&ai_hint, 0, sizeof(ai_hint));
-	ai_hint.ai_flags = AI_CANONNAME;
-	ai_hint.ai_family = AF_UNSPEC;
-	ai_hint.ai_socktype = SOCK_STREAM;
+	n = recv(conn->sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
 
-	snprintf(port_str, sizeof(port_str), "%d",
-		 port >= 0 ? port : HTTP_PORT);
+static void pool_remove(int i)
+{
+	assert(i >= 0 && i < pool_size);
 
-	err = getaddrinfo(host, port_str, &ai_hint, &ai_result);
-	if (err) {
-		set_last_error("Failed to translate address: %s",
-			       gai_strerror(err));
-		return false;
-	}
+	pool_size--;
+	memmove(&pool[i], &pool[i + 1], (pool_size - i) * sizeof(*pool));
+}
 
-	for (ai = ai_result; ai; ai = ai->ai_next) {
-		sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (sockfd < 0) {
-			err = errno;
-			continue;
-		}
+/*
+ * Move @conn to the pool. @conn is reinitialized.
+ */
+static void pool_put(struct http_connection *conn)
+{
+	assert(conn->sockfd >= 0);
+	assert(!BUF_USED(conn));
 
-		dump("Connecting to ");
-		dump_addrinfo(ai);
-		dump("\n");
+	pthread_mutex_lock(&pool_lock);
 
-		if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0)
-			break;
-		err = errno;
-		close(sockfd);
+	if (pool_size == POOL_MAX) {
+		close_connection(&pool[0]);
+		pool_remove(0);
 	}
 
-	freeaddrinfo(ai_result);
+	pool[pool_size] = *conn;
+	pool[pool_size].buf_begin = pool[pool_size].buf_end = 0;
+	pool[pool_size].reused = false;
+	pool[pool_size].timed = false;	/* set by the next user */
+	pool[pool_size].stall_start = 0;
+	pool[pool_size].first_byte_deadline = 0;
+	pool_size++;
 
-	if (!ai) {
-		set_last_error_errno(err, "Failed to connect");
-		return false;
-	}
+	pthread_mutex_unlock(&pool_lock);
 
-	conn->sockfd = sockfd;
-	return true;
+	init_connection(conn);
 }
 
 /*
- * Wrapper around send(2). Sends exactly @len bytes from @buf on success. On
- * failure, sets @last_error and the @conn->failed flag. If the flag is already
- * set, does nothing.
+ * Look up an idle connection to @host:@port in the pool. On success, return
+ * %true and move the connection to @conn.
  */
-static void do_send(struct http_connection *conn, const char *buf, size_t len)
+static bool pool_get(const char *host, int port, struct http_connection *conn)
 {
-	while (!conn->failed && len > 0) {
-		ssize_t n;
+	bool found = false;
+	int i;
 
-		n = send(conn->sockfd, buf, len,
-			 MSG_NOSIGNAL);	/* don't want to die from SIGPIPE */
-		if (n >= 0) {
-			assert(n > 0);
-			assert(n <= len);
-			buf += n;
-			len -= n;
-		} else {
-			set_last_error_errno(errno, "Send failed");
-			conn->failed = true;
-		}
+	pthread_mutex_lock(&pool_lock);
+	for (i = pool_size - 1; i >= 0 && !found; i--) {
+		if (pool[i].port != port || strcasecmp(pool[i].host, host) != 0)
+			continue;
+
+		*conn = pool[i];
+		pool_remove(i);
+
+		if (connection_alive(conn)) {
+			conn->reused = true;
+			found = true;
+		} else
+			close_connection(conn);
 	}
+	pthread_mutex_unlock(&pool_lock);
+
+	return found;
+}
+
+void http_pool_flush(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	while (pool_size > 0) {
+		close_connection(&pool[pool_size - 1]);
+		pool_remove(pool_size - 1);
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static void init_response(struct http_response *resp,
+			  const struct http_request_info *info)
+{
+	memset(resp, 0, sizeof(*resp));
+	init_connection(&resp->conn);
+	arena_init(&resp->arena, RESPONSE_ARENA_SIZE);
+	resp->splice_pipe[0] = resp->splice_pipe[1] = -1;
+	resp->record = info->record;
+	resp->trace = info->trace;
+	resp->trace_arg = info->trace_arg;
+	resp->stats.timing.start = now_us();
 }
 
 /*
- * Wrapper around recv(2). Receives @len bytes at max and stores them in @buf.
- * Returns the number of bytes received, which can be less than @len. On EOF
- * returns 0. On failure, sets @last_error and the @conn->failed flag. If the
- * flag is already set, does nothing. If @exact is set, this function will keep
- * looping until it receives exactly @len bytes.
+ * Return %true if the connection used by @resp may be reused for another
+ * request, i.e. the server agreed to keep it open and the whole response
+ * has been read.
  */
-static size_t do_recv(struct http_connection *conn, char *buf, size_t len,
-		      bool exact)
+static bool response_done(struct http_response *resp)
 {
-	size_t ret = 0;
+	struct http_connection *conn = &resp->conn;
 
-	while (!conn->failed && len > 0) {
-		ssize_t n;
+	if (conn->sockfd < 0 || conn->failed || !resp->keep_alive)
+		return false;
 
-		n = recv(conn->sockfd, buf, len, 0);
-		if (n > 0) {
-			assert(n <= len);
-			buf += n;
-			len -= n;
-			ret += n;
-		} else if (n < 0) {
-			set_last_error_errno(errno, "Receive failed");
-			conn->failed = true;
-		} else
-			break; /* EOF */
-		if (!exact)
-			break;
-	}
-	return ret;
+	if (BUF_USED(conn))
+		return false;	/* got something beyond the response */
+
+	if (resp->chunked)
+		return resp->chunk_state == CHUNK_END;
+
+	assert(resp->sized);
+	return resp->body_read == resp->body_size;
 }
 
-/*
- * Copy content of @buf to @conn->buf, max @len bytes.
- * Return the number of bytes actually copied.
- */
-static size_t copy_to_buffer(struct http_connection *conn,
-			     const char *buf, size_t len)
+static void destroy_response(struct http_response *resp)
 {
-	size_t n;
+	struct http_connection *conn = &resp->conn;
 
-	assert(conn->buf_end <= BUF_SIZE);
+	/* Give back what was read ahead of the end of the response */
+	if (conn->replay)
+		conn->replay->pos -= BUF_USED(conn);
 
-	n = min(BUF_LEFT(conn), len);
-	if (n) {
-		memcpy(BUF_END(conn), buf, n);
-		conn->buf_end += n;
+	if (response_done(resp))
+		pool_put(conn);
+	else
+		close_connection(conn);
+
+	if (resp->splice_pipe[0] >= 0) {
+		close(resp->splice_pipe[0]);
+		close(resp->splice_pipe[1]);
 	}
-	return n;
+
+	arena_destroy(&resp->arena);
 }
 
 /*
- * Copy content of @conn->buf to @buf, max @len bytes.
- * Return the number of bytes actually copied.
+ * Translate @host:@port to a list of addresses to connect to, see
+ * resolv_lookup(). Return %NULL on failure. The entry must be released
+ * with resolv_put().
  */
-static size_t copy_from_buffer(struct http_connection *conn,
-			       char *buf, size_t len)
+static struct resolv_entry *resolve(const char *host, int port)
 {
-	size_t n;
+	struct resolv_entry *entry;
 
-	assert(conn->buf_begin <= conn->buf_end);
-	assert(conn->buf_end <= BUF_SIZE);
-
-	n = min(BUF_USED(conn), len);
-	if (n) {
-		memcpy(buf, BUF_BEGIN(conn), n);
-		conn->buf_begin += n;
+	entry = resolv_lookup(host, port);
+	if (!entry->ai) {
+		set_last_error("Failed to translate address: %s",
+			       gai_strerror(entry->err));
+		resolv_put(entry);
+		return NULL;
 	}
-	return n;
+	return entry;
+}
+
+void http_prefetch_host(const char *host, int port)
+{
+	resolv_prefetch(host, port >= 0 ? port : HTTP_PORT);
 }
 
 /*
- * Send content of @conn->buf to the server.
+ * Return the addresses of @list in an array, ordered so that address
+ * families alternate, starting with the family of the first address, as
+ * recommended by RFC 8305. Addresses of the same family keep their relative
+ * order. Store the number of addresses in @nr. The array must be freed by
+ * the caller.
  */
-static void flush_buffer(struct http_connection *conn)
+static struct addrinfo **interleave_families(struct addrinfo *list, int *nr)
 {
-	assert(conn->buf_begin <= conn->buf_end);
-	assert(conn->buf_end <= BUF_SIZE);
+	struct addrinfo **order, **tmp;
+	struct addrinfo *ai;
+	int n = 0, i, j, k, split;
+
+	for (ai = list; ai; ai = ai->ai_next)
+		n++;
+	order = xmalloc(sizeof(*order) * n);
+	tmp = xmalloc(sizeof(*tmp) * n);
+
+	/* the first family goes first, the rest follow */
+	i = 0;
+	for (ai = list; ai; ai = ai->ai_next)
+		if (ai->ai_family == list->ai_family)
+			tmp[i++] = ai;
+	split = i;
+	for (ai = list; ai; ai = ai->ai_next)
+		if (ai->ai_family != list->ai_family)
+			tmp[i++] = ai;
+
+	for (i = 0, j = split, k = 0; k < n; ) {
+		if (i < split)
+			order[k++] = tmp[i++];
+		if (j < n)
+			order[k++] = tmp[j++];
+	}
 
-	do_send(conn, BUF_BEGIN(conn), BUF_USED(conn));
-	conn->buf_begin = conn->buf_end = 0;
+	free(tmp);
+	*nr = n;
+	return order;
 }
 
 /*
- * Read data from socket and append them to @conn->buf.
- * Return the number of bytes read.
+ * Apply @opts to a new socket. None of the options is essential, so failing
+ * to set any of them is only reported with dump().
  */
-static size_t refill_buffer(struct http_connection *conn)
+static void tune_socket(const struct http_response *resp, int sockfd,
+			const struct http_sockopts *opts)
 {
-	size_t n;
-
-	assert(conn->buf_begin <= conn->buf_end);
-	assert(conn->buf_end <= BUF_SIZE);
-
-	if (!BUF_USED(conn))
-		conn->buf_begin = conn->buf_end = 0;
-
-	n = do_recv(conn, BUF_END(conn), BUF_LEFT(conn), false);
-	conn->buf_end += n;
-	return n;
+	char buf[64];
+	int one = 1;
+
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY,
+		       &one, sizeof(one)) < 0)
+		dump(resp, "Failed to set TCP_NODELAY: %s\n",
+		     strerror_r(errno, buf, sizeof(buf)));
+	if (opts->rcvbuf > 0 &&
+	    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+		       &opts->rcvbuf, sizeof(opts->rcvbuf)) < 0)
+		dump(resp, "Failed to set SO_RCVBUF: %s\n",
+		     strerror_r(errno, buf, sizeof(buf)));
+	/*
+	 * With this option, connect() returns at once if there's a Fast Open
+	 * cookie for the server, and the SYN goes out along with the request
+	 * on the first send(). Otherwise, it connects as usual, asking the
+	 * server for a cookie.
+	 */
+	if (opts->fast_open &&
+	    setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+		       &one, sizeof(one)) < 0)
+		dump(resp, "Failed to set TCP_FASTOPEN_CONNECT: %s\n",
+		     strerror_r(errno, buf, sizeof(buf)));
 }
 
 /*
- * Buffered send. Appends content of @buf to @conn->buf until the latter is
- * full, then sends the whole buffer.
+ * Start a non-blocking connection attempt to @ai, an address of host @name,
+ * tuning the socket according to @opts. Return the socket, or -1
+ * with *@err set if the attempt failed right away. Set *@done if connect()
+ * completed immediately, as it may for loopback or with TCP Fast Open.
  */
-static void buffered_send(struct http_connection *conn,
-			  const char *buf, size_t len)
+static int start_connect(const struct http_response *resp,
+			 const char *name, struct addrinfo *ai,
+			 const struct http_sockopts *opts,
+			 int *err, bool *done)
 {
-	while (!conn->failed && len > 0) {
-		size_t n;
+	int sockfd;
 
-		n = copy_to_buffer(conn, buf, len);
-		if (!n) {
-			flush_buffer(conn);
-			continue;
-		}
-		buf += n;
-		len -= n;
+	sockfd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+			ai->ai_protocol);
+	if (sockfd < 0) {
+		*err = errno;
+		return -1;
+	}
+	tune_socket(resp, sockfd, opts);
+
+	dump(resp, "Connecting to ");
+	dump_addrinfo(resp, name, ai);
+	dump(resp, "\n");
+
+	*done = false;
+	if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) == 0) {
+		*done = true;
+		return sockfd;
 	}
+	if (errno == EINPROGRESS)
+		return sockfd;
+
+	*err = errno;
+	close(sockfd);
+	return -1;
 }
 
 /*
- * Buffered recv. Well, it's not really buffered. The only difference of this
- * method from do_recv() is that it first copies data from @conn->buf if the
- * latter is not empty and only then proceeds to reading from socket.
- *
- * This function returns the number of copied to @buf, which can be less than
- * @len only if the connection was closed or an error occurred.
+ * Try to establish a tcp connection to be used for http session, giving
+ * each attempt @attempt_timeout ms, unless it's 0, and tuning the socket
+ * according to @opts.
+ * Return %true and set conn->sockfd on success.
  *
- * This method is needed for reading response data, because we can't just use
- * do_recv() for the purpose as there might be some data left in the buffer
- * after receiving headers.
+ * Rather than waiting for each address to fail in turn, which may take
+ * a full kernel connect timeout for an unreachable one, start attempts
+ * CONNECT_ATTEMPT_DELAY apart, or as soon as the previous one fails, and
+ * race them (RFC 8305). The first connection established wins, the rest
+ * are closed.
  */
-static size_t buffered_recv(struct http_connection *conn, char *buf, size_t len)
+static bool do_connect(const char *host, int port, int attempt_timeout,
+		       const struct http_sockopts *opts,
+		       struct http_connection *conn)
 {
-	size_t ret = 0;
+	struct resolv_entry *addrs;
+	struct addrinfo *ai_result, **order, *winner = NULL;
+	struct addrinfo *attempt_ai[CONNECT_ATTEMPTS_MAX];
+	struct pollfd pfd[CONNECT_ATTEMPTS_MAX];
+	int64_t deadline[CONNECT_ATTEMPTS_MAX];
+	int64_t now, next_start, timeout;
+	int nr_addrs, next = 0, nr = 0;
+	int sockfd = -1, fd;
+	int err = 0, sock_err, flags, i;
+	socklen_t len;
+	bool done;
+
+	addrs = resolve(host, port);
+	if (!addrs)
+		return false;
+	conn_stats(conn)->timing.resolved = now_us();
+
+	ai_result = addrs->ai;
+	order = interleave_families(ai_result, &nr_addrs);
+
+	next_start = now_ms();
+	while (sockfd < 0) {
+		now = now_ms();
+
+		if (next < nr_addrs && nr < CONNECT_ATTEMPTS_MAX &&
+		    now >= next_start) {
+			fd = start_connect(conn_response(conn),
+					   ai_result->ai_canonname, order[next],
+					   opts, &err, &done);
+			if (fd >= 0 && done) {
+				sockfd = fd;
+				winner = order[next];
+				break;
+			}
+			if (fd >= 0) {
+				attempt_ai[nr] = order[next];
+				pfd[nr].fd = fd;
+				pfd[nr].events = POLLOUT;
+				deadline[nr] = attempt_timeout ?
+					now + attempt_timeout : INT64_MAX;
+				nr++;
+				next_start = now + CONNECT_ATTEMPT_DELAY;
+			}
+			next++;
+			continue;
+		}
 
-	/* First, copy from the buffer if it's not empty */
-	if (BUF_USED(conn)) {
-		ret = copy_from_buffer(conn, buf, len);
-		buf += ret;
-		len -= ret;
-	}
+		if (!nr) {
+			if (next >= nr_addrs)
+				break;	/* all attempts failed */
+			next_start = now;
+			continue;
+		}
 
-	/* Still want more? */
-	if (len > 0)
-		ret += do_recv(conn, buf, len, true);
+		timeout = deadline[0];
+		for (i = 1; i < nr; i++)
+			timeout = min(timeout, deadline[i]);
+		if (next < nr_addrs && nr < CONNECT_ATTEMPTS_MAX)
+			timeout = min(timeout, next_start);
+		timeout = timeout == INT64_MAX ? -1 :
+			max(timeout - now, (int64_t)0);
+
+		if (poll(pfd, nr, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
 
-	return ret;
-}
+		now = now_ms();
+		for (i = nr - 1; i >= 0 && sockfd < 0; i--) {
+			if (pfd[i].revents) {
+				len = sizeof(sock_err);
+				if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR,
+					       &sock_err, &len) < 0)
+					sock_err = errno;
+				if (!sock_err) {
+					sockfd = pfd[i].fd;
+					winner = attempt_ai[i];
+				} else
+					err = sock_err;
+			} else if (now >= deadline[i])
+				err = ETIMEDOUT;
+			else
+				continue;
+
+			if (sockfd < 0)
+				close(pfd[i].fd);
+
+			/* the attempt is over, start the next one right away */
+			nr--;
+			pfd[i] = pfd[nr];
+			deadline[i] = deadline[nr];
+			attempt_ai[i] = attempt_ai[nr];
+			next_start = now;
+		}
+	}
 
-static void send_str(struct http_connection *conn, const char *str)
-{
-	buffered_send(conn, str, strlen(str));
-}
+	/* Abandon the attempts that lost the race */
+	for (i = 0; i < nr; i++)
+		close(pfd[i].fd);
 
-static void send_line(struct http_connection *conn, const char *str, ...)
-{
-	va_list ap;
+	if (sockfd >= 0) {
+		dump(conn_response(conn), "Connected to ");
+		dump_addrinfo(conn_response(conn),
+			      ai_result->ai_canonname, winner);
+		dump(conn_response(conn), "\n");
+	}
 
-	dump("> ");
+	free(order);
+	resolv_put(addrs);
 
-	va_start(ap, str);
-	while (str) {
-		dump("%s", str);
-		send_str(conn, str);
-		str = va_arg(ap, const char *);
+	if (sockfd < 0) {
+		set_last_error_errno(err, "Failed to connect");
+		return false;
 	}
-	va_end(ap);
 
-	dump("\n");
-	send_str(conn, "\r\n");
-}
+	/* Blocking requests expect a blocking socket */
+	flags = fcntl(sockfd, F_GETFL);
+	if (flags < 0 || fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		set_last_error_errno(errno, "Failed to set socket flags");
+		close(sockfd);
+		return false;
+	}
 
-static void send_header(struct http_connection *conn,
-			const char *field, const char *value)
-{
-	send_line(conn, field, ": ", value, NULL);
+	conn->sockfd = sockfd;
+	return true;
 }
 
-static void send_range_header(struct http_connection *conn,
-			      size_t first, size_t last)
+/*
+ * Initialize a newly established connection to @host:@port.
+ */
+static void note_connected(struct http_connection *conn)
 {
-	char buf[32];
-
-	if (last != SIZE_MAX)
-		snprintf(buf, sizeof(buf), "bytes=%zu-%zu", first, last);
-	else
-		snprintf(buf, sizeof(buf), "bytes=%zu-", first);
+	struct http_timing *t = &conn_stats(conn)->timing;
 
-	send_header(conn, "Range", buf);
+	t->connected = now_us();
+	t->reused = conn->reused;
 }
 
-static void send_host_header(struct http_connection *conn,
+/*
+ * Initialize a newly established connection.
+ */
+static void setup_connection(struct http_connection *conn,
 			     const char *host, int port)
 {
-	char buf[16] = "";
+	conn->buf = xmalloc(BUF_SIZE);
+	conn->host = xstrdup(host);
+	conn->port = port;
+	note_connected(conn);
+}
+
+/*
+ * Try to take a connection to @host:@port from the pool of idle connections.
+ * Return %true on success.
+ */
+static bool reuse_connection(const char *host, int port,
+			     struct http_connection *conn)
+{
+	if (!pool_get(host, port, conn))
+		return false;
+
+	note_connected(conn);
+	dump(conn_response(conn), "Reusing connection to %s:%d\n",
+	     host, port);
+	return true;
+}
+
+/*
+ * Get a connection to @host:@port, either from the pool of idle connections
+ * or by establishing a new one. Return %true on success.
+ */
+static bool open_connection(const char *host, int port,
+			    const struct http_timeouts *timeouts,
+			    const struct http_sockopts *sockopts,
+			    struct http_connection *conn)
+{
+	if (port < 0)
+		port = HTTP_PORT;
+
+	if (!reuse_connection(host, port, conn)) {
+		if (!do_connect(host, port, timeouts->connect, sockopts, conn))
+			return false;
+		setup_connection(conn, host, port);
+	}
+
+	conn->sockopts = *sockopts;
+
+	conn->timeouts = *timeouts;
+	conn->timed = timeouts->first_byte || timeouts->idle ||
+		timeouts->stall_time;
+	conn->phase = PHASE_SEND;
+	conn->first_byte_deadline = 0;
+	conn->stall_start = 0;
+	return true;
+}
+
+/*
+ * Mark @conn as failed due to a timeout.
+ */
+static void timed_out(struct http_connection *conn)
+{
+	conn->failed = true;
+	conn->timed_out = true;
+}
+
+/*
+ * Check the throughput over the current stall detection window, if it is
+ * over, and start a new one. Return %false and fail @conn if the transfer
+ * has stalled.
+ */
+static bool check_stall(struct http_connection *conn, int64_t now)
+{
+	const struct http_timeouts *t = &conn->timeouts;
+	int64_t elapsed = now - conn->stall_start;
+
+	if (elapsed < t->stall_time)
+		return true;
+
+	if ((uint64_t)conn->stall_bytes * 1000 <
+	    (uint64_t)t->min_speed * elapsed) {
+		set_last_error("Transfer stalled: %zu bytes received "
+			       "in %lld ms, less than %zu bytes/s",
+			       conn->stall_bytes, (long long)elapsed,
+			       t->min_speed);
+		timed_out(conn);
+		return false;
+	}
+
+	conn->stall_start = now;
+	conn->stall_bytes = 0;
+	return true;
+}
+
+/*
+ * Sample the tcp state of @conn to its stats at @now, in us. Return %false if
+ * it couldn't be sampled, e.g. because the response is replayed.
+ */
+static bool sample_tcp(struct http_connection *conn, int64_t now)
+{
+	struct http_tcp_stats *tcp = &conn_stats(conn)->tcp;
+	int64_t elapsed = now - conn->tune_time;
+	struct tcp_info ti;
+	socklen_t len;
+	int rcvbuf;
+
+	len = sizeof(ti);
+	if (conn->sockfd < 0 ||
+	    getsockopt(conn->sockfd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+		return false;
+
+	tcp->rtt = ti.tcpi_rtt;
+	tcp->rcv_rtt = ti.tcpi_rcv_rtt;
+	tcp->snd_cwnd = ti.tcpi_snd_cwnd;
+	tcp->fast_open = ti.tcpi_options & TCPI_OPT_SYN_DATA;
+	if (conn->tune_time && elapsed > 0) {
+		tcp->rate = (uint64_t)conn->tune_bytes * 1000000 / elapsed;
+		tcp->bdp = (uint64_t)tcp->rate *
+			(tcp->rtt ? tcp->rtt : tcp->rcv_rtt) / 1000000;
+	}
+
+	len = sizeof(rcvbuf);
+	if (getsockopt(conn->sockfd, SOL_SOCKET, SO_RCVBUF,
+		       &rcvbuf, &len) == 0)
+		tcp->rcvbuf = rcvbuf;
+
+	conn->tune_time = now;
+	conn->tune_bytes = 0;
+	return true;
+}
+
+/*
+ * Grow the receive buffer of @conn so that the tcp window may reach twice
+ * the bandwidth-delay product measured since the previous call. While the
+ * window is what limits the transfer, the measured product follows it, so
+ * the buffer keeps doubling until the link becomes the limit. Like the
+ * kernel's own autotuning, this never shrinks the buffer.
+ *
+ * The round trip time measured by the sending side is preferred, because
+ * the receiving side overestimates it when the server doesn't keep up.
+ */
+static void tune_rcvbuf(struct http_connection *conn, int64_t now)
+{
+	struct http_tcp_stats *tcp = &conn_stats(conn)->tcp;
+	socklen_t len = sizeof(int);
+	int size, actual;
+	char buf[64];
+
+	if (conn->tune_capped || !sample_tcp(conn, now))
+		return;
+
+	/*
+	 * The kernel doubles the size set with SO_RCVBUF to account for
+	 * overhead, and about a half of the buffer goes to the window.
+	 */
+	size = min(2 * tcp->bdp, (size_t)TUNE_RCVBUF_MAX);
+	if (size <= tcp->rcvbuf / 2)
+		return;
+
+	if (setsockopt(conn->sockfd, SOL_SOCKET, SO_RCVBUF,
+		       &size, sizeof(size)) < 0 ||
+	    getsockopt(conn->sockfd, SOL_SOCKET, SO_RCVBUF,
+		       &actual, &len) < 0) {
+		dump(conn_response(conn), "Failed to set SO_RCVBUF: %s\n",
+		     strerror_r(errno, buf, sizeof(buf)));
+		conn->tune_capped = true;
+		return;
+	}
+	dump(conn_response(conn), "Receive buffer set to %d bytes for "
+	     "%zu bytes/s, rtt %u us\n", actual / 2, tcp->rate,
+	     tcp->rtt ? tcp->rtt : tcp->rcv_rtt);
+
+	/* Capped by net.core.rmem_max, no use trying again */
+	if (actual / 2 < size) {
+		dump(conn_response(conn), "Receive buffer capped "
+		     "by net.core.rmem_max\n");
+		conn->tune_capped = true;
+	}
+}
+
+/*
+ * Account for @len bytes received on @conn. Return %false and fail @conn if
+ * the transfer has stalled.
+ */
+static bool note_recv(struct http_connection *conn, size_t len)
+{
+	struct http_stats *stats = conn_stats(conn);
+	int64_t now;
+	int one = 1;
+
+	stats->bytes_received += len;
+	stats->recv_calls++;
+	if (!stats->timing.first_byte)
+		stats->timing.first_byte = now_us();
+
+	conn->tune_bytes += len;
+	/* The kernel leaves quick ack mode on its own, so renew it */
+	if (conn->sockopts.quickack && conn->sockfd >= 0)
+		setsockopt(conn->sockfd, IPPROTO_TCP, TCP_QUICKACK,
+			   &one, sizeof(one));
+	if (conn->sockopts.autotune && conn->tune_time) {
+		now = now_us();
+		if (now - conn->tune_time >= TUNE_INTERVAL)
+			tune_rcvbuf(conn, now);
+	}
+
+	conn->first_byte_deadline = 0;
+	if (!conn->stall_start)
+		return true;
+	conn->stall_bytes += len;
+	return check_stall(conn, now_ms());
+}
+
+/*
+ * Wait until @conn->sockfd is ready for @events, but no longer than the
+ * request timeouts allow. Return %true if it is ready. Otherwise set
+ * @last_error, telling which phase timed out, fail @conn, and return %false.
+ */
+static bool wait_socket(struct http_connection *conn, short events)
+{
+	const struct http_timeouts *t = &conn->timeouts;
+	struct pollfd pfd = {
+		.fd		= conn->sockfd,
+		.events		= events,
+	};
+	int64_t now = now_ms();
+	int64_t idle_deadline = t->idle ? now + t->idle : INT64_MAX;
+	int64_t deadline;
+	int ret;
+
+	while (1) {
+		deadline = idle_deadline;
+		if (conn->first_byte_deadline)
+			deadline = min(deadline, conn->first_byte_deadline);
+		if (conn->stall_start)
+			deadline = min(deadline,
+				       conn->stall_start + t->stall_time);
+
+		ret = poll(&pfd, 1, deadline == INT64_MAX ? -1 :
+			   max(deadline - now, (int64_t)0));
+		if (ret > 0)
+			return true;
+		if (ret < 0 && errno != EINTR) {
+			set_last_error_errno(errno, "Poll failed");
+			conn->failed = true;
+			return false;
+		}
+
+		now = now_ms();
+		if (conn->first_byte_deadline &&
+		    now >= conn->first_byte_deadline) {
+			set_last_error("Timed out waiting for response: "
+				       "no reply in %d ms", t->first_byte);
+			timed_out(conn);
+			return false;
+		}
+		if (now >= idle_deadline) {
+			set_last_error("Timed out %s: idle for %d ms",
+				       phase_names[conn->phase], t->idle);
+			timed_out(conn);
+			return false;
+		}
+		if (conn->stall_start && !check_stall(conn, now))
+			return false;
+	}
+}
+
+/*
+ * Skip @n bytes at the beginning of *@iov array of *@cnt elements, dropping
+ * elements that have been used up.
+ */
+static void advance_iov(struct iovec **iov, size_t *cnt, size_t n)
+{
+	while (*cnt > 0 && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		(*cnt)--;
+	}
+	assert(*cnt > 0 || n == 0);
+	if (n) {
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+}
+
+/*
+ * Wrapper around sendmsg(2). Sends all data referred to by @iov array of
+ * @cnt elements on success. The array is modified. On failure, sets
+ * @last_error and the @conn->failed flag. If the flag is already set, does
+ * nothing.
+ */
+static void do_send(struct http_connection *conn, struct iovec *iov,
+		    size_t cnt)
+{
+	struct msghdr msg = {
+		.msg_iov	= iov,
+		.msg_iovlen	= cnt,
+	};
+
+	while (!conn->failed && msg.msg_iovlen > 0) {
+		ssize_t n;
+
+		n = sendmsg(conn->sockfd, &msg,
+			    MSG_NOSIGNAL |	/* don't want to die from SIGPIPE */
+			    (conn->timed ? MSG_DONTWAIT : 0));
+		if (n >= 0) {
+			assert(n > 0);
+			advance_iov(&msg.msg_iov, &msg.msg_iovlen, n);
+			conn_stats(conn)->bytes_sent += n;
+		} else if (conn->timed &&
+			   (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINPROGRESS)) {
+			/* EINPROGRESS: Fast Open fell back on a handshake */
+			wait_socket(conn, POLLOUT);
+		} else {
+			set_last_error_errno(errno, "Send failed");
+			conn->failed = true;
+		}
+	}
+}
+
+/*
+ * Receive up to @len bytes on @conn: call recv(2) on @conn->sockfd or, if
+ * @conn replays a capture, take the next bytes of it. Whatever is received
+ * is also written to the record file, if the request asked for one.
+ */
+static ssize_t conn_recv(struct http_connection *conn, char *buf, size_t len,
+			 int flags)
+{
+	struct http_replay *replay = conn->replay;
+	FILE *record;
+	ssize_t n;
+
+	if (replay) {
+		n = min(len, replay->len - replay->pos);
+		memcpy(buf, replay->data + replay->pos, n);
+		replay->pos += n;
+	} else
+		n = recv(conn->sockfd, buf, len, flags);
+
+	record = container_of(conn, struct http_response, conn)->record;
+	if (n > 0 && record)
+		fwrite(buf, 1, n, record);
+	return n;
+}
+
+/*
+ * Wrapper around recv(2). Receives @len bytes at max and stores them in @buf.
+ * Returns the number of bytes received, which can be less than @len. On EOF
+ * returns 0. On failure, sets @last_error and the @conn->failed flag. If the
+ * flag is already set, does nothing. If @exact is set, this function will keep
+ * looping until it receives exactly @len bytes.
+ */
+static size_t do_recv(struct http_connection *conn, char *buf, size_t len,
+		      bool exact)
+{
+	size_t ret = 0;
+
+	while (!conn->failed && len > 0) {
+		ssize_t n;
+
+		n = conn_recv(conn, buf, len,
+			      conn->timed ? MSG_DONTWAIT : 0);
+		if (n > 0) {
+			assert(n <= len);
+			buf += n;
+			len -= n;
+			ret += n;
+			note_recv(conn, n);
+		} else if (n < 0 && conn->timed &&
+			   (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			wait_socket(conn, POLLIN);
+			continue;
+		} else if (n < 0) {
+			set_last_error_errno(errno, "Receive failed");
+			conn->failed = true;
+		} else
+			break; /* EOF */
+		if (!exact)
+			break;
+	}
+	return ret;
+}
+
+/*
+ * Copy content of @conn->buf to @buf, max @len bytes.
+ * Return the number of bytes actually copied.
+ */
+static size_t copy_from_buffer(struct http_connection *conn,
+			       char *buf, size_t len)
+{
+	size_t n;
+
+	assert(conn->buf_begin <= conn->buf_end);
+	assert(conn->buf_end <= BUF_SIZE);
+
+	n = min(BUF_USED(conn), len);
+	if (n) {
+		memcpy(buf, BUF_BEGIN(conn), n);
+		conn->buf_begin += n;
+	}
+	return n;
+}
+
+/*
+ * Move the content of @conn->buf to the beginning of the buffer to make room
+ * for more data.
+ */
+static void compact_buffer(struct http_connection *conn)
+{
+	memmove(conn->buf, BUF_BEGIN(conn), BUF_USED(conn));
+	conn->buf_end -= conn->buf_begin;
+	conn->buf_begin = 0;
+}
+
+/*
+ * Receive up to @len bytes to @buf, bypassing @conn->buf. Return the number
+ * of bytes received, 0 on EOF, or -1 on failure, in which case @last_error and
+ * the @conn->failed flag are set. If @nonblock is set and there's no data
+ * available, return %HTTP_AGAIN.
+ */
+static ssize_t recv_some(struct http_connection *conn, char *buf, size_t len,
+			 bool nonblock)
+{
+	ssize_t n;
+
+	while (1) {
+		n = conn_recv(conn, buf, len,
+			      nonblock || conn->timed ? MSG_DONTWAIT : 0);
+		if (n >= 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			set_last_error_errno(errno, "Receive failed");
+			conn->failed = true;
+			return n;
+		}
+		if (nonblock)
+			return HTTP_AGAIN;
+		if (!wait_socket(conn, POLLIN))
+			return -1;
+	}
+
+	if (n > 0 && !note_recv(conn, n))
+		return -1;
+	return n;
+}
+
+/*
+ * Receive more data to @conn->buf. Return value is the same as of
+ * recv_some().
+ */
+static ssize_t fill_buffer(struct http_connection *conn, bool nonblock)
+{
+	ssize_t n;
+
+	if (!BUF_USED(conn))
+		conn->buf_begin = conn->buf_end = 0;
+	else if (!BUF_LEFT(conn))
+		compact_buffer(conn);
+
+	assert(BUF_LEFT(conn) > 0);
+
+	n = recv_some(conn, BUF_END(conn), BUF_LEFT(conn), nonblock);
+	if (n > 0)
+		conn->buf_end += n;
+	return n;
+}
+
+/*
+ * Receive a line of the response head. The line is not copied anywhere, but
+ * is nul-terminated in place, in @conn->buf, with the line terminator
+ * stripped, and stays valid until the buffer is refilled. @colon is set to
+ * the first `:' in the line or %NULL if there's none.
+ *
+ * On EOF, whatever is left in the buffer, possibly nothing, is returned as
+ * the last line.
+ *
+ * Return the line length on success, -1 on failure, or %HTTP_AGAIN if
+ * @nonblock is set and there's no data available.
+ */
+static ssize_t recv_head_line(struct http_connection *conn, bool nonblock,
+			      char **line, char **colon)
+{
+	const char *eol, *c;
+	size_t len;
+	ssize_t n;
+
+	while (!(eol = scan_line(BUF_BEGIN(conn), BUF_END(conn), &c))) {
+		if (BUF_USED(conn) >= HTTP_LINE_MAX)
+			goto too_long;
+
+		n = fill_buffer(conn, nonblock);
+		if (n < 0)
+			return n;
+		if (n == 0) {
+			/* EOF - make room for the terminating nul */
+			compact_buffer(conn);
+			eol = BUF_END(conn);
+			c = memchr(BUF_BEGIN(conn), ':', BUF_USED(conn));
+			break;
+		}
+	}
+
+	*line = BUF_BEGIN(conn);
+	*colon = (char *)c;
+
+	len = eol - *line;
+	if (len >= HTTP_LINE_MAX)
+		goto too_long;
+	conn->buf_begin += eol < BUF_END(conn) ? len + 1 : len;
+
+	/* strip '\r' from the end; note, we don't complain if it's absent,
+	 * i.e. we effectively accept "\n" as line separator */
+	if (len > 0 && (*line)[len - 1] == '\r')
+		len--;
+	(*line)[len] = '\0';
+
+	dump(conn_response(conn), "< %s\n", *line);
+	return len;
+
+too_long:
+	set_last_error("Invalid response: Header line too long");
+	return -1;
+}
+
+/*
+ * Buffered recv. Well, it's not really buffered. The only difference of this
+ * method from do_recv() is that it first copies data from @conn->buf if the
+ * latter is not empty and only then proceeds to reading from socket.
+ *
+ * This function returns the number of copied to @buf, which can be less than
+ * @len only if the connection was closed or an error occurred.
+ *
+ * This method is needed for reading response data, because we can't just use
+ * do_recv() for the purpose as there might be some data left in the buffer
+ * after receiving headers.
+ */
+static size_t buffered_recv(struct http_connection *conn, char *buf, size_t len)
+{
+	size_t ret = 0;
+
+	/* First, copy from the buffer if it's not empty */
+	if (BUF_USED(conn)) {
+		ret = copy_from_buffer(conn, buf, len);
+		buf += ret;
+		len -= ret;
+	}
+
+	/* Still want more? */
+	if (len > 0)
+		ret += do_recv(conn, buf, len, true);
+
+	return ret;
+}
+
+/*
+ * A request is composed in memory and then sent in one go, see
+ * compose_request().
+ */
+struct request_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	struct allocator *allocator;
+};
+
+/*
+ * Make room for @len more bytes and return a pointer to it.
+ */
+static char *reserve(struct request_buf *rb, size_t len)
+{
+	size_t size;
+
+	if (rb->len + len > rb->size) {
+		size = max(rb->size * 2, rb->len + len);
+		rb->data = allocator_realloc(rb->allocator, rb->data,
+					     rb->len, size);
+		rb->size = size;
+	}
+	return rb->data + rb->len;
+}
+
+static void put_str(struct request_buf *rb, const char *str)
+{
+	size_t len = strlen(str);
+
+	memcpy(reserve(rb, len), str, len);
+	rb->len += len;
+}
+
+static void put_line(struct request_buf *rb, const char *str, ...)
+{
+	va_list ap;
+
+	va_start(ap, str);
+	while (str) {
+		put_str(rb, str);
+		str = va_arg(ap, const char *);
+	}
+	va_end(ap);
+
+	put_str(rb, "\r\n");
+}
+
+static void put_header(struct request_buf *rb,
+		       const char *field, const char *value)
+{
+	put_line(rb, field, ": ", value, NULL);
+}
+
+static void put_range_header(struct request_buf *rb, size_t first, size_t last)
+{
+	char buf[32];
+
+	if (last != SIZE_MAX)
+		snprintf(buf, sizeof(buf), "bytes=%zu-%zu", first, last);
+	else
+		snprintf(buf, sizeof(buf), "bytes=%zu-", first);
+
+	put_header(rb, "Range", buf);
+}
+
+static void put_host_header(struct request_buf *rb, const char *host, int port)
+{
+	char buf[16] = "";
 
 	if (port >= 0)
 		snprintf(buf, sizeof(buf), ":%d", port);
-	send_line(conn, "Host: ",  host, buf, NULL);
+	put_line(rb, "Host: ",  host, buf, NULL);
+}
+
+static void put_auth_header(struct request_buf *rb, const char *creds)
+{
+	size_t len;
+	char *p;
+
+	put_str(rb, "Authorization: Basic ");
+
+	/* Encode straight to the request */
+	len = base64_encode(creds, NULL, 0);
+	p = reserve(rb, len + 1);
+	base64_encode(creds, p, len + 1);
+	rb->len += len;
+
+	put_str(rb, "\r\n");
+}
+
+static bool template_matches(const struct http_template *t, const char *host,
+			     int port, const char *creds)
+{
+	return t->data && t->port == port && strcmp(t->host, host) == 0 &&
+		(t->creds && creds ? strcmp(t->creds, creds) == 0 :
+		 t->creds == creds);
+}
+
+/*
+ * Make sure the template of @conn holds the headers for a request to
+ * @host:@port with @creds.
+ */
+static void update_template(struct http_connection *conn, const char *host,
+			    int port, const char *creds)
+{
+	struct http_template *t = &conn->tmpl;
+	struct request_buf rb = {
+		.allocator	= &heap_allocator,
+	};
+
+	if (template_matches(t, host, port, creds))
+		return;
+
+	destroy_template(t);
+
+	/* Host header is mandatory in case of HTTP/1.1 */
+	put_host_header(&rb, host, port);
+
+	if (creds)
+		put_auth_header(&rb, creds);
+
+	t->data = rb.data;
+	t->len = rb.len;
+	t->host = xstrdup(host);
+	t->port = port;
+	t->creds = creds ? xstrdup(creds) : NULL;
+}
+
+/*
+ * Pass the request lines referred to by @iov array of @cnt elements to
+ * dump(), unless nobody is listening.
+ */
+static void dump_request(const struct http_response *resp,
+			 const struct iovec *iov, size_t cnt)
+{
+	const char *p, *end, *eol;
+	size_t i;
+
+	if (!resp->trace && !http_dump_fn)
+		return;
+
+	for (i = 0; i < cnt; i++) {
+		p = iov[i].iov_base;
+		end = p + iov[i].iov_len;
+		for (; p < end; p = eol + 1) {
+			eol = memchr(p, '\n', end - p);
+			assert(eol && eol > p && eol[-1] == '\r');
+			dump(resp, "> %.*s\n", (int)(eol - 1 - p), p);
+		}
+	}
+}
+
+/*
+ * Compose the request defined by @info to be sent over @conn. The request
+ * is stored in @rb, except for the headers kept in the template of @conn,
+ * and referred to by @iov, which must have HTTP_REQUEST_IOVS elements.
+ */
+static void compose_request(struct request_buf *rb,
+			    struct http_connection *conn,
+			    const struct http_request_info *info,
+			    struct iovec *iov)
+{
+	size_t line_len;
+
+	put_line(rb, info->command, " ", info->path, " HTTP/1.1", NULL);
+	line_len = rb->len;
+
+	update_template(conn, info->host, info->port, info->creds);
+
+	if (info->want_range) {
+		put_range_header(rb, info->range_first, info->range_last);
+		if (info->if_range)
+			put_header(rb, "If-Range", info->if_range);
+	}
+
+	if (info->want_compression)
+		put_header(rb, "Accept-Encoding", "gzip, deflate");
+
+	if (info->if_none_match)
+		put_header(rb, "If-None-Match", info->if_none_match);
+	if (info->if_modified_since)
+		put_header(rb, "If-Modified-Since", info->if_modified_since);
+
+	put_line(rb, NULL);
+
+	iov[0].iov_base = rb->data;
+	iov[0].iov_len = line_len;
+	iov[1].iov_base = conn->tmpl.data;
+	iov[1].iov_len = conn->tmpl.len;
+	iov[2].iov_base = rb->data + line_len;
+	iov[2].iov_len = rb->len - line_len;
+
+	dump_request(conn_response(conn), iov, HTTP_REQUEST_IOVS);
+}
+
+/*
+ * Submit a http request. Return %true on success.
+ */
+static bool send_request(struct http_response *resp,
+			 const struct http_request_info *info)
+{
+	struct http_connection *conn = &resp->conn;
+	struct request_buf rb = {
+		.allocator	= &resp->arena.allocator,
+	};
+	struct iovec iov[HTTP_REQUEST_IOVS];
+
+	compose_request(&rb, conn, info, iov);
+	do_send(conn, iov, HTTP_REQUEST_IOVS);
+	resp->stats.timing.sent = now_us();
+
+	conn->phase = PHASE_HEAD;
+	if (conn->timeouts.first_byte)
+		conn->first_byte_deadline = now_ms() +
+			conn->timeouts.first_byte;
+
+	return !conn->failed;
+}
+
+/*
+ * Given a string supposedly containing a http response status line, try to
+ * parse it. On success return %true and initialize @resp->version,
+ * @resp->status, and @resp->reason accordingly.
+ */
+static bool parse_status(char *str, struct http_response *resp)
+{
+	char *p;
+
+	if (strncasecmp(str, "HTTP/", 5) != 0)
+		goto invalid_status;
+	str += 5;
+
+	/* skip version */
+	p = findspace(str);
+
+	resp->version = -1;
+	/* all known versions consist of 3 characters */
+	if (p - str == 3) {
+		if (strncmp(str, "0.9", 3) == 0)
+			resp->version = 9;
+		if (strncmp(str, "1.0", 3) == 0)
+			resp->version = 10;
+		if (strncmp(str, "1.1", 3) == 0)
+			resp->version = 11;
+	}
+
+	if (resp->version < 0) {
+		*p = '\0';
+		set_last_error("Invalid response: "
+			       "Unknown protocol version: %s", str);
+		goto fail;
+	}
+
+	str = skipspaces(p);
+	resp->status = strtol(str, &p, 10);
+
+	/* Status code consists of exactly 3 digits */
+	if (p - str != 3 || !isspace(*p) || resp->status < 100)
+		goto invalid_status;
+
+	str = skipspaces(p);
+	if (!*str) {
+		set_last_error("Invalid response: "
+			       "Reason message missing");
+		goto fail;
+	}
+
+	resp->reason = allocator_strdup(&resp->arena.allocator, str);
+	return true;
+
+invalid_status:
+	set_last_error("Invalid response status");
+fail:
+	return false;
+}
+
+/*
+ * Given a header line of @len bytes with the first colon at @colon, try to
+ * parse it. On success, return %true and initialize @field, @value, and
+ * their lengths. Both the field name and the value are stripped of surrounding
+ * spaces and nul-terminated in place.
+ */
+static bool parse_header(char *line, size_t len, char *colon,
+			 char **field, size_t *field_len,
+			 char **value, size_t *value_len)
+{
+	char *end = line + len;
+	char *p;
+
+	if (!colon) {
+		set_last_error("Invalid response header: `:' missing");
+		return false;
+	}
+
+	for (p = colon; p > line && isspace(p[-1]); p--)
+		;
+	while (line < p && isspace(*line))
+		line++;
+	if (line == p) {
+		set_last_error("Invalid response header: Field name missing");
+		return false;
+	}
+	*p = '\0';
+	*field = line;
+	*field_len = p - line;
+
+	for (p = colon + 1; p < end && isspace(*p); p++)
+		;
+	while (end > p && isspace(end[-1]))
+		end--;
+	if (p == end) {
+		set_last_error("Invalid response header: Value missing");
+		return false;
+	}
+	*end = '\0';
+	*value = p;
+	*value_len = end - p;
+
+	return true;
+}
+
+static bool parse_size(const char *s, int base, size_t *result)
+{
+	long long x;
+
+	if (!strict_strtoll(s, base, &x) || x < 0 || x > SIZE_MAX)
+		return false;
+
+	*result = x;
+	return true;
+}
+
+struct http_header_handler {
+	/*
+	 * The field name which this handler handles.
+	 */
+	const char *field;
+
+	/*
+	 * The handler function. It is supposed to set @resp according to the
+	 * header value, passed in @value, and return %true on success.
+	 */
+	bool (*handle)(char *value, struct http_response *resp);
+
+	size_t field_len;	/* initialized by init_header_hash() */
+};
+
+static bool handle_content_length_header(char *s, struct http_response *resp)
+{
+	/* Content-Length is ignored for chunked responses */
+	if (resp->chunked)
+		return true;
+
+	if (!parse_size(s, 10, &resp->body_size)) {
+		set_last_error("Failed to parse `Content-Length' header: %s", s);
+		return false;
+	}
+	resp->sized = 1;
+	return true;
+}
+
+static bool handle_content_range_header(char *s, struct http_response *resp)
+{
+	/*
+	 * Example of an expected value:
+	 *
+	 * Content-Range: bytes 100-200/300
+	 *
+	 * We're pedantic, so don't trust sscanf.
+	 */
+	char *orig_s = s, *dash_pos = NULL, *slash_pos = NULL;
+
+	/* unit - we only support bytes */
+	if (strncasecmp(s, "bytes", 5) != 0)
+		goto fail;
+	s += 5;
+	if (!isspace(*s))
+		goto fail;
+	s = skipspaces(s);
+
+	/* index of the first byte in the range */
+	dash_pos = strchr(s, '-');
+	if (!dash_pos)
+		goto fail;
+	*dash_pos = '\0';
+	if (!parse_size(s, 10, &resp->range_first))
+		goto fail;
+	s = dash_pos + 1;
+
+	/* index of the last byte in the range */
+	slash_pos = strchr(s, '/');
+	if (!slash_pos)
+		goto fail;
+	*slash_pos = '\0';
+	if (!parse_size(s, 10, &resp->range_last))
+		goto fail;
+	s = slash_pos + 1;
+
+	/* total number of bytes in the file */
+	if (!parse_size(s, 10, &resp->range_total))
+		goto fail;
+
+	/* sanity check */
+	if (resp->range_first > resp->range_last ||
+	    resp->range_last >= resp->range_total)
+		goto fail;
+
+	resp->ranged = 1;
+	return true;
+
+fail:
+	/* restore the original header value for error reporting */
+	s = orig_s;
+	if (dash_pos)
+		*dash_pos = '-';
+	if (slash_pos)
+		*slash_pos = '/';
+	set_last_error("Failed to parse `Content-Range' header: %s", s);
+	return false;
+}
+
+static bool handle_connection_header(char *s, struct http_response *resp)
+{
+	char *tok, *saveptr;
+
+	for (tok = strtok_r(s, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		tok = strstrip(tok);
+		if (strcasecmp(tok, "close") == 0)
+			resp->keep_alive = 0;
+		else if (strcasecmp(tok, "keep-alive") == 0)
+			resp->keep_alive = 1;
+	}
+	return true;
+}
+
+static bool handle_transfer_encoding_header(char *s, struct http_response *resp)
+{
+	/* Looking for "chunked" at the end */
+	static const char chunked_str[] = "chunked";
+	const size_t chunked_strlen = sizeof(chunked_str) - 1;
+
+	size_t len = strlen(s);
+
+	if (len >= chunked_strlen &&
+	    strcasecmp(s + len - chunked_strlen, chunked_str) == 0) {
+		resp->chunked = 1;
+
+		/* Content-Length is ignored for chunked responses */
+		resp->body_size = 0;
+		resp->sized = 0;
+	}
+	return true;
+}
+
+static bool handle_location_header(char *s, struct http_response *resp)
+{
+	resp->location = url_alloc_in(s, &resp->arena.allocator);
+	if (!resp->location) {
+		set_last_error("Failed to parse `Location' header: %s", s);
+		return false;
+	}
+	return true;
+}
+
+static struct http_header_handler header_handlers[] = {
+	{ "Content-Length",		handle_content_length_header, },
+	{ "Content-Range",		handle_content_range_header, },
+	{ "Transfer-Encoding",		handle_transfer_encoding_header, },
+	{ "Location",			handle_location_header, },
+	{ "Connection",			handle_connection_header, },
+	{ }, /* terminate */
+};
+
+/*
+ * Known headers are dispatched through a perfect hash table. A field name is
+ * hashed by its length and first and last characters, ignoring case, and the
+ * hash function seed is picked on first use so that the known fields don't
+ * collide. So a lookup takes a single probe and a single string comparison.
+ */
+#define HEADER_HASH_BITS	5
+#define HEADER_HASH_SIZE	(1 << HEADER_HASH_BITS)
+
+/* Max number of seeds to try before giving up, see init_header_hash() */
+#define HEADER_HASH_TRIES	10000
+
+static struct http_header_handler *header_hash[HEADER_HASH_SIZE];
+static uint32_t header_hash_seed;
+static pthread_once_t header_hash_once = PTHREAD_ONCE_INIT;
+
+static unsigned header_hash_fn(const char *field, size_t len, uint32_t seed)
+{
+	uint32_t key;
+
+	/* setting bit 5 converts ASCII letters to lower case */
+	key = (field[0] | 0x20) | (field[len - 1] | 0x20) << 8 | len << 16;
+	return (key * seed) >> (32 - HEADER_HASH_BITS);
+}
+
+static void init_header_hash(void)
+{
+	struct http_header_handler *h;
+	uint32_t seed = 0x9e3779b1;
+	unsigned i;
+	int tries;
+
+	for (h = header_handlers; h->handle; h++)
+		h->field_len = strlen(h->field);
+
+	for (tries = 0; tries < HEADER_HASH_TRIES; tries++, seed += 2) {
+		memset(header_hash, 0, sizeof(header_hash));
+		for (h = header_handlers; h->handle; h++) {
+			i = header_hash_fn(h->field, h->field_len, seed);
+			if (header_hash[i])
+				break;
+			header_hash[i] = h;
+		}
+		if (!h->handle)
+			break;
+	}
+
+	/*
+	 * Can only fail if two known fields are of the same length and start
+	 * and end with the same characters - the hash key must be extended
+	 * then - or if there are too many of them for the table.
+	 */
+	assert(tries < HEADER_HASH_TRIES);
+	header_hash_seed = seed;
+}
+
+/*
+ * Given a header, call the corresponding handler, if any.
+ */
+static bool handle_header(char *field, size_t field_len, char *value,
+			  struct http_response *resp)
+{
+	struct http_header_handler *h;
+
+	pthread_once(&header_hash_once, init_header_hash);
+
+	h = header_hash[header_hash_fn(field, field_len, header_hash_seed)];
+	if (h && h->field_len == field_len &&
+	    strncasecmp(h->field, field, field_len) == 0)
+		return h->handle(value, resp);
+	return true;
+}
+
+/*
+ * Save a header in @resp->headers. All headers of a response share the same
+ * chunk of memory, which is grown as needed.
+ */
+static void store_header(struct http_response *resp,
+			 const char *field, size_t field_len,
+			 const char *value, size_t value_len)
+{
+	size_t need = resp->headers_len + field_len + value_len + 2;
+	char *p;
+
+	if (need > resp->headers_size) {
+		resp->headers_size = max(need, max(2 * resp->headers_size,
+						   (size_t)HEADERS_SIZE_MIN));
+		resp->headers = allocator_realloc(&resp->arena.allocator,
+						  resp->headers,
+						  resp->headers_len,
+						  resp->headers_size);
+	}
+
+	p = resp->headers + resp->headers_len;
+	memcpy(p, field, field_len + 1);
+	p += field_len + 1;
+	memcpy(p, value, value_len + 1);
+	resp->headers_len = need;
+}
+
+/*
+ * Process a line of the response head, i.e. the status line or a header.
+ * Return 1 if the head is over, 0 if more lines are expected, or -1 on error.
+ */
+static int process_head_line(char *line, size_t len, char *colon,
+			     struct http_response *resp)
+{
+	char *field, *value;
+	size_t field_len, value_len;
+
+	/* The status line comes first */
+	if (!resp->reason) {
+		if (!parse_status(line, resp))
+			return -1;
+
+		/* Persistent connections are the default since HTTP/1.1 */
+		resp->keep_alive = resp->version >= 11;
+		return 0;
+	}
+
+	/* Empty line? Proceed to the message body */
+	if (!len)
+		return 1;
+
+	if (!parse_header(line, len, colon, &field, &field_len,
+			  &value, &value_len))
+		return -1;
+
+	/* Save before handling, because handlers may modify the value */
+	store_header(resp, field, field_len, value, value_len);
+
+	if (!handle_header(field, field_len, value, resp))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Receive a http response. Return %true on success.
+ */
+static bool recv_response(struct http_connection *conn,
+			  struct http_response *resp)
+{
+	char *line, *colon;
+	ssize_t len;
+	int ret;
+
+	do {
+		len = recv_head_line(conn, false, &line, &colon);
+		if (len < 0)
+			return false;
+		ret = process_head_line(line, len, colon, resp);
+	} while (ret == 0);
+
+	return ret > 0;
 }
 
-static void send_auth_header(struct http_connection *conn, const char *creds)
+/*
+ * Return %true if the response may have a body.
+ */
+static bool response_has_body(const struct http_request_info *info,
+			      struct http_response *resp)
 {
-	const char prefix[] = "Basic ";
-	size_t len, offset;
-	char *buf;
+	if (strcmp(info->command, "HEAD") == 0)
+		return false;
 
-	offset = sizeof(prefix) - 1;
-	len = base64_encode(creds, NULL, 0);
-	buf = xmalloc(len + offset + 1);
-	strcpy(buf, prefix);
-	base64_encode(creds, buf + offset, len + 1);
+	/* 1xx (Informational), 204 (No Content), 304 (Not Modified) */
+	if (resp->status / 100 == 1 ||
+	    resp->status == 204 || resp->status == 304)
+		return false;
+
+	return true;
+}
+
+static bool check_range(const struct http_request_info *info,
+			struct http_response *resp)
+{
+	size_t first = 0, last = resp->range_total - 1;
+
+	if (info->want_range) {
+		first = info->range_first;
+		if (info->range_last != SIZE_MAX)
+			last = info->range_last;
+	}
 
-	send_header(conn, "Authorization", buf);
+	if (first != resp->range_first || last != resp->range_last) {
+		set_last_error("Received range differs from requested: "
+			       "requested %zu-%zu, received %zu-%zu",
+			       first, last, resp->range_first, resp->range_last);
+		return false;
+	}
 
-	free(buf);
+	return true;
 }
 
 /*
- * Submit a http request. Return %true on success.
+ * Decompressor of a gzip or deflate encoded body.
+ *
+ * All its memory, including zlib's internal state, is taken from the
+ * response arena, so there's nothing to free.
+ */
+struct http_decoder {
+	z_stream zs;
+	int window_bits;	/* zlib format, see inflateInit2();
+				   0 until the first bytes tell */
+	bool ready;		/* @zs has been initialized */
+	bool done;		/* end of the compressed stream reached */
+	unsigned char buf[DECODER_BUF_SIZE];	/* compressed data */
+};
+
+static void *decoder_alloc(void *opaque, unsigned items, unsigned size)
+{
+	return allocator_alloc(opaque, (size_t)items * size);
+}
+
+static void decoder_free(void *opaque, void *ptr)
+{
+	allocator_free(opaque, ptr);
+}
+
+/*
+ * Set up decompression of the body of @resp according to its
+ * Content-Encoding header.
+ */
+static bool init_decoder(struct http_response *resp)
+{
+	const char *coding = http_response_header(resp, "Content-Encoding");
+	struct allocator *a = &resp->arena.allocator;
+	struct http_decoder *d;
+	int window_bits;
+
+	if (!coding || strcasecmp(coding, "identity") == 0)
+		return true;
+
+	if (strcasecmp(coding, "gzip") == 0 ||
+	    strcasecmp(coding, "x-gzip") == 0)
+		window_bits = 16 + MAX_WBITS;	/* gzip header */
+	else if (strcasecmp(coding, "deflate") == 0)
+		window_bits = 0;
+	else {
+		set_last_error("Unsupported content encoding: %s", coding);
+		return false;
+	}
+
+	d = allocator_alloc(a, sizeof(*d));
+	memset(d, 0, sizeof(*d));
+	d->zs.zalloc = decoder_alloc;
+	d->zs.zfree = decoder_free;
+	d->zs.opaque = a;
+	d->window_bits = window_bits;
+	resp->decoder = d;
+	return true;
+}
+
+/*
+ * Called when the response head has been received. Return %true if the
+ * response is fine and its body may be read.
+ */
+static bool finish_head(const struct http_request_info *info,
+			struct http_response *resp)
+{
+	resp->stats.timing.head_done = now_us();
+
+	/* The receive rate is measured over the body */
+	resp->conn.tune_time = resp->stats.timing.head_done;
+	resp->conn.tune_bytes = 0;
+
+	if (!response_has_body(info, resp)) {
+		resp->chunked = 0;
+		resp->sized = 1;
+		resp->body_size = 0;
+		resp->stats.timing.body_done = resp->stats.timing.head_done;
+		sample_tcp(&resp->conn, resp->stats.timing.body_done);
+	}
+
+	/* Unless the body length is known, the server will close the
+	 * connection to mark the end of the body */
+	if (!resp->chunked && !resp->sized)
+		resp->keep_alive = 0;
+
+	/* Check requested-vs-received ranges */
+	if (resp->ranged && !check_range(info, resp))
+		return false;
+
+	if (info->want_compression && !info->want_range &&
+	    response_has_body(info, resp) && !init_decoder(resp))
+		return false;
+
+	resp->conn.phase = PHASE_BODY;
+	if (resp->conn.timeouts.stall_time) {
+		resp->conn.stall_start = now_ms();
+		resp->conn.stall_bytes = 0;
+	}
+	return true;
+}
+
+static bool __http_simple_request(const struct http_request_info *info,
+				  struct http_response *resp)
+{
+	struct http_connection *conn = &resp->conn;
+
+	init_response(resp, info);
+retry:
+	if (!open_connection(info->host, info->port, &info->timeouts,
+			     &info->sockopts, conn))
+		goto fail;
+
+	if (!send_request(resp, info) || !recv_response(conn, resp)) {
+		/*
+		 * The server may have closed an idle connection right before
+		 * we sent the request. Retry with a new connection if so.
+		 */
+		if (conn->reused && !resp->reason && !conn->timed_out) {
+			close_connection(conn);
+			goto retry;
+		}
+		goto fail;
+	}
+
+	if (!finish_head(info, resp))
+		goto fail;
+
+	return true;
+fail:
+	resp->keep_alive = 0;
+	destroy_response(resp);
+	return false;
+}
+
+/*
+ * Read and throw away the rest of the response body so that the connection
+ * can be reused. Give up if the body is too large.
+ */
+static void drain_response(struct http_response *resp)
+{
+	char buf[1024];
+	size_t left = DRAIN_MAX;
+	ssize_t n;
+
+	if (!resp->keep_alive)
+		return;
+
+	if (resp->sized && resp->body_size - resp->body_read > left)
+		return;
+
+	while (left > 0) {
+		n = http_response_read(resp, buf, min(sizeof(buf), left));
+		if (n <= 0)
+			break;
+		left -= n;
+	}
+}
+
+/*
+ * If @resp redirects to a location we can follow, update @info to point to
+ * the new location and return %true.
+ *
+ * Since @info refers to the location, the latter is moved from @resp to
+ * *@url, which must be freed by the caller. The url stored in *@url before
+ * the call is freed.
+ */
+static bool follow_redirect(struct http_request_info *info,
+			    struct http_response *resp,
+			    struct url_struct **url)
+{
+	struct url_struct *location = resp->location;
+
+	/* Hit the redirection limit? Stop now. */
+	if (info->max_redirections >= 0 && info->max_redirections-- == 0)
+		return false;
+
+	/* Not a redirection response? We're done then. */
+	if (!HTTP_STATUS_REDIRECT(resp->status))
+		return false;
+
+	/* Redirected, but not given the new location?
+	 * Suspicious. Can't continue. */
+	if (!location)
+		return false;
+
+	/* Unsupported target url scheme? Stop now. */
+	if (location->scheme &&
+	    strcmp(location->scheme, HTTP_URL_SCHEME) != 0)
+		return false;
+
+	/*
+	 * Do not send credentials when redirecting to another host
+	 * unless explicitly allowed.
+	 */
+	if (info->creds && !info->trusted_location &&
+	    location->host && strcasecmp(location->host, info->host) != 0)
+		info->creds = NULL;
+
+	/*
+	 * The location is gone with @resp, so make a copy. A relative
+	 * location inherits the server, which may be defined by the url we
+	 * are about to free, so copy it too.
+	 */
+	location = url_dup(location);
+	if (!location->host) {
+		location->host = xstrdup(info->host);
+		location->port = info->port;
+	}
+	url_free(*url);
+	*url = location;
+
+	info->host = location->host;
+	info->port = location->port;
+	info->path = location->path;
+	return true;
+}
+
+/*
+ * Remember the request @resp is the answer to, so that the body transfer can
+ * be resumed should the connection fail. This takes a validator to tell if
+ * the file has changed by then: a strong ETag or, failing that, the
+ * Last-Modified date.
+ */
+static void save_request(const struct http_request_info *info,
+			 struct http_response *resp)
+{
+	struct allocator *a = &resp->arena.allocator;
+	struct http_request_info *req;
+	const char *validator;
+
+	validator = http_response_header(resp, "ETag");
+	if (validator && strncmp(validator, "W/", 2) == 0)
+		validator = NULL;	/* weak, not allowed in If-Range */
+	if (!validator)
+		validator = http_response_header(resp, "Last-Modified");
+	if (!validator)
+		return;
+
+	req = allocator_alloc(a, sizeof(*req));
+	*req = *info;
+	req->host = allocator_strdup(a, info->host);
+	req->command = allocator_strdup(a, info->command);
+	req->path = allocator_strdup(a, info->path);
+	if (info->creds)
+		req->creds = allocator_strdup(a, info->creds);
+	req->if_range = (char *)validator;
+	/* we've got the file, don't let a resumed request end with 304 */
+	req->if_none_match = req->if_modified_since = NULL;
+	resp->request = req;
+}
+
+/* Sleep before the next attempt to resume @resp, see RETRY_DELAY */
+static void retry_delay(struct http_response *resp)
+{
+	static __thread unsigned int seed;
+	struct timespec ts;
+	int delay;
+
+	if (!seed)
+		seed = now_ms() ^ (uintptr_t)&seed;
+
+	delay = min(RETRY_DELAY << min(resp->retries, 16), RETRY_DELAY_MAX);
+	delay = delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+
+	dump(resp, "Retrying in %d ms (attempt %d of %d)\n", delay,
+	     resp->retries + 1, resp->request->max_retries);
+
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Check that @new, the response to a request to resume @resp, continues the
+ * same file.
+ */
+static bool check_resumed(struct http_response *resp, struct http_response *new)
+{
+	size_t total = resp->ranged ? resp->range_total : resp->body_size;
+	const char *coding, *new_coding;
+
+	if (new->status == 200) {
+		set_last_error("Cannot resume: file changed on the server");
+		return false;
+	}
+	if (new->status != 206 || !new->ranged) {
+		set_last_error("Cannot resume: error %d: %s",
+			       new->status, new->reason);
+		return false;
+	}
+	if ((resp->ranged || resp->sized) && new->range_total != total) {
+		set_last_error("Cannot resume: file size changed "
+			       "from %zu to %zu", total, new->range_total);
+		return false;
+	}
+
+	/* The validator may be shared by differently encoded variants */
+	coding = http_response_header(resp, "Content-Encoding");
+	new_coding = http_response_header(new, "Content-Encoding");
+	if (!coding != !new_coding ||
+	    (coding && strcasecmp(coding, new_coding) != 0)) {
+		set_last_error("Cannot resume: content encoding changed");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Try to resume the transfer of the body of @resp after a connection failure
+ * by requesting the rest of it on a new connection, see http_response_read().
+ * The new response takes the place of the failed one, apart from the head,
+ * which stays intact.
+ *
+ * Returns %true if the transfer may go on. Otherwise the error that made us
+ * give up is left in @last_error.
+ */
+static bool resume_response(struct http_response *resp)
+{
+	struct http_request_info info;
+	struct http_response new;
+	bool ok;
+
+	if (!resp->request || !resp->conn.failed)
+		return false;
+
+	info = *resp->request;
+	info.want_range = 1;
+	info.range_first = (resp->ranged ? resp->range_first : 0) +
+		resp->body_read;
+	if (!resp->ranged)
+		info.range_last = SIZE_MAX;
+
+	close_connection(&resp->conn);
+	resp->conn.failed = true;
+
+	while (resp->retries < info.max_retries) {
+		dump(resp, "Transfer failed at byte %zu: %s\n",
+		     info.range_first, http_last_error());
+		retry_delay(resp);
+		resp->retries++;
+
+		ok = __http_simple_request(&info, &new);
+
+		/* The new request's traffic counts towards @resp */
+		resp->stats.bytes_sent += new.stats.bytes_sent;
+		resp->stats.bytes_received += new.stats.bytes_received;
+		resp->stats.recv_calls += new.stats.recv_calls;
+
+		if (!ok)
+			continue;
+
+		/* The server may be out of order for a while */
+		if (new.status / 100 == 5) {
+			set_last_error("Error %d: %s", new.status, new.reason);
+			destroy_response(&new);
+			continue;
+		}
+
+		if (!check_resumed(resp, &new)) {
+			destroy_response(&new);
+			return false;
+		}
+
+		if (!resp->sized && new.sized) {
+			resp->sized = 1;
+			resp->body_size = resp->body_read + new.body_size;
+		}
+		resp->chunked = new.chunked;
+		resp->chunk_size = new.chunk_size;
+		resp->chunk_state = new.chunk_state;
+		resp->keep_alive = new.keep_alive;
+
+		resp->conn = new.conn;
+		init_connection(&new.conn);
+		destroy_response(&new);
+		resp->stats.resumes++;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Account for the request whose statistics are @prev as a redirection that
+ * led to the request whose statistics are @stats.
+ */
+static void add_hop(struct http_stats *stats, const struct http_stats *prev)
+{
+	memcpy(stats->hops, prev->hops, sizeof(stats->hops));
+	if (prev->redirects < HTTP_STATS_HOPS)
+		stats->hops[prev->redirects] = prev->timing;
+	stats->redirects = prev->redirects + 1;
+
+	stats->bytes_sent += prev->bytes_sent;
+	stats->bytes_received += prev->bytes_received;
+	stats->recv_calls += prev->recv_calls;
+}
+
+bool http_simple_request(const struct http_request_info *info,
+			 struct http_response *resp)
+{
+	/* we will need to modify request info, so copy it */
+	struct http_request_info i = *info;
+	struct url_struct *url = NULL;
+	struct http_stats prev;
+	bool redirected = false;
+	bool ret;
+
+	while (1) {
+		ret = __http_simple_request(&i, resp);
+		if (ret && redirected)
+			add_hop(&resp->stats, &prev);
+		if (!ret || !follow_redirect(&i, resp, &url))
+			break;
+
+		/* Let the next request reuse the connection if possible */
+		drain_response(resp);
+		prev = resp->stats;
+		redirected = true;
+		destroy_response(resp);
+	}
+
+	if (ret && i.max_retries > 0 && HTTP_STATUS_OK(resp->status) &&
+	    strcmp(i.command, "GET") == 0)
+		save_request(&i, resp);
+
+	url_free(url);
+	return ret;
+}
+
+bool http_response_replay(const struct http_request_info *info,
+			  struct http_replay *replay,
+			  struct http_response *resp)
+{
+	struct http_connection *conn = &resp->conn;
+
+	init_response(resp, info);
+	conn->replay = replay;
+	conn->buf = xmalloc(BUF_SIZE);
+
+	if (!recv_response(conn, resp) || !finish_head(info, resp)) {
+		resp->keep_alive = 0;
+		destroy_response(resp);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Chunked body decoder.
+ *
+ * The decoder state is kept in @resp->chunk_state, so that decoding can be
+ * suspended when there's no data available in non-blocking mode and resumed
+ * later.
+ */
+
+/*
+ * If @conn->buf starts with a complete line, consume it and return a pointer
+ * to it, with the line terminator replaced by nul. The pointer stays valid
+ * until the buffer is refilled. Otherwise return %NULL.
+ */
+static char *take_line(struct http_connection *conn)
+{
+	char *line = BUF_BEGIN(conn);
+	char *eol;
+
+	eol = memchr(line, '\n', BUF_USED(conn));
+	if (!eol)
+		return NULL;
+
+	conn->buf_begin += eol - line + 1;
+	if (eol > line && eol[-1] == '\r')
+		eol--;
+	*eol = '\0';
+	return line;
+}
+
+/*
+ * Parse a chunk size line. Chunk extensions, which follow the size after
+ * `;', are ignored.
+ */
+static bool parse_chunk_size(const char *s, size_t *result)
+{
+	size_t size = 0;
+	int digits = 0;
+	int x;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	for (; isxdigit(*s); s++, digits++) {
+		x = isdigit(*s) ? *s - '0' : tolower(*s) - 'a' + 10;
+		if (size > (SIZE_MAX - x) / 16)
+			return false;
+		size = size * 16 + x;
+	}
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	if (!digits || (*s != '\0' && *s != ';'))
+		return false;
+
+	*result = size;
+	return true;
+}
+
+/*
+ * Process a line of the chunked body framing, i.e. anything but chunk data.
+ * Return %false on failure.
+ */
+static bool process_chunk_line(char *line, struct http_response *resp)
+{
+	switch (resp->chunk_state) {
+	case CHUNK_SIZE:
+		if (!parse_chunk_size(line, &resp->chunk_size)) {
+			set_last_error("Failed to parse response chunk size");
+			return false;
+		}
+		resp->chunk_state = resp->chunk_size ?
+			CHUNK_DATA : CHUNK_TRAILER;
+		break;
+	case CHUNK_CRLF:
+		if (line[0] != '\0') {
+			set_last_error("Response chunk lacks terminating CRLF");
+			return false;
+		}
+		resp->chunk_state = CHUNK_SIZE;
+		break;
+	case CHUNK_TRAILER:
+		/* Trailer headers are ignored */
+		if (line[0] != '\0')
+			dump(resp, "< %s\n", line);
+		else
+			resp->chunk_state = CHUNK_END;
+		break;
+	default:
+		assert(0);
+	}
+	return true;
+}
+
+/*
+ * Handle EOF met by chunked_read().
+ */
+static int chunked_eof(struct http_response *resp)
+{
+	switch (resp->chunk_state) {
+	case CHUNK_SIZE:
+		set_last_error("Failed to parse response chunk size");
+		return -1;
+	case CHUNK_DATA:
+		set_last_error("Response chunk shorter than announced");
+		return -1;
+	case CHUNK_CRLF:
+		set_last_error("Response chunk lacks terminating CRLF");
+		return -1;
+	case CHUNK_TRAILER:
+		/* Tolerate EOF instead of the final empty line,
+		 * but don't reuse the connection then */
+		resp->keep_alive = 0;
+		resp->chunk_state = CHUNK_END;
+		return 0;
+	default:
+		assert(0);
+	}
+	return -1;
+}
+
+/*
+ * Account for @n bytes of chunk data returned to the caller.
  */
-static bool send_request(struct http_connection *conn,
-			 const struct http_request_info *info)
+static void consume_chunk_data(struct http_response *resp, size_t n)
 {
-	send_line(conn, info->command, " ", info->path, " HTTP/1.1", NULL);
-
-	/* Host header is mandatory in case of HTTP/1.1 */
-	send_host_header(conn, info->host, info->port);
-
-	if (info->creds)
-		send_auth_header(conn, info->creds);
-
-	/* We do not support persistent connections,
-	 * neither do we actually need them for now */
-	send_header(conn, "Connection", "close");
-
-	if (info->want_range)
-		send_range_header(conn, info->range_first, info->range_last);
-
-	send_line(conn, NULL);
+	assert(n <= resp->chunk_size);
 
-	flush_buffer(conn);
-	return !conn->failed;
+	resp->body_read += n;
+	resp->chunk_size -= n;
+	if (!resp->chunk_size)
+		resp->chunk_state = CHUNK_CRLF;
 }
 
 /*
- * Read a line ending with "\r\n" to @buf of size @buf_size. "\r\n" is not
- * copied to @buf. Return the line length.
+ * Decode as much of a chunked body as fits in @buf.
  *
- * If the line doesn't fit in @buf, the line is truncated to @buf_size
- * characters and the function returns @buf_size. In this case @buf is not
- * nul-terminated.
+ * The decoder walks @conn->buf, copying chunk data and parsing the framing in
+ * place, so one call may return many small chunks. Large pieces of chunk data
+ * are received straight to @buf, bypassing @conn->buf. Once something has
+ * been decoded, the function doesn't wait for more data to arrive, but returns
+ * what it has.
  */
-static size_t recv_line(struct http_connection *conn,
-			char *buf, size_t buf_size)
+static ssize_t chunked_read(struct http_response *resp, void *buf, size_t len,
+			    bool nonblock)
 {
-	size_t line_len = 0;
+	struct http_connection *conn = &resp->conn;
+	char *p = buf;
+	size_t ret = 0;
+	size_t want;
+	ssize_t n;
+	char *line;
 
-	while (line_len < buf_size) {
-		char *p;
-		size_t n;
+	while (ret < len && resp->chunk_state != CHUNK_END) {
+		want = min(len - ret, resp->chunk_size);
 
-		if (!BUF_USED(conn) && !refill_buffer(conn))
-			break; /* EOF */
+		if (resp->chunk_state == CHUNK_DATA && BUF_USED(conn)) {
+			n = copy_from_buffer(conn, p + ret, want);
+			consume_chunk_data(resp, n);
+			ret += n;
+			continue;
+		}
 
-		p = memchr(BUF_BEGIN(conn), '\n', BUF_USED(conn));
+		if (resp->chunk_state != CHUNK_DATA &&
+		    (line = take_line(conn)) != NULL) {
+			if (!process_chunk_line(line, resp))
+				return -1;
+			continue;
+		}
 
-		n = p ? p - BUF_BEGIN(conn) : buf_size - line_len;
-		n = copy_from_buffer(conn, buf + line_len, n);
-		assert(n > 0);
-		line_len += n;
+		/* Need more data */
+		if (resp->chunk_state == CHUNK_DATA && want >= BUF_SIZE) {
+			n = recv_some(conn, p + ret, want, nonblock || ret > 0);
+			if (n > 0) {
+				consume_chunk_data(resp, n);
+				ret += n;
+				continue;
+			}
+		} else {
+			if (BUF_USED(conn) >= HTTP_LINE_MAX) {
+				set_last_error("Invalid response: "
+					       "Line too long");
+				return -1;
+			}
+			n = fill_buffer(conn, nonblock || ret > 0);
+			if (n > 0)
+				continue;
+		}
 
-		/* line separator found - we're done */
-		if (p) {
-			/* pop '\n' from the buffer */
-			conn->buf_begin++;
+		/*
+		 * Out of data. Return what we've got so far, if anything;
+		 * EOF or error will be hit again on the next call.
+		 */
+		if (ret > 0)
 			break;
-		}
+		if (n < 0)
+			return n;
+		n = chunked_eof(resp);
+		if (n < 0)
+			conn->failed = true;	/* may be resumed */
+		return n;
 	}
-
-	/* strip '\r' from the end; note, we don't complain if it's absent,
-	 * i.e. we effectively accept "\n" as line separator */
-	if (line_len > 0 && buf[line_len - 1] == '\r')
-		line_len--;
-
-	/* add terminating nul if there's space left */
-	if (line_len < buf_size)
-		buf[line_len] = '\0';
-
-	return line_len;
+	return ret;
 }
 
-/*
- * Size of @buf must equal %HTTP_LINE_MAX.
- */
-static bool recv_header_line(struct http_connection *conn, char *buf)
+static ssize_t simple_read(struct http_response *resp, void *buf, size_t len,
+			   bool nonblock)
 {
-	size_t n;
+	struct http_connection *conn = &resp->conn;
+	ssize_t n;
 
-	n = recv_line(conn, buf, HTTP_LINE_MAX);
-	if (conn->failed)
-		return false;
-	if (n >= HTTP_LINE_MAX) {
-		set_last_error("Invalid response: Header line too long");
-		return false;
+	/*
+	 * Stop as soon as we've received as much as was announced. The point
+	 * is that the server is allowed to leave the connection open after
+	 * sending out a response, so if we ignore Content-Length and continue
+	 * receiving data, we might get stuck forever.
+	 */
+	if (resp->sized) {
+		assert(resp->body_read <= resp->body_size);
+		len = min(len, resp->body_size - resp->body_read);
 	}
-	dump("< %s\n", buf);
-	return true;
-}
 
-/*
- * Given a string supposedly containing a http response status line, try to
- * parse it. On success return %true and initialize @resp->version,
- * @resp->status, and @resp->reason accordingly.
- */
-static bool parse_status(char *str, struct http_response *resp)
-{
-	char *p;
+	if (!len)
+		return 0;
 
-	if (strncasecmp(str, "HTTP/", 5) != 0)
-		goto invalid_status;
-	str += 5;
+	if (!nonblock)
+		n = buffered_recv(conn, buf, len);
+	else if (BUF_USED(conn))
+		n = copy_from_buffer(conn, buf, len);
+	else {
+		n = recv_some(conn, buf, len, true);
+		if (n < 0)
+			return n;
+	}
 
-	/* skip version */
-	p = findspace(str);
+	resp->body_read += n;
+	if (n)
+		return n;
 
-	resp->version = -1;
-	/* all known versions consist of 3 characters */
-	if (p - str == 3) {
-		if (strncmp(str, "0.9", 3) == 0)
-			resp->version = 9;
-		if (strncmp(str, "1.0", 3) == 0)
-			resp->version = 10;
-		if (strncmp(str, "1.1", 3) == 0)
-			resp->version = 11;
-	}
+	if (conn->failed)
+		return -1;
 
-	if (resp->version < 0) {
-		*p = '\0';
-		set_last_error("Invalid response: "
-			       "Unknown protocol version: %s", str);
-		goto fail;
+	/* EOF - check that Content-Length is correct */
+	if (resp->body_read < resp->body_size) {
+		set_last_error("Response body shorter than announced");
+		conn->failed = true;	/* may be resumed */
+		return -1;
 	}
 
-	str = skipspaces(p);
-	resp->status = strtol(str, &p, 10);
+	return 0;
+}
 
-	/* Status code consists of exactly 3 digits */
-	if (p - str != 3 || !isspace(*p) || resp->status < 100)
-		goto invalid_status;
+bool http_response_next_header(const struct http_response *resp,
+			       size_t *iter, const char **field,
+			       const char **value)
+{
+	const char *p;
 
-	str = skipspaces(p);
-	if (!*str) {
-		set_last_error("Invalid response: "
-			       "Reason message missing");
-		goto fail;
-	}
+	if (*iter >= resp->headers_len)
+		return false;
 
-	resp->reason = xstrdup(str);
+	p = resp->headers + *iter;
+	*field = p;
+	p += strlen(p) + 1;
+	*value = p;
+	p += strlen(p) + 1;
+	*iter = p - resp->headers;
 	return true;
-
-invalid_status:
-	set_last_error("Invalid response status");
-fail:
-	return false;
 }
 
-/*
- * Given a string supposedly containing a http header, try to parse it.
- * On success, return %true and initialize @field and @value.
- */
-static bool parse_header(char *str, char **field, char **value)
+const char *http_response_header(const struct http_response *resp,
+				 const char *field)
 {
-	char *p;
+	const char *f, *v;
+	size_t iter = 0;
 
-	p = strchr(str, ':');
-	if (!p) {
-		set_last_error("Invalid response header: `:' missing");
-		return false;
-	}
-	*p = '\0';
-
-	*field = strstrip(str);
-	if (strempty(*field)) {
-		set_last_error("Invalid response header: Field name missing");
-		return false;
+	while (http_response_next_header(resp, &iter, &f, &v)) {
+		if (strcasecmp(f, field) == 0)
+			return v;
 	}
+	return NULL;
+}
 
-	*value = strstrip(p + 1);
-	if (strempty(*value)) {
-		set_last_error("Invalid response header: Value missing");
-		return false;
+/*
+ * Account for a return value of a body reading function called for @len
+ * bytes.
+ */
+static void note_read(struct http_response *resp, ssize_t n, size_t len)
+{
+	if (n > 0)
+		resp->retries = 0;
+	else if (!n && len && !resp->stats.timing.body_done) {
+		resp->stats.timing.body_done = now_us();
+		sample_tcp(&resp->conn, resp->stats.timing.body_done);
 	}
-
-	return true;
 }
 
-static bool parse_size(const char *s, int base, size_t *result)
+/*
+ * Read the body of @resp as it is sent, i.e. without decompressing it,
+ * resuming the transfer on failure.
+ */
+static ssize_t raw_read(struct http_response *resp, void *buf, size_t len)
 {
-	long long x;
+	ssize_t n;
 
-	if (!strict_strtoll(s, base, &x) || x < 0 || x > SIZE_MAX)
-		return false;
+	do {
+		if (resp->chunked)
+			n = chunked_read(resp, buf, len, false);
+		else
+			n = simple_read(resp, buf, len, false);
+	} while (n < 0 && resume_response(resp));
 
-	*result = x;
-	return true;
+	note_read(resp, n, len);
+	return n;
 }
 
-struct http_header_handler {
-	/*
-	 * The field name which this handler handles.
-	 */
-	const char *field;
+/*
+ * Initialize the decompressor once enough data has been received.
+ */
+static bool start_decoder(struct http_decoder *d)
+{
+	const unsigned char *p = d->zs.next_in;
 
 	/*
-	 * The handler function. It is supposed to set @resp according to the
-	 * header value, passed in @value, and return %true on success.
+	 * Deflate coding is supposed to be zlib-wrapped, but some servers
+	 * send raw deflate data. Tell one from the other by the zlib header.
 	 */
-	bool (*handle)(char *value, struct http_response *resp);
-};
-
-static bool handle_content_length_header(char *s, struct http_response *resp)
-{
-	/* Content-Length is ignored for chunked responses */
-	if (resp->chunked)
-		return true;
+	if (!d->window_bits) {
+		if (d->zs.avail_in < 2)
+			return true;
+		if ((p[0] & 0x0f) == Z_DEFLATED && ((p[0] << 8) | p[1]) % 31 == 0)
+			d->window_bits = MAX_WBITS;
+		else
+			d->window_bits = -MAX_WBITS;
+	}
 
-	if (!parse_size(s, 10, &resp->body_size)) {
-		set_last_error("Failed to parse `Content-Length' header: %s", s);
+	if (inflateInit2(&d->zs, d->window_bits) != Z_OK) {
+		set_last_error("Failed to initialize decompressor: %s",
+			       d->zs.msg ? d->zs.msg : "unknown error");
 		return false;
 	}
+	d->ready = true;
 	return true;
 }
 
-static bool handle_content_range_header(char *s, struct http_response *resp)
+static ssize_t decoded_read(struct http_response *resp, void *buf, size_t len)
 {
-	/*
-	 * Example of an expected value:
-	 *
-	 * Content-Range: bytes 100-200/300
-	 *
-	 * We're pedantic, so don't trust sscanf.
-	 */
-	char *orig_s = s, *dash_pos = NULL, *slash_pos = NULL;
+	struct http_decoder *d = resp->decoder;
+	ssize_t n;
+	int ret;
 
-	/* unit - we only support bytes */
-	if (strncasecmp(s, "bytes", 5) != 0)
-		goto fail;
-	s += 5;
-	if (!isspace(*s))
-		goto fail;
-	s = skipspaces(s);
+	if (!len)
+		return 0;
 
-	/* index of the first byte in the range */
-	dash_pos = strchr(s, '-');
-	if (!dash_pos)
-		goto fail;
-	*dash_pos = '\0';
-	if (!parse_size(s, 10, &resp->range_first))
-		goto fail;
-	s = dash_pos + 1;
+	while (1) {
+		if (d->ready && d->zs.avail_in > 0) {
+			d->zs.next_out = buf;
+			d->zs.avail_out = min(len, (size_t)UINT_MAX);
+			ret = inflate(&d->zs, Z_NO_FLUSH);
+			n = (unsigned char *)d->zs.next_out - (unsigned char *)buf;
+
+			if (ret == Z_STREAM_END) {
+				/* gzip allows concatenated members */
+				if (d->window_bits > MAX_WBITS &&
+				    d->zs.avail_in > 0)
+					inflateReset(&d->zs);
+				else {
+					d->done = true;
+					d->zs.avail_in = 0;
+				}
+			} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+				set_last_error("Failed to decompress body: %s",
+					       d->zs.msg ? d->zs.msg :
+					       "corrupted data");
+				return -1;
+			}
+
+			if (n > 0)
+				return n;
+			if (d->zs.avail_in > 0 && ret != Z_BUF_ERROR)
+				continue;	/* next gzip member */
+		}
 
-	/* index of the last byte in the range */
-	slash_pos = strchr(s, '/');
-	if (!slash_pos)
-		goto fail;
-	*slash_pos = '\0';
-	if (!parse_size(s, 10, &resp->range_last))
-		goto fail;
-	s = slash_pos + 1;
+		/* Need more compressed data */
+		if (d->zs.avail_in > 0)
+			memmove(d->buf, d->zs.next_in, d->zs.avail_in);
+		d->zs.next_in = d->buf;
 
-	/* total number of bytes in the file */
-	if (!parse_size(s, 10, &resp->range_total))
-		goto fail;
+		n = raw_read(resp, d->buf + d->zs.avail_in,
+			     sizeof(d->buf) - d->zs.avail_in);
+		if (n < 0)
+			return -1;
+		if (!n) {
+			if (d->done)
+				return 0;
+			set_last_error("Compressed body truncated");
+			return -1;
+		}
 
-	/* sanity check */
-	if (resp->range_first > resp->range_last ||
-	    resp->range_last >= resp->range_total)
-		goto fail;
+		/* Ignore anything past the end of the compressed stream */
+		if (d->done)
+			continue;
 
-	resp->ranged = 1;
-	return true;
+		d->zs.avail_in += n;
+		if (!d->ready && !start_decoder(d))
+			return -1;
+	}
+}
 
-fail:
-	/* restore the original header value for error reporting */
-	s = orig_s;
-	if (dash_pos)
-		*dash_pos = '-';
-	if (slash_pos)
-		*slash_pos = '/';
-	set_last_error("Failed to parse `Content-Range' header: %s", s);
-	return false;
+ssize_t http_response_read(struct http_response *resp, void *buf, size_t len)
+{
+	if (resp->decoder)
+		return decoded_read(resp, buf, len);
+	return raw_read(resp, buf, len);
 }
 
-static bool handle_transfer_encoding_header(char *s, struct http_response *resp)
+/*
+ * Write @len bytes from @buf to @fd, at *@offset if @offset is not %NULL.
+ * On failure sets @last_error and returns %false.
+ */
+static bool write_out(int fd, loff_t *offset, const char *buf, size_t len)
 {
-	/* Looking for "chunked" at the end */
-	const char *chunked_str = "chunked";
-	const size_t chunked_strlen = sizeof(chunked_str) - 1;
+	while (len > 0) {
+		ssize_t n;
 
-	size_t len = strlen(s);
+		if (offset)
+			n = pwrite(fd, buf, len, *offset);
+		else
+			n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			set_last_error_errno(errno, "Write failed");
+			return false;
+		}
 
-	if (len >= chunked_strlen &&
-	    strcasecmp(s + len - chunked_strlen, chunked_str) == 0) {
-		resp->chunked = 1;
+		assert(n > 0);
+		assert(n <= len);
 
-		/* Content-Length is ignored for chunked responses */
-		resp->body_size = 0;
+		buf += n;
+		len -= n;
+		if (offset)
+			*offset += n;
 	}
 	return true;
 }
 
-static bool handle_location_header(char *s, struct http_response *resp)
+/*
+ * Receive up to @len bytes of the body and write them to @fd through a user
+ * space buffer. Used when @fd doesn't support splice(2).
+ */
+static ssize_t copy_body(struct http_response *resp, int fd, loff_t *offset,
+			 size_t len)
 {
-	resp->location = url_alloc(s);
-	if (!resp->location) {
-		set_last_error("Failed to parse `Location' header: %s", s);
-		return false;
+	char buf[BUF_SIZE];
+	size_t n;
+
+	n = do_recv(&resp->conn, buf, min(len, sizeof(buf)), false);
+	if (resp->conn.failed)
+		return -1;
+	if (!write_out(fd, offset, buf, n))
+		return -1;
+	return n;
+}
+
+/*
+ * Move @len bytes sitting in @resp->splice_pipe to @fd. If @fd turns out not
+ * to support splice(2), read them out of the pipe and write in the usual way.
+ */
+static bool flush_pipe(struct http_response *resp, int fd, loff_t *offset,
+		       size_t len)
+{
+	char buf[BUF_SIZE];
+	ssize_t n;
+
+	while (len > 0 && !resp->no_splice) {
+		n = splice(resp->splice_pipe[0], NULL, fd, offset, len,
+			   SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL) {
+				resp->no_splice = 1;
+				break;
+			}
+			set_last_error_errno(errno, "Write failed");
+			return false;
+		}
+		assert(n > 0);
+		assert(n <= len);
+		len -= n;
+	}
+
+	while (len > 0) {
+		n = read(resp->splice_pipe[0], buf, min(len, sizeof(buf)));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			set_last_error_errno(errno, "Pipe read failed");
+			return false;
+		}
+		assert(n > 0);
+		if (!write_out(fd, offset, buf, n))
+			return false;
+		len -= n;
 	}
 	return true;
 }
 
-static struct http_header_handler header_handlers[] = {
-	{ "Content-Length",		handle_content_length_header, },
-	{ "Content-Range",		handle_content_range_header, },
-	{ "Transfer-Encoding",		handle_transfer_encoding_header, },
-	{ "Location",			handle_location_header, },
-	{ }, /* terminate */
-};
-
 /*
- * Given a header, call the corresponding handler, if any.
+ * Receive up to @len bytes of the body and move them to @fd with splice(2).
+ * Since one end of splice(2) must be a pipe, data go through
+ * @resp->splice_pipe unless @fd is a pipe itself.
  */
-static bool handle_header(char *field, char *value, struct http_response *resp)
+static ssize_t splice_body(struct http_response *resp, int fd, loff_t *offset,
+			   size_t len)
 {
-	struct http_header_handler *h;
-	bool ret = true;
+	struct http_connection *conn = &resp->conn;
+	struct stat st;
+	ssize_t n;
 
-	for (h = header_handlers; h->handle; h++) {
-		if (strcasecmp(h->field, field) == 0) {
-			ret = h->handle(value, resp);
-			break;
+	if (conn->failed)
+		return -1;	/* reported by the previous call */
+
+	if (resp->no_splice)
+		return copy_body(resp, fd, offset, len);
+
+	/* splice(2) can't be told not to block on a socket, so wait first */
+	if (conn->timed && !wait_socket(conn, POLLIN))
+		return -1;
+
+	if (!offset && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		do {
+			n = splice(conn->sockfd, NULL, fd, NULL, len,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			set_last_error_errno(errno, "Splice failed");
+			conn->failed = true;
+		} else if (n > 0)
+			note_recv(conn, n);	/* a stall is reported next time */
+		return n;
+	}
+
+	if (resp->splice_pipe[0] < 0) {
+		if (pipe2(resp->splice_pipe, O_CLOEXEC) != 0) {
+			set_last_error_errno(errno, "Failed to create pipe");
+			resp->splice_pipe[0] = resp->splice_pipe[1] = -1;
+			return -1;
 		}
+		/* Fewer syscalls per byte with a bigger pipe. Not critical. */
+		fcntl(resp->splice_pipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
 	}
-	return ret;
+
+	/*
+	 * The pipe is empty here, so this never blocks on the pipe: once it
+	 * fills up, splice(2) returns what it has moved so far.
+	 */
+	do {
+		n = splice(conn->sockfd, NULL, resp->splice_pipe[1], NULL,
+			   min(len, (size_t)SPLICE_PIPE_SIZE),
+			   SPLICE_F_MOVE | SPLICE_F_MORE);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		set_last_error_errno(errno, "Receive failed");
+		conn->failed = true;
+		return -1;
+	}
+
+	if (!flush_pipe(resp, fd, offset, n))
+		return -1;
+	if (n > 0)
+		note_recv(conn, n);	/* a stall is reported next time */
+	return n;
 }
 
 /*
- * Receive a http response. Return %true on success.
+ * Receive up to @len bytes of the body and write them to @fd with io_uring.
+ *
+ * Each buffer registered with @ring gets a receive followed by a write of the
+ * same buffer, and all of them are linked in a single chain. The receives use
+ * MSG_WAITALL, so a buffer is either filled up or the body is over. A short
+ * receive or write fails the chain, cancelling the rest of it, so the data
+ * land in the file in order and we only have to finish the broken link by
+ * hand. uring_init() fails on kernels that don't cancel the write linked to
+ * a short receive, so that the body is spliced instead.
+ *
+ * There's no waiting for the socket with poll() here, so if timeouts are set,
+ * each receive is bounded by a linked timeout instead. It can only limit the
+ * time it takes to fill a whole buffer, so the idle timeout, or else the stall
+ * detection interval, is used for that.
  */
-static bool recv_response(struct http_connection *conn,
-			  struct http_response *resp)
+static ssize_t uring_body(struct http_response *resp, struct uring *ring,
+			  int fd, loff_t *offset, size_t len)
 {
-	char *buf;
-	bool ret = false;
+	struct http_connection *conn = &resp->conn;
+	struct io_uring_sqe *sqe = NULL;
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec ts;
+	int res[3 * URING_CHAIN_MAX];
+	size_t size[URING_CHAIN_MAX];
+	size_t queued = 0;
+	ssize_t ret = 0;
+	int i, nr = 0, ops;
+	int timeout = 0;
+
+	if (conn->failed)
+		return -1;	/* reported by the previous call */
+
+	if (conn->timed)
+		timeout = conn->timeouts.idle ? conn->timeouts.idle :
+			conn->timeouts.stall_time;
+	ops = timeout ? 3 : 2;	/* receive, write, and timeout */
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+
+	while (nr < ring->nr_bufs && nr < URING_CHAIN_MAX && queued < len) {
+		char *buf = uring_buf(ring, nr);
+
+		size[nr] = min(len - queued, ring->buf_size);
+
+		sqe = uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = conn->sockfd;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = size[nr];
+		sqe->msg_flags = MSG_WAITALL;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = ops * nr;
+
+		if (timeout) {
+			sqe = uring_get_sqe(ring);
+			sqe->opcode = IORING_OP_LINK_TIMEOUT;
+			sqe->addr = (unsigned long)&ts;
+			sqe->len = 1;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = ops * nr + 2;
+		}
 
-	buf = xmalloc(HTTP_LINE_MAX);
+		sqe = uring_get_sqe(ring);
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = size[nr];
+		sqe->off = offset ? *offset + queued : -1;
+		sqe->buf_index = nr;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = ops * nr + 1;
+
+		queued += size[nr++];
+	}
+	sqe->flags = 0;		/* end of chain */
 
-	/* Get status */
-	if (!recv_header_line(conn, buf) ||
-	    !parse_status(buf, resp))
-		goto out;
+	if (!uring_submit(ring, ops * nr)) {
+		set_last_error_errno(errno, "io_uring submission failed");
+		conn->failed = true;
+		return -1;
+	}
 
-	/* Proceed to the headers */
-	while (1) {
-		char *field, *value;
+	for (i = 0; i < ops * nr; i++) {
+		cqe = uring_peek_cqe(ring);
+		assert(cqe);
+		assert(cqe->user_data < ops * nr);
+		res[cqe->user_data] = cqe->res;
+		uring_cqe_seen(ring);
+	}
 
-		if (!recv_header_line(conn, buf))
-			goto err_hdrs;
+	for (i = 0; i < nr; i++) {
+		int r = res[ops * i], w = res[ops * i + 1];
 
-		/* Empty line? Proceed to the message body */
-		if (buf[0] == '\0')
+		/*
+		 * On receive failure, return what has been written so far,
+		 * if anything, so that the caller knows where the body left
+		 * off. The error is reported by the next call then.
+		 */
+		if (timeout && res[ops * i + 2] == -ETIME) {
+			set_last_error("Timed out %s: %zu bytes not received "
+				       "in %d ms", phase_names[conn->phase],
+				       size[i], timeout);
+			timed_out(conn);
+			break;
+		}
+		if (r < 0) {
+			set_last_error_errno(-r, "Receive failed");
+			conn->failed = true;
 			break;
+		}
+		if (w < 0 && w != -ECANCELED) {
+			set_last_error_errno(-w, "Write failed");
+			return -1;
+		}
+		w = max(w, 0);
+
+		if (w < r) {
+			loff_t pos;
+
+			if (offset)
+				pos = *offset + ret + w;
+			if (!write_out(fd, offset ? &pos : NULL,
+				       uring_buf(ring, i) + w, r - w))
+				return -1;
+		}
+		ret += r;
 
-		if (!parse_header(buf, &field, &value) ||
-		    !handle_header(field, value, resp))
-			goto err_hdrs;
+		/* the rest of the chain was cancelled */
+		if (r < size[i] || w < r)
+			break;
 	}
 
-	ret = true;
-out:
-	free(buf);
+	if (!ret && conn->failed)
+		return -1;
+	if (offset)
+		*offset += ret;
+	if (ret > 0)
+		note_recv(conn, ret);	/* a stall is reported next time */
 	return ret;
-err_hdrs:
-	free(resp->reason);
-	goto out;
 }
 
-static bool check_range(const struct http_request_info *info,
-			struct http_response *resp)
+/*
+ * Common part of http_response_splice() and http_response_uring(). If @ring
+ * is %NULL, the body is spliced.
+ */
+static ssize_t move_body(struct http_response *resp, struct uring *ring,
+			 int fd, off_t *offset, size_t len)
 {
-	size_t first = 0, last = resp->range_total - 1;
+	struct http_connection *conn = &resp->conn;
+	loff_t pos, *ppos = NULL;
+	ssize_t n;
 
-	if (info->want_range) {
-		first = info->range_first;
-		if (info->range_last != SIZE_MAX)
-			last = info->range_last;
+	if (resp->chunked) {
+		set_last_error("Cannot move chunked body");
+		return -1;
+	}
+	if (resp->decoder) {
+		set_last_error("Cannot move compressed body");
+		return -1;
 	}
 
-	if (first != resp->range_first || last != resp->range_last) {
-		set_last_error("Received range differs from requested: "
-			       "requested %zu-%zu, received %zu-%zu",
-			       first, last, resp->range_first, resp->range_last);
-		return false;
+	/* Do not read beyond the body, see simple_read() */
+	if (resp->sized) {
+		assert(resp->body_read <= resp->body_size);
+		len = min(len, resp->body_size - resp->body_read);
 	}
 
-	return true;
-}
+	if (!len)
+		return 0;
 
-static bool load_chunk(struct http_connection *conn,
-		       struct http_response *resp)
-{
-	char buf[16]; /* should be enough for storing chunk size */
+	if (offset) {
+		pos = *offset;
+		ppos = &pos;
+	}
 
-	if (recv_line(conn, buf, sizeof(buf)) >= sizeof(buf) ||
-	    !parse_size(buf, 16, &resp->chunk_size)) {
-		if (!conn->failed)
-			set_last_error("Failed to parse response chunk size");
-		return false;
+	/* First, flush what was received along with the response head */
+	if (BUF_USED(conn)) {
+		n = min(BUF_USED(conn), len);
+		if (!write_out(fd, ppos, BUF_BEGIN(conn), n))
+			return -1;
+		conn->buf_begin += n;
+	} else {
+		/* Recording and replaying need the data in user space */
+		if (conn->replay || resp->record)
+			n = copy_body(resp, fd, ppos, len);
+		else if (ring)
+			n = uring_body(resp, ring, fd, ppos, len);
+		else
+			n = splice_body(resp, fd, ppos, len);
+		if (n < 0)
+			return -1;
 	}
-	return true;
-}
 
-static bool __http_simple_request(const struct http_request_info *info,
-				  struct http_response *resp)
-{
-	struct http_connection *conn = &resp->conn;
+	if (offset)
+		*offset = pos;
 
-	init_response(resp);
+	resp->body_read += n;
+	if (n)
+		return n;
 
-	if (!do_connect(info->host, info->port, conn))
-		goto fail;
+	/* EOF - check that Content-Length is correct */
+	if (resp->body_read < resp->body_size) {
+		set_last_error("Response body shorter than announced");
+		conn->failed = true;	/* may be resumed */
+		return -1;
+	}
 
-	if (!send_request(conn, info))
-		goto fail;
+	return 0;
+}
 
-	if (!recv_response(conn, resp))
-		goto fail;
+/*
+ * Common part of http_response_splice() and http_response_uring(): move the
+ * body resuming the transfer on connection failure.
+ */
+static ssize_t move_body_resume(struct http_response *resp, struct uring *ring,
+				int fd, off_t *offset, size_t len)
+{
+	ssize_t n;
 
-	/* Check requested-vs-received ranges */
-	if (resp->ranged && !check_range(info, resp))
-		goto fail;
+	while ((n = move_body(resp, ring, fd, offset, len)) < 0 &&
+	       resume_response(resp))
+		;
 
-	/* Load the first chunk - see chunked_read() */
-	if (resp->chunked && !load_chunk(conn, resp))
-		goto fail;
+	note_read(resp, n, len);
+	return n;
+}
 
-	return true;
-fail:
-	destroy_response(resp);
-	return false;
+ssize_t http_response_splice(struct http_response *resp, int fd,
+			     off_t *offset, size_t len)
+{
+	return move_body_resume(resp, NULL, fd, offset, len);
 }
 
-bool http_simple_request(const struct http_request_info *info,
-			 struct http_response *resp)
+ssize_t http_response_uring(struct http_response *resp, struct uring *ring,
+			    int fd, off_t *offset, size_t len)
 {
-	/* we will need to modify request info, so copy it */
-	struct http_request_info i = *info;
-	struct url_struct *url = NULL;
-	bool ret;
+	return move_body_resume(resp, ring, fd, offset, len);
+}
 
-	while (1) {
-		ret = __http_simple_request(&i, resp);
-		if (!ret)
-			break;
+void http_response_destroy(struct http_response *resp)
+{
+	destroy_response(resp);
+}
 
-		/* Hit the redirection limit? Stop now. */
-		if (i.max_redirections >= 0 && i.max_redirections-- == 0)
-			break;
+/*
+ * Non-blocking requests.
+ *
+ * A non-blocking request goes through the same phases as a blocking one, but
+ * each phase is split into steps that never block. A step returns 0 when the
+ * request advances to the next phase, %HTTP_AGAIN if it has to wait for the
+ * socket to become ready, or -1 on failure.
+ */
 
-		/* Not a redirection response? We're done then. */
-		if (!HTTP_STATUS_REDIRECT(resp->status))
-			break;
+enum async_state {
+	ASYNC_CONNECT,		/* waiting for connect() to complete */
+	ASYNC_SEND,		/* sending the request */
+	ASYNC_HEAD,		/* receiving the status line and headers */
+	ASYNC_DRAIN,		/* skipping the body of a redirect response */
+	ASYNC_BODY,		/* response head received */
+	ASYNC_FAILED,
+};
 
-		/* Redirected, but not given the new location?
-		 * Suspicious. Can't continue. */
-		if (!resp->location)
-			break;
+/*
+ * Start connecting to the next address in @req->ai_next list. Return %true
+ * if the connection has been established or is in progress.
+ */
+static bool async_connect_next(struct http_async *req)
+{
+	struct http_connection *conn = &req->resp.conn;
+	struct addrinfo *ai;
+	int sockfd;
+	bool done;
+
+	while ((ai = req->ai_next) != NULL) {
+		req->ai_next = ai->ai_next;
+
+		sockfd = start_connect(&req->resp,
+				       req->addrs->ai->ai_canonname, ai,
+				       &req->info.sockopts,
+				       &req->connect_err, &done);
+		if (sockfd >= 0) {
+			conn->sockfd = sockfd;
+			return true;
+		}
+	}
 
-		/* Unsupported target url scheme? Stop now. */
-		if (resp->location->scheme &&
-		    strcmp(resp->location->scheme, HTTP_URL_SCHEME) != 0)
-			break;
+	set_last_error_errno(req->connect_err, "Failed to connect");
+	return false;
+}
 
-		url_free(url);
-		url = resp->location;
-		resp->location = NULL; /* Prevent destroy_response()
-					  from destroying the url */
+static void async_send_request(struct http_async *req)
+{
+	struct request_buf rb = {
+		.allocator	= &req->resp.arena.allocator,
+	};
 
-		/*
-		 * TODO: Reuse resources/connection left from the previous
-		 * response if possible.
-		 */
-		destroy_response(resp);
+	compose_request(&rb, &req->resp.conn, &req->info, req->req_iov);
+	req->req_iovcnt = HTTP_REQUEST_IOVS;
 
-		/*
-		 * Do not send credentials when redirecting to another host
-		 * unless explicitly allowed.
-		 */
-		if (i.creds && !i.trusted_location &&
-		    strcasecmp(url->host, i.host) != 0)
-			i.creds = NULL;
+	req->state = ASYNC_SEND;
+}
 
-		if (url->host) {
-			i.host = url->host;
-			i.port = url->port;
-		}
-		i.path = url->path;
+/*
+ * Start the request defined by @req->info: take a connection from the pool,
+ * unless @use_pool is unset, or begin to establish a new one. Return %true
+ * on success. @req->resp must be initialized.
+ */
+static bool async_open(struct http_async *req, bool use_pool)
+{
+	struct http_connection *conn = &req->resp.conn;
+	const char *host = req->info.host;
+	int port = req->info.port >= 0 ? req->info.port : HTTP_PORT;
+
+	if (use_pool && reuse_connection(host, port, conn)) {
+		conn->sockopts = req->info.sockopts;
+		async_send_request(req);
+		return true;
 	}
-	url_free(url);
-	return ret;
+
+	if (req->addrs)
+		resolv_put(req->addrs);
+	req->addrs = resolve(host, port);
+	if (!req->addrs)
+		return false;
+	req->resp.stats.timing.resolved = now_us();
+
+	req->ai_next = req->addrs->ai;
+	req->connect_err = 0;
+	req->state = ASYNC_CONNECT;
+	return async_connect_next(req);
 }
 
-static ssize_t chunked_read(struct http_response *resp, void *buf, size_t len)
+static int async_connect(struct http_async *req)
 {
-	struct http_connection *conn = &resp->conn;
-	size_t n;
+	struct http_connection *conn = &req->resp.conn;
+	struct pollfd pfd = {
+		.fd		= conn->sockfd,
+		.events		= POLLOUT,
+	};
+	socklen_t len = sizeof(int);
+	int err, flags;
+
+	if (poll(&pfd, 1, 0) == 0)
+		return HTTP_AGAIN;
+
+	if (getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
 
-	if (!resp->chunk_size)
-		return 0;
+	if (err) {
+		/* Try the next address */
+		req->connect_err = err;
+		close(conn->sockfd);
+		conn->sockfd = -1;
+		return async_connect_next(req) ? 0 : -1;
+	}
 
-	/* Read from the current chunk */
-	len = min(len, resp->chunk_size);
-	n = buffered_recv(conn, buf, len);
-	if (n < len) {
-		if (!conn->failed)
-			set_last_error("Response chunk shorter than announced");
+	/*
+	 * Non-blocking requests don't need O_NONBLOCK after connect(), as
+	 * they use MSG_DONTWAIT, while the connection may be reused by a
+	 * blocking request once it gets to the pool.
+	 */
+	flags = fcntl(conn->sockfd, F_GETFL);
+	if (flags < 0 || fcntl(conn->sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		set_last_error_errno(errno, "Failed to set socket flags");
 		return -1;
 	}
 
-	resp->body_read += n;
-	resp->chunk_size -= n;
+	setup_connection(conn, req->info.host,
+			 req->info.port >= 0 ? req->info.port : HTTP_PORT);
+	conn->sockopts = req->info.sockopts;
+	async_send_request(req);
+	return 0;
+}
 
-	/*
-	 * If we're done with the current chunk, load the next one. We don't
-	 * have to read exactly as many bytes as requested, so we don't proceed
-	 * to reading the new chunk right now - it'll be done by the next call
-	 * to chunked_read().
-	 */
-	if (!resp->chunk_size) {
-		char crlf[2];
-
-		if (buffered_recv(conn, crlf, 2) != 2 ||
-		    strncmp(crlf, "\r\n", 2) != 0) {
-			if (!conn->failed)
-				set_last_error("Response chunk lacks "
-					       "terminating CRLF");
+static int async_send(struct http_async *req)
+{
+	struct http_connection *conn = &req->resp.conn;
+	struct msghdr msg = {
+		.msg_iov	= req->req_iov + HTTP_REQUEST_IOVS -
+				  req->req_iovcnt,
+		.msg_iovlen	= req->req_iovcnt,
+	};
+
+	while (msg.msg_iovlen > 0) {
+		ssize_t n;
+
+		n = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINPROGRESS)
+				return HTTP_AGAIN;
+			set_last_error_errno(errno, "Send failed");
+			conn->failed = true;
 			return -1;
 		}
-		if (!load_chunk(conn, resp))
-			return -1;
+		advance_iov(&msg.msg_iov, &msg.msg_iovlen, n);
+		req->req_iovcnt = msg.msg_iovlen;
+		req->resp.stats.bytes_sent += n;
 	}
 
-	return n;
+	req->resp.stats.timing.sent = now_us();
+	req->state = ASYNC_HEAD;
+	return 0;
 }
 
-static ssize_t simple_read(struct http_response *resp, void *buf, size_t len)
+static int async_recv_head(struct http_async *req)
 {
+	struct http_response *resp = &req->resp;
 	struct http_connection *conn = &resp->conn;
-	size_t n;
+	char *line, *colon;
+	ssize_t len;
+	int ret;
+
+	do {
+		len = recv_head_line(conn, true, &line, &colon);
+		if (len < 0)
+			return len;
+		ret = process_head_line(line, len, colon, resp);
+	} while (ret == 0);
+
+	if (ret < 0 || !finish_head(&req->info, resp))
+		return -1;
 
-	/*
-	 * Stop as soon as we've received as much as was announced. The point
-	 * is that the server is allowed to leave the connection open after
-	 * sending out a response, so if we ignore Content-Length and continue
-	 * receiving data, we might get stuck forever.
-	 */
-	if (resp->body_size > 0) {
-		assert(resp->body_read <= resp->body_size);
-		len = min(len, resp->body_size - resp->body_read);
+	if (follow_redirect(&req->info, resp, &req->url)) {
+		req->drained = 0;
+		req->state = ASYNC_DRAIN;
+	} else
+		req->state = ASYNC_BODY;
+	return 0;
+}
+
+/*
+ * Non-blocking version of drain_response(). Proceeds to the new location
+ * when done.
+ */
+static int async_drain(struct http_async *req)
+{
+	struct http_response *resp = &req->resp;
+	struct http_stats prev;
+	char buf[1024];
+	ssize_t n;
+
+	if (resp->keep_alive &&
+	    !(resp->sized && resp->body_size - resp->body_read > DRAIN_MAX)) {
+		do {
+			if (resp->chunked)
+				n = chunked_read(resp, buf, sizeof(buf), true);
+			else
+				n = simple_read(resp, buf, sizeof(buf), true);
+			if (n > 0)
+				req->drained += n;
+		} while (n > 0 && req->drained < DRAIN_MAX);
+
+		if (n == HTTP_AGAIN)
+			return HTTP_AGAIN;
 	}
 
-	n = buffered_recv(conn, buf, len);
-	resp->body_read += n;
-	if (n)
-		return n;
+	prev = resp->stats;
+	destroy_response(resp);
+	init_response(resp, &req->info);
+	add_hop(&resp->stats, &prev);
+	return async_open(req, true) ? 0 : -1;
+}
 
-	if (conn->failed)
-		return -1;
+bool http_async_start(struct http_async *req,
+		      const struct http_request_info *info)
+{
+	memset(req, 0, sizeof(*req));
+	init_response(&req->resp, info);
+	req->info = *info;
+	req->info.want_compression = 0;	/* not supported */
+
+	if (!async_open(req, true)) {
+		req->state = ASYNC_FAILED;
+		http_async_destroy(req);
+		return false;
+	}
+	return true;
+}
 
-	/* EOF - check that Content-Length is correct */
-	if (resp->body_read < resp->body_size) {
-		set_last_error("Response body shorter than announced");
-		return -1;
+int http_async_fd(const struct http_async *req)
+{
+	return req->resp.conn.sockfd;
+}
+
+int http_async_events(const struct http_async *req)
+{
+	switch (req->state) {
+	case ASYNC_CONNECT:
+	case ASYNC_SEND:
+		return POLLOUT;
+	default:
+		return POLLIN;
 	}
+}
 
-	return 0;
+int http_async_advance(struct http_async *req)
+{
+	struct http_connection *conn = &req->resp.conn;
+	int ret;
+
+	while (1) {
+		switch (req->state) {
+		case ASYNC_CONNECT:
+			ret = async_connect(req);
+			break;
+		case ASYNC_SEND:
+			ret = async_send(req);
+			break;
+		case ASYNC_HEAD:
+			ret = async_recv_head(req);
+			break;
+		case ASYNC_DRAIN:
+			ret = async_drain(req);
+			break;
+		case ASYNC_BODY:
+			return 0;
+		default:
+			return -1;
+		}
+
+		if (ret == HTTP_AGAIN)
+			return HTTP_AGAIN;
+
+		if (ret < 0) {
+			/* See __http_simple_request() */
+			if ((req->state == ASYNC_SEND ||
+			     req->state == ASYNC_HEAD) &&
+			    conn->reused && !req->resp.reason) {
+				close_connection(conn);
+				if (async_open(req, false))
+					continue;
+			}
+			req->state = ASYNC_FAILED;
+			return -1;
+		}
+	}
 }
 
-ssize_t http_response_read(struct http_response *resp, void *buf, size_t len)
+ssize_t http_async_read(struct http_async *req, void *buf, size_t len)
 {
+	struct http_response *resp = &req->resp;
+	ssize_t n;
+
+	assert(req->state == ASYNC_BODY);
+
 	if (resp->chunked)
-		return chunked_read(resp, buf, len);
+		n = chunked_read(resp, buf, len, true);
 	else
-		return simple_read(resp, buf, len);
+		n = simple_read(resp, buf, len, true);
+
+	note_read(resp, n, len);
+	return n;
 }
 
-void http_response_destroy(struct http_response *resp)
+void http_async_destroy(struct http_async *req)
 {
-	destroy_response(resp);
+	/* Only a response whose body is being read may be complete */
+	if (req->state != ASYNC_BODY)
+		req->resp.keep_alive = 0;
+
+	destroy_response(&req->resp);
+	url_free(req->url);
+	if (req->addrs)
+		resolv_put(req->addrs);
 }
@@ -20,29 +20,217 @@
 #ifndef _HTTP_H
 #define _HTTP_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdarg.h>
+#include <stdio.h>
 
 #include "url.h"
+#include "util.h"
+
+struct uring;
+struct http_decoder;
 
 #define HTTP_URL_SCHEME		"http"
 
+#define HTTP_AGAIN		(-2)	/* returned by non-blocking functions
+					   if they would block */
+
 typedef void (*http_dump_fn_t)(const char *, va_list);
 
 extern http_dump_fn_t http_dump_fn;	/* if set, this function will be used
-					   for dumping debug information */
+					   for dumping debug information of
+					   requests that have no trace hook;
+					   must not be changed while requests
+					   are in progress */
+
+/*
+ * Per-request counterpart of http_dump_fn, see http_request_info::trace.
+ */
+typedef void (*http_trace_fn_t)(void *arg, const char *fmt, va_list ap);
+
+/*
+ * Request timeouts, in milliseconds. Zero disables a timeout.
+ */
+struct http_timeouts {
+	int connect;		/* time given to each connection attempt */
+	int first_byte;		/* from sending the request to receiving the
+				   first byte of the response */
+	int idle;		/* max time to wait for the server to send or
+				   accept the next piece of data */
+
+	/*
+	 * Stall detection: the transfer is aborted if less than @min_speed
+	 * bytes per second of the response body are received over
+	 * @stall_time. Zero @stall_time disables the check.
+	 */
+	size_t min_speed;
+	int stall_time;
+};
+
+/*
+ * Socket tuning. TCP_NODELAY is always set, since a request is sent in one
+ * go, so Nagle's algorithm could only delay it.
+ */
+struct http_sockopts {
+	unsigned fast_open:1;	/* TCP Fast Open: on repeat connections to
+				   a server that supports it, send the
+				   request along with SYN, saving a round
+				   trip */
+	unsigned quickack:1;	/* ack received data at once rather than
+				   delay acks, so that the server's
+				   congestion window opens up faster */
+	unsigned autotune:1;	/* grow the receive buffer to the
+				   bandwidth-delay product measured as the
+				   body is received, see below */
+
+	/*
+	 * Receive buffer size in bytes, 0 for the system default. Applied
+	 * before connecting, so that the tcp window scale fits it.
+	 *
+	 * Note, setting the receive buffer size, either explicitly or by
+	 * autotuning, disables the kernel's own autotuning, which does the
+	 * same within net.ipv4.tcp_rmem limits. Only worth it if those are
+	 * too low for the link, as they may be on long fat networks. Either
+	 * way, the size is capped by net.core.rmem_max.
+	 */
+	int rcvbuf;
+};
+
+/*
+ * Request headers that only depend on the server and the credentials, i.e.
+ * Host and Authorization. They are composed once for a connection and sent
+ * as is with each request over it, while the server and the credentials stay
+ * the same.
+ */
+struct http_template {
+	char *data;		/* header lines, CRLF-terminated */
+	size_t len;
+	char *host;		/* what the headers were composed for; */
+	int port;		/* @creds is %NULL if there's no */
+	char *creds;		/* Authorization header */
+};
+
+/*
+ * A request is sent in this many parts: the request line, the headers kept
+ * in struct http_template, and the rest of the headers.
+ */
+#define HTTP_REQUEST_IOVS	3
+
+/*
+ * Received bytes captured with http_request_info::record, to be parsed again
+ * by http_response_replay().
+ */
+struct http_replay {
+	const char *data;
+	size_t len;
+	size_t pos;		/* where the next response starts */
+};
 
 struct http_connection {
 	int sockfd;		/* tcp socket corresponding to the http connection */
 	bool failed;		/* set if send/recv fails */
+	bool timed_out;		/* set along with @failed if a timeout
+				   expired */
+	bool reused;		/* set if the connection was taken from the
+				   pool of idle connections */
+
+	char *host;		/* server host name and port number the */
+	int port;		/* connection is established to; used as the
+				   key in the pool of idle connections */
+	struct http_template tmpl;	/* headers of the last request */
 
-	char *buf;		/* on send: used for caching output;
-				   on receive: used as buffer for received but
-				   not yet processed data */
+	char *buf;		/* buffer for received but not yet processed
+				   data */
 	size_t buf_begin;	/* index of the first actual byte in the buffer */
 	size_t buf_end;		/* index of the byte following the last actual
 				   byte in the buffer */
+
+	/* socket tuning for the request the connection is used for */
+	struct http_sockopts sockopts;
+	int64_t tune_time;	/* when the tcp state was last sampled */
+	size_t tune_bytes;	/* bytes received since then */
+	bool tune_capped;	/* the receive buffer can't grow anymore */
+
+	/* timeout tracking for the request the connection is used for */
+	struct http_timeouts timeouts;
+	bool timed;		/* some of @timeouts are set, so blocking
+				   send/recv go through poll() */
+	int phase;		/* request phase, for error messages */
+	int64_t first_byte_deadline;	/* 0 unless waiting for the first
+					   byte of the response */
+	int64_t stall_start;	/* beginning of the current stall detection
+				   window; 0 if the check is off */
+	size_t stall_bytes;	/* bytes received in the window */
+
+	struct http_replay *replay;	/* if not %NULL, data are received
+					   from there instead of @sockfd */
+};
+
+/*
+ * Timeline of a request. Timestamps are taken with now_us(). A timestamp
+ * is 0 if the request hasn't got that far.
+ */
+struct http_timing {
+	int64_t start;		/* request started */
+	int64_t resolved;	/* host name resolved; 0 if the connection
+				   was reused */
+	int64_t connected;	/* connection established or taken from
+				   the pool */
+	int64_t sent;		/* request sent */
+	int64_t first_byte;	/* first byte of the response received */
+	int64_t head_done;	/* response head received */
+	int64_t body_done;	/* response body read to the end */
+	bool reused;		/* the connection was taken from the pool */
+};
+
+/*
+ * State of the tcp connection, sampled with TCP_INFO once the response body
+ * has been received and, with autotuning on, as it is received. All zero if
+ * it has never been sampled.
+ */
+struct http_tcp_stats {
+	unsigned rtt;		/* smoothed round trip time, in us */
+	unsigned rcv_rtt;	/* round trip time as estimated by the
+				   receiving side, in us */
+	unsigned snd_cwnd;	/* congestion window of the sending side,
+				   in segments */
+	size_t rate;		/* bytes/s received since the previous
+				   sample, or since the body started */
+	size_t bdp;		/* bandwidth-delay product: @rate times
+				   @rtt, or @rcv_rtt if @rtt is unknown */
+	int rcvbuf;		/* receive buffer size as reported by
+				   SO_RCVBUF, in bytes */
+	bool fast_open;		/* the server accepted data along with
+				   SYN, i.e. TCP Fast Open worked */
+};
+
+/* Max number of redirections whose timings are kept */
+#define HTTP_STATS_HOPS		8
+
+/*
+ * Statistics of a request, including the redirections that led to it and
+ * the requests issued to resume the body transfer.
+ */
+struct http_stats {
+	struct http_timing timing;	/* of the final request */
+	struct http_tcp_stats tcp;	/* of the final connection */
+
+	int redirects;		/* number of redirections followed */
+	struct http_timing hops[HTTP_STATS_HOPS];	/* of the redirected
+							   requests, first
+							   ones only */
+	int resumes;		/* number of times the body transfer was
+				   resumed */
+
+	/* bytes on the wire, including heads, for all requests */
+	size_t bytes_sent;
+	size_t bytes_received;
+	unsigned long recv_calls;	/* number of receive operations that
+					   returned data */
 };
 
 struct http_response {
@@ -55,8 +243,13 @@ struct http_response {
 
 	unsigned ranged:1;	/* partial body */
 	unsigned chunked:1;	/* chunked body */
+	unsigned sized:1;	/* body length is known in advance */
+	unsigned keep_alive:1;	/* connection may be reused once the body
+				   has been read */
+	unsigned no_splice:1;	/* output doesn't support splice(2) */
 
-	size_t body_size;	/* content length; 0 if unavailable */
+	size_t body_size;	/* content length; 0 if unavailable
+				   (check @sized to tell it from an empty body) */
 	size_t body_read;	/* number of bytes read from body */
 
 	/* always 0 if @ranged is unset */
@@ -65,11 +258,39 @@ struct http_response {
 	size_t range_total;	/* total number of bytes in the file */
 
 	/* always 0 if @chunked is unset */
-	size_t chunk_size;	/* number of bytes left in current chunk;
-				   0 if we're done reading */
+	size_t chunk_size;	/* number of bytes left in current chunk */
+	int chunk_state;	/* chunked body decoder state */
 
 	struct url_struct *location;	/* if not %NULL, points to
 					   redirect location */
+
+	struct arena arena;	/* memory for everything the response
+				   refers to, except the connection */
+
+	char *headers;		/* all response headers, stored one after
+				   another as pairs of nul-terminated field
+				   name and value */
+	size_t headers_len;	/* number of bytes used in @headers */
+	size_t headers_size;	/* number of bytes allocated for @headers */
+
+	int splice_pipe[2];	/* pipe used by http_response_splice();
+				   -1 until needed */
+
+	struct http_request_info *request;	/* the request to repeat to
+						   resume the transfer; %NULL
+						   if it can't be resumed */
+	int retries;		/* failed attempts to resume since the last
+				   successful read */
+
+	struct http_decoder *decoder;	/* decompresses the body; %NULL
+					   unless it's compressed, see
+					   @want_compression */
+
+	struct http_stats stats;
+
+	FILE *record;		/* see http_request_info::record */
+	http_trace_fn_t trace;	/* see http_request_info::trace */
+	void *trace_arg;
 };
 
 #define HTTP_STATUS_OK(status)		((status) / 100 == 2)	/* 2xx */
@@ -83,6 +304,8 @@ struct http_request_info {
 	char *path;		/* http command path */
 
 	unsigned want_range:1;	/* for byte-serving, see below */
+	unsigned want_compression:1;	/* ask for gzip or deflate
+					   compressed body, see below */
 	unsigned trusted_location:1;	/* send credentials even when
 					   redirecting to another host */
 
@@ -90,6 +313,13 @@ struct http_request_info {
 	 * If @want_range is set, request a specific part of the file,
 	 * starting at @range_first byte and ending at @range_last byte.
 	 * Set @range_last to %SIZE_MAX for the last byte of the file.
+	 *
+	 * If @want_compression is set, the server may compress the body,
+	 * which http_response_read() then decompresses on the fly, while
+	 * @body_size and @body_read still count bytes on the wire. As ranges
+	 * of a compressed body can't be decompressed separately, the body is
+	 * passed as is if @want_range is set too. Not supported by
+	 * non-blocking requests.
 	 */
 	size_t range_first;
 	size_t range_last;
@@ -100,13 +330,42 @@ struct http_request_info {
 	char *creds;		/* if not %NULL, defines credentials for
 				   HTTP basic authentication in a form of
 				   `user:password' */
+
+	char *if_range;		/* if not %NULL, sent in If-Range header
+				   along with a range request, so that the
+				   whole file is returned if it has changed */
+
+	char *if_none_match;	/* if not %NULL, sent in If-None-Match and */
+	char *if_modified_since;	/* If-Modified-Since headers, so that
+					   304 is returned instead of the file
+					   if it hasn't changed */
+
+	struct http_timeouts timeouts;	/* not applied to non-blocking
+					   requests */
+
+	struct http_sockopts sockopts;	/* applied to new connections;
+					   autotuning and quick acks, to
+					   reused ones as well */
+
+	int max_retries;	/* max number of attempts in a row to resume
+				   the body transfer after a connection
+				   failure, see http_response_read() */
+
+	FILE *record;		/* if not %NULL, all bytes received in
+				   response, including heads and chunked
+				   framing, are written there as is */
+
+	http_trace_fn_t trace;	/* if set, debug information on this request
+				   is passed there along with @trace_arg
+				   instead of http_dump_fn */
+	void *trace_arg;
 };
 
 /**
  * http_last_error - return the last error
  *
- * Returns the error message set by the last failed http_* method.
- * The caller must not modify the returned string.
+ * Returns the error message set by the last failed http_* method called by
+ * the current thread. The caller must not modify the returned string.
  */
 const char *http_last_error(void);
 
@@ -125,6 +384,50 @@ const char *http_last_error(void);
 bool http_simple_request(const struct http_request_info *info,
 			 struct http_response *resp);
 
+/**
+ * http_response_header - look up a response header
+ * @resp: the response
+ * @field: the header field name, case-insensitive
+ *
+ * Returns the value of the first header with the given name, or %NULL if
+ * there's no such header. The value is stripped of surrounding spaces and
+ * stays valid until @resp is destroyed.
+ */
+const char *http_response_header(const struct http_response *resp,
+				 const char *field);
+
+/**
+ * http_response_next_header - iterate over response headers
+ * @resp: the response
+ * @iter: the iterator; must be initialized to 0 before the first call
+ * @field: location to store the header field name
+ * @value: location to store the header value
+ *
+ * Returns %true and sets @field and @value to the next header, in the order
+ * they were received, or returns %false if there are no more headers. The
+ * strings stay valid until @resp is destroyed.
+ */
+bool http_response_next_header(const struct http_response *resp,
+			       size_t *iter, const char **field,
+			       const char **value);
+
+/**
+ * http_response_replay - parse a response captured earlier
+ * @info: the request the response was received for
+ * @replay: the captured data; the response is taken at @replay->pos
+ * @resp: the response to initialize
+ *
+ * Same as http_simple_request(), but the response is parsed from memory
+ * rather than received, which is handy for measuring the cost of parsing
+ * alone. Redirections are not followed and failed transfers are not resumed.
+ *
+ * Once @resp has been read to the end and destroyed, @replay->pos points to
+ * the next response, if any.
+ */
+bool http_response_replay(const struct http_request_info *info,
+			  struct http_replay *replay,
+			  struct http_response *resp);
+
 /**
  * http_response_read - read the body of a http response
  * @resp: the response
@@ -134,15 +437,174 @@ bool http_simple_request(const struct http_request_info *info,
  * Returns the number of bytes read on success or -1 on error, in which case
  * http_last_error() is set accordingly. Return value of 0 means the end of
  * the stream was reached.
+ *
+ * If the connection fails or is closed before the end of the body, the
+ * transfer is resumed transparently, up to http_request_info::max_retries
+ * times in a row, with exponential backoff between attempts. The rest of
+ * the body is requested with a Range header, and an If-Range header carrying
+ * the ETag or Last-Modified date of the response makes sure the file hasn't
+ * changed meanwhile; a response with neither can't be resumed.
+ *
+ * A compressed body is decompressed, see @want_compression, and the
+ * returned length counts decompressed bytes.
  */
 ssize_t http_response_read(struct http_response *resp, void *buf, size_t len);
 
+/**
+ * http_response_splice - move the body of a http response to a file
+ * @resp: the response
+ * @fd: the file descriptor to write to; may be a regular file or a pipe
+ * @offset: if not %NULL, the body is written at *@offset, which is then
+ *          advanced, and the file offset of @fd is left intact, like pwrite(2)
+ * @len: maximal number of bytes to move
+ *
+ * Same as http_response_read() followed by a write to @fd, but the data are
+ * moved from the socket to @fd with splice(2), without being copied to user
+ * space. If @fd doesn't support splice(2), e.g. is opened with O_APPEND,
+ * falls back on copying silently.
+ *
+ * Only non-chunked uncompressed bodies are supported. Returns the number of
+ * bytes written on success, 0 at the end of the body, or -1 on error, in
+ * which case http_last_error() is set. It is undefined how much data has been
+ * written to @fd on failure. Failed transfers are resumed like by
+ * http_response_read().
+ */
+ssize_t http_response_splice(struct http_response *resp, int fd,
+			     off_t *offset, size_t len);
+
+/**
+ * http_response_uring - move the body of a http response to a file
+ * @resp: the response
+ * @ring: the io_uring instance to use
+ * @fd: the file descriptor to write to
+ * @offset: same as for http_response_splice()
+ * @len: maximal number of bytes to move
+ *
+ * Same as http_response_splice(), but the data are received and written with
+ * io_uring, using the buffers registered with @ring. Receives and writes are
+ * submitted as a single chain of linked requests, so that up to @len bytes
+ * are moved with one system call.
+ *
+ * The function waits for all the data to arrive, unless the body is over.
+ */
+ssize_t http_response_uring(struct http_response *resp, struct uring *ring,
+			    int fd, off_t *offset, size_t len);
+
 /**
  * http_response_destroy - destroy response returned by http_simple_request()
  * @resp: the response
  *
- * This function releases resources associated with @resp.
+ * This function releases resources associated with @resp. If the response
+ * body has been read till the end and the server agreed to keep the
+ * connection open, the connection is put to the pool of idle connections
+ * so that it can be reused by the next request to the same server.
  */
 void http_response_destroy(struct http_response *resp);
 
+/**
+ * http_pool_flush - close all idle connections
+ */
+void http_pool_flush(void);
+
+/**
+ * http_prefetch_host - start resolving a host name in background
+ * @host: the host name
+ * @port: the port; -1 for default
+ *
+ * Resolved addresses are cached for a while, so a request to @host issued
+ * later doesn't have to wait for name resolution.
+ */
+void http_prefetch_host(const char *host, int port);
+
+/*
+ * Non-blocking requests.
+ *
+ * A non-blocking request is started with http_async_start() and then driven
+ * by calling http_async_advance() whenever the socket returned by
+ * http_async_fd() is ready for the poll(2) events returned by
+ * http_async_events(). Note, both the socket and the events may change after
+ * each call to http_async_advance().
+ *
+ * Once http_async_advance() has returned 0, the response head is available
+ * in @resp, and the body may be read with http_async_read(). Finally, the
+ * request must be destroyed with http_async_destroy().
+ *
+ * Note, host name resolution is blocking, unless the host has been resolved
+ * in advance with http_prefetch_host().
+ */
+struct addrinfo;
+struct resolv_entry;
+
+struct http_async {
+	struct http_response resp;
+
+	/* private */
+	int state;		/* request phase */
+	struct http_request_info info;	/* current request; redirections
+					   update it */
+	struct url_struct *url;		/* current redirect location */
+	struct resolv_entry *addrs;	/* addresses to connect to */
+	struct addrinfo *ai_next;	/* next address to try */
+	int connect_err;	/* error of the last connection attempt */
+	struct iovec req_iov[HTTP_REQUEST_IOVS];	/* the request being
+							   sent */
+	size_t req_iovcnt;	/* number of parts left to send, at the end
+				   of @req_iov */
+	size_t drained;		/* number of bytes of a redirect response
+				   body skipped */
+};
+
+/**
+ * http_async_start - start a non-blocking http request
+ * @req: the request
+ * @info: the request definition
+ *
+ * Returns %true on success. On failure returns %false and sets
+ * http_last_error(); @req needn't be destroyed then. Strings referenced by
+ * @info must stay valid until @req is destroyed.
+ */
+bool http_async_start(struct http_async *req,
+		      const struct http_request_info *info);
+
+/**
+ * http_async_fd - return the socket to wait on
+ * @req: the request
+ */
+int http_async_fd(const struct http_async *req);
+
+/**
+ * http_async_events - return the poll(2) events to wait for
+ * @req: the request
+ */
+int http_async_events(const struct http_async *req);
+
+/**
+ * http_async_advance - advance a non-blocking request
+ * @req: the request
+ *
+ * Returns 0 if the response head has been received, %HTTP_AGAIN if the
+ * caller should wait for the request socket to become ready and call this
+ * function again, or -1 on failure, in which case http_last_error() is set.
+ */
+int http_async_advance(struct http_async *req);
+
+/**
+ * http_async_read - read the body of a non-blocking request response
+ * @req: the request
+ * @buf: the buffer to write read data to
+ * @len: the buffer length
+ *
+ * Same as http_response_read(), but returns %HTTP_AGAIN if there's no data
+ * available. May only be called after http_async_advance() returned 0.
+ */
+ssize_t http_async_read(struct http_async *req, void *buf, size_t len);
+
+/**
+ * http_async_destroy - destroy a non-blocking request
+ * @req: the request
+ *
+ * Like http_response_destroy(), puts the connection to the pool if possible.
+ */
+void http_async_destroy(struct http_async *req);
+
 #endif /* _HTTP_H */
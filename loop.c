@@ -0,0 +1,235 @@
+/*
+ * Event loop driving non-blocking http requests.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "util.h"
+#include "http.h"
+#include "loop.h"
+
+#define BUF_SIZE		65536
+
+/* Max number of events fetched by one epoll_wait() call */
+#define EVENTS_MAX		64
+
+/*
+ * Max number of body reads done for a request in a row, so that a fast
+ * request doesn't starve the others. If a request hits the limit, it is put
+ * on the ready list and processed again on the next iteration, because it may
+ * have data buffered, in which case epoll won't report it.
+ */
+#define READS_MAX		16
+
+bool http_loop_init(struct http_loop *loop)
+{
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0)
+		return false;
+
+	loop->nr_requests = 0;
+	loop->buf = xmalloc(BUF_SIZE);
+	loop->ready = NULL;
+	return true;
+}
+
+void http_loop_destroy(struct http_loop *loop)
+{
+	assert(loop->nr_requests == 0);
+
+	close(loop->epfd);
+	free(loop->buf);
+}
+
+/*
+ * Make epoll wait for the socket and events the request needs now.
+ */
+static bool update_events(struct http_loop *loop,
+			  struct http_loop_request *req)
+{
+	struct epoll_event ev = {
+		.data.ptr	= req,
+	};
+	int fd = http_async_fd(&req->async);
+	int events = http_async_events(&req->async);
+
+	ev.events = (events & POLLIN ? EPOLLIN : 0) |
+		    (events & POLLOUT ? EPOLLOUT : 0);
+
+	/*
+	 * The connection never changes once the response head has been
+	 * received, so there's nothing to do if the events are the same.
+	 */
+	if (req->head_done && fd == req->fd && ev.events == req->events)
+		return true;
+
+	/* The old socket may have been closed or moved to the pool */
+	if (req->fd >= 0 && req->fd != fd)
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, req->fd, NULL);
+
+	/*
+	 * If the socket was closed and a new one got the same descriptor,
+	 * epoll has already forgotten about it, hence the fallback to ADD.
+	 */
+	if (req->fd == fd &&
+	    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		goto out;
+
+	req->fd = -1;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return false;
+out:
+	req->fd = fd;
+	req->events = ev.events;
+	return true;
+}
+
+static void remove_ready(struct http_loop_request **list,
+			 struct http_loop_request *req)
+{
+	struct http_loop_request **p;
+
+	for (p = list; *p != req; p = &(*p)->next_ready)
+		assert(*p);
+	*p = req->next_ready;
+	req->ready = false;
+}
+
+static void finish_request(struct http_loop *loop,
+			   struct http_loop_request *req, bool success)
+{
+	if (req->fd >= 0)
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, req->fd, NULL);
+	req->fd = -1;
+
+	loop->nr_requests--;
+
+	if (req->on_done)
+		req->on_done(req, success);
+}
+
+static void process_request(struct http_loop *loop,
+			    struct http_loop_request *req)
+{
+	ssize_t n;
+	int i;
+
+	if (!req->head_done) {
+		n = http_async_advance(&req->async);
+		if (n == HTTP_AGAIN)
+			goto wait;
+		if (n < 0)
+			goto fail;
+
+		req->head_done = true;
+		if (req->on_headers && !req->on_headers(req))
+			goto fail;
+	}
+
+	for (i = 0; i < READS_MAX; i++) {
+		n = http_async_read(&req->async, loop->buf, BUF_SIZE);
+		if (n == HTTP_AGAIN)
+			goto wait;
+		if (n < 0)
+			goto fail;
+		if (n == 0) {
+			finish_request(loop, req, true);
+			return;
+		}
+		if (req->on_data && !req->on_data(req, loop->buf, n))
+			goto fail;
+	}
+
+	req->ready = true;
+	req->next_ready = loop->ready;
+	loop->ready = req;
+	return;
+wait:
+	if (update_events(loop, req))
+		return;
+fail:
+	finish_request(loop, req, false);
+}
+
+bool http_loop_start(struct http_loop *loop, struct http_loop_request *req,
+		     const struct http_request_info *info)
+{
+	req->fd = -1;
+	req->events = 0;
+	req->head_done = false;
+	req->ready = false;
+	req->next_ready = NULL;
+
+	if (!http_async_start(&req->async, info))
+		return false;
+
+	if (!update_events(loop, req)) {
+		int err = errno;
+
+		http_async_destroy(&req->async);
+		errno = err;
+		return false;
+	}
+
+	loop->nr_requests++;
+	return true;
+}
+
+int http_loop_run(struct http_loop *loop, int timeout)
+{
+	struct epoll_event events[EVENTS_MAX];
+	struct http_loop_request *req, *ready;
+	int i, n;
+
+	/* Don't sleep if some requests are known to have data */
+	if (loop->ready)
+		timeout = 0;
+
+	n = epoll_wait(loop->epfd, events, EVENTS_MAX, timeout);
+	if (n < 0) {
+		if (errno != EINTR)
+			return -1;
+		n = 0;
+	}
+
+	/* Requests put on the list from now on will be processed next time */
+	ready = loop->ready;
+	loop->ready = NULL;
+
+	for (i = 0; i < n; i++) {
+		req = events[i].data.ptr;
+		if (req->ready)
+			remove_ready(&ready, req);
+		process_request(loop, req);
+	}
+
+	while (ready) {
+		req = ready;
+		ready = req->next_ready;
+		req->ready = false;
+		process_request(loop, req);
+	}
+
+	return loop->nr_requests;
+}
@@ -0,0 +1,110 @@
+/*
+ * Event loop driving non-blocking http requests.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOOP_H
+#define _LOOP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "http.h"
+
+struct http_loop_request;
+
+struct http_loop {
+	int epfd;		/* epoll instance */
+	int nr_requests;	/* number of requests in progress */
+	char *buf;		/* buffer for reading response bodies */
+	struct http_loop_request *ready;	/* requests that have data
+						   to process */
+};
+
+struct http_loop_request {
+	struct http_async async;
+
+	/*
+	 * Callbacks. Any of them may be %NULL.
+	 *
+	 * on_headers() is called once the response head has been received.
+	 * on_data() is called for each piece of the response body. Either of
+	 * them may return %false to abort the request.
+	 *
+	 * on_done() is called when the request is over. @success is %false if
+	 * the request failed, in which case http_last_error() is set, or was
+	 * aborted. The request is removed from the loop before the callback is
+	 * called, so the callback may destroy it.
+	 */
+	bool (*on_headers)(struct http_loop_request *req);
+	bool (*on_data)(struct http_loop_request *req,
+			const char *buf, size_t len);
+	void (*on_done)(struct http_loop_request *req, bool success);
+
+	void *priv;		/* for the caller's use */
+
+	/* private */
+	int fd;			/* socket registered with epoll; -1 if none */
+	int events;		/* events registered with epoll */
+	bool head_done;		/* on_headers() has been called */
+	bool ready;		/* on http_loop::ready list */
+	struct http_loop_request *next_ready;
+};
+
+/**
+ * http_loop_init - initialize an event loop
+ * @loop: the loop
+ *
+ * Returns %true on success. On failure returns %false and sets errno.
+ */
+bool http_loop_init(struct http_loop *loop);
+
+/**
+ * http_loop_destroy - destroy an event loop
+ * @loop: the loop
+ *
+ * The loop must have no requests in progress.
+ */
+void http_loop_destroy(struct http_loop *loop);
+
+/**
+ * http_loop_start - start a request and add it to an event loop
+ * @loop: the loop
+ * @req: the request; callbacks must be set by the caller
+ * @info: the request definition
+ *
+ * Returns %true on success. On failure returns %false and sets
+ * http_last_error() or, if the request couldn't be added to the loop, errno;
+ * callbacks are not called then.
+ *
+ * Once on_done() has been called, the request must be destroyed with
+ * http_async_destroy(&req->async).
+ */
+bool http_loop_start(struct http_loop *loop, struct http_loop_request *req,
+		     const struct http_request_info *info);
+
+/**
+ * http_loop_run - wait for events and process them
+ * @loop: the loop
+ * @timeout: max time to wait, in milliseconds; -1 for infinity
+ *
+ * Returns the number of requests left in progress, or -1 on failure, in
+ * which case errno is set.
+ */
+int http_loop_run(struct http_loop *loop, int timeout);
+
+#endif /* _LOOP_H */
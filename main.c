@@ -17,8 +17,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE		/* for fallocate() and sync_file_range() */
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -30,13 +33,55 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "http.h"
 #include "url.h"
 #include "util.h"
+#include "batch.h"
+#include "uring.h"
+#include "cache.h"
+#include "stats.h"
+#include "writer.h"
 
 #define BUF_SIZE		65536
 
+/*
+ * Segments smaller than this are not worth a separate connection.
+ */
+#define SEGMENT_MIN		(1 << 20)
+
+/*
+ * Max number of bytes moved from a response to the output file at once.
+ * Must not exceed SEGMENT_MIN, see steal_segment().
+ */
+#define XFER_SIZE		((size_t)1 << 20)
+
+/*
+ * Buffers registered with io_uring. Together they hold XFER_SIZE bytes.
+ */
+#define URING_BUFS		4
+#define URING_BUF_SIZE		(XFER_SIZE / URING_BUFS)
+
+/*
+ * Buffers of a body received to user space that can wait to be written to
+ * the output file. Together they hold XFER_SIZE bytes.
+ */
+#define WRITER_BUFS		(XFER_SIZE / BUF_SIZE)
+
+/*
+ * With -B, the output file is written back in windows of this size, and each
+ * window is dropped from the page cache once the next one has been written.
+ */
+#define WRITEBACK_WINDOW	((off_t)8 << 20)
+
+/*
+ * With -M, the output file is mapped in windows of this size, starting at
+ * file offsets aligned to the huge page size.
+ */
+#define MMAP_WINDOW		((off_t)64 << 20)
+#define HUGE_PAGE_SIZE		((off_t)2 << 20)
+
 /*
  * Used if -o option is omitted and URL ends with '/'.
  */
@@ -55,9 +100,34 @@ static int MAX_REDIRECTIONS = 10;
 static char *CREDS;
 static bool TRUSTED_LOCATION;
 static bool QUIET;
+static int SEGMENTS = 1;
+static char *MANIFEST;		/* NULL unless in batch mode */
+static int JOBS = 8;
+static int JOBS_PER_HOST = 4;
+static bool URING;
+static bool WRITER;
+static bool WRITEBACK;
+static bool DIRECT;
+static bool MMAP;
+static int MAX_RETRIES = 5;
+static char *CACHE_DIR;		/* NULL if not caching */
+static bool COMPRESSION;
+static char *STATS_FILE;	/* NULL if not reporting statistics */
+static char *RECORD_FILE;	/* NULL if not recording */
+static struct http_timeouts TIMEOUTS = {
+	.connect	= 30000,
+	.first_byte	= 60000,
+	.idle		= 60000,
+};
+static struct http_sockopts SOCKOPTS;
 
 static int output_fd = -1;
+static bool output_reserved;	/* disk space for the document has been
+				   allocated, see preallocate_output() */
+static FILE *stats_file;
+static FILE *record_file;
 static struct url_struct url;
+static struct cache_entry *cache_stored; /* body being stored in the cache */
 
 static void printf_stderr(const char *fmt, va_list ap)
 {
@@ -67,6 +137,7 @@ static void printf_stderr(const char *fmt, va_list ap)
 static void print_usage(void)
 {
 	fprintf(stderr, "Usage: %1$s [option]... URL\n"
+		"   or: %1$s [option]... -i MANIFEST\n"
 		"Try `%1$s -h' for more information\n",
 		PROG_NAME);
 }
@@ -75,21 +146,74 @@ static void print_help(void)
 {
 	printf("httpget - HTTP file retriever\n"
 	       "Usage:\n"
-	       "  %s [option]... URL\n"
+	       "  %1$s [option]... URL\n"
+	       "  %1$s [option]... -i MANIFEST\n"
 	       "Options:\n"
 	       "  -o FILE       write document to FILE\n"
 	       "                (use `-' for stdandard output)\n"
 	       "  -c OFFSET	resume transfer at OFFSET\n"
 	       "                (use `-' for auto detection)\n"
 	       "  -r MAX_REDIR  max number of redirections\n"
-	       "                (-1 for unlimited, default is %d)\n"
+	       "                (-1 for unlimited, default is %2$d)\n"
 	       "  -u USER:PASS  server user and password\n"
 	       "  -L            trust redirect location\n"
+	       "  -n SEGMENTS   download in SEGMENTS parallel connections\n"
+	       "  -i MANIFEST   download all URLs listed in MANIFEST\n"
+	       "                (use `-' for standard input)\n"
+	       "  -j JOBS       max number of concurrent downloads\n"
+	       "                in batch mode (default is %3$d)\n"
+	       "  -J JOBS       max number of concurrent downloads\n"
+	       "                from the same server in batch mode\n"
+	       "                (0 for unlimited, default is %4$d)\n"
+	       "  -U            use io_uring for receiving data\n"
+	       "                if supported by the system\n"
+	       "  -W            receive data to memory and write them\n"
+	       "                from another thread instead of splicing\n"
+	       "                (may help if the disk is slow)\n"
+	       "  -B            write the document back to disk as it is\n"
+	       "                received and drop it from the page cache\n"
+	       "  -O            write the document with O_DIRECT,\n"
+	       "                bypassing the page cache (implies -W)\n"
+	       "  -M            receive the document right into the output\n"
+	       "                file mapped to memory if its size is known\n"
+	       "                and disk space can be reserved for it\n"
+	       "                (takes precedence over -W and -O)\n"
+	       "  -C SECONDS    connect timeout, per address\n"
+	       "                (0 for none, default is %5$d)\n"
+	       "  -F SECONDS    max time to wait for the server\n"
+	       "                to start responding\n"
+	       "                (0 for none, default is %6$d)\n"
+	       "  -I SECONDS    max time to wait for the next piece\n"
+	       "                of data (0 for none, default is %7$d)\n"
+	       "  -S SPEED:SECONDS\n"
+	       "                abort if less than SPEED bytes/s\n"
+	       "                are received for SECONDS\n"
+	       "  -t RETRIES    max number of attempts in a row to resume\n"
+	       "                a broken transfer (default is %8$d)\n"
+	       "  -s OPTION[,OPTION]...\n"
+	       "                tune sockets; OPTION is one of\n"
+	       "                fastopen (TCP Fast Open), quickack,\n"
+	       "                autotune (grow the receive buffer\n"
+	       "                to the bandwidth-delay product), and\n"
+	       "                rcvbuf=BYTES (receive buffer size)\n"
+	       "  -z            ask for compressed transfer\n"
+	       "                (gzip or deflate)\n"
+	       "  -T FILE       write request timings and statistics\n"
+	       "                to FILE in JSON (use `-' for standard\n"
+	       "                output; for segmented downloads, only\n"
+	       "                the initial request is reported)\n"
+	       "  -R FILE       write all data received from the server,\n"
+	       "                headers included, to FILE as is\n"
+	       "  -D DIR        keep a copy of the document in DIR\n"
+	       "                and revalidate it next time instead\n"
+	       "                of downloading it again\n"
 	       "  -q            quiet (no output)\n"
 	       "  -v            increase output verbosity\n"
 	       "                (useful for debugging)\n"
 	       "  -h            print this help and exit\n",
-	       PROG_NAME, MAX_REDIRECTIONS);
+	       PROG_NAME, MAX_REDIRECTIONS, JOBS, JOBS_PER_HOST,
+	       TIMEOUTS.connect / 1000, TIMEOUTS.first_byte / 1000,
+	       TIMEOUTS.idle / 1000, MAX_RETRIES);
 }
 
 static void parse_error(const char *fmt, ...)
@@ -110,6 +234,57 @@ static void parse_error(const char *fmt, ...)
 	exit(2);
 }
 
+/*
+ * Parse a timeout given in seconds and return it in milliseconds.
+ */
+static int parse_timeout(const char *str, const char *what)
+{
+	long long x;
+
+	if (!strict_strtoll(str, 10, &x) || x < 0 || x > INT_MAX / 1000)
+		parse_error("invalid %s", what);
+	return x * 1000;
+}
+
+static void parse_stall(char *str)
+{
+	char *sep = strchr(str, ':');
+	long long x;
+
+	if (!sep)
+		parse_error("invalid SPEED:SECONDS");
+	*sep = '\0';
+	if (!strict_strtoll(str, 10, &x) || x < 0)
+		parse_error("invalid SPEED");
+	TIMEOUTS.min_speed = x;
+	TIMEOUTS.stall_time = parse_timeout(sep + 1, "SECONDS");
+}
+
+static void parse_sockopts(char *str)
+{
+	char *opt, *val;
+	long long x;
+
+	for (opt = strtok(str, ","); opt; opt = strtok(NULL, ",")) {
+		val = strchr(opt, '=');
+		if (val)
+			*val++ = '\0';
+		if (strcmp(opt, "fastopen") == 0 && !val)
+			SOCKOPTS.fast_open = 1;
+		else if (strcmp(opt, "quickack") == 0 && !val)
+			SOCKOPTS.quickack = 1;
+		else if (strcmp(opt, "autotune") == 0 && !val)
+			SOCKOPTS.autotune = 1;
+		else if (strcmp(opt, "rcvbuf") == 0 && val) {
+			if (!strict_strtoll(val, 10, &x) ||
+			    x <= 0 || x > INT_MAX)
+				parse_error("invalid rcvbuf");
+			SOCKOPTS.rcvbuf = x;
+		} else
+			parse_error("invalid socket option: %s", opt);
+	}
+}
+
 static void parse_args(int argc, char *argv[])
 {
 	int c;
@@ -117,7 +292,8 @@ static void parse_args(int argc, char *argv[])
 
 	PROG_NAME = argv[0];
 
-	while ((c = getopt(argc, argv, "o:c:r:u:Lqvh")) != -1) {
+	while ((c = getopt(argc, argv,
+			   "o:c:r:u:Ln:i:j:J:UWBOMC:F:I:S:t:s:zT:R:D:qvh")) != -1) {
 		switch (c) {
 		case 'o':
 			OUTPUT_FILE = optarg;
@@ -144,6 +320,75 @@ static void parse_args(int argc, char *argv[])
 		case 'L':
 			TRUSTED_LOCATION = true;
 			break;
+		case 'n':
+			if (!strict_strtoll(optarg, 10, &x) ||
+			    x < 1 || x > 64)
+				parse_error("invalid SEGMENTS");
+			SEGMENTS = x;
+			break;
+		case 'i':
+			MANIFEST = optarg;
+			break;
+		case 'j':
+			if (!strict_strtoll(optarg, 10, &x) ||
+			    x < 1 || x > 1024)
+				parse_error("invalid JOBS");
+			JOBS = x;
+			break;
+		case 'J':
+			if (!strict_strtoll(optarg, 10, &x) ||
+			    x < 0 || x > INT_MAX)
+				parse_error("invalid JOBS");
+			JOBS_PER_HOST = x;
+			break;
+		case 'U':
+			URING = true;
+			break;
+		case 'W':
+			WRITER = true;
+			break;
+		case 'B':
+			WRITEBACK = true;
+			break;
+		case 'O':
+			DIRECT = WRITER = true;
+			break;
+		case 'M':
+			MMAP = true;
+			break;
+		case 'C':
+			TIMEOUTS.connect = parse_timeout(optarg, "SECONDS");
+			break;
+		case 'F':
+			TIMEOUTS.first_byte = parse_timeout(optarg, "SECONDS");
+			break;
+		case 'I':
+			TIMEOUTS.idle = parse_timeout(optarg, "SECONDS");
+			break;
+		case 'S':
+			parse_stall(optarg);
+			break;
+		case 't':
+			if (!strict_strtoll(optarg, 10, &x) ||
+			    x < 0 || x > INT_MAX)
+				parse_error("invalid RETRIES");
+			MAX_RETRIES = x;
+			break;
+		case 's':
+			parse_sockopts(optarg);
+			break;
+		case 'z':
+			COMPRESSION = true;
+			break;
+		case 'T':
+			STATS_FILE = optarg;
+			break;
+		case 'R':
+			RECORD_FILE = optarg;
+			break;
+		case 'D':
+			CACHE_DIR = optarg;
+			break;
 		case 'q':
 			QUIET = true;
 			break;
@@ -158,6 +403,25 @@ static void parse_args(int argc, char *argv[])
 		}
 	}
 
+	if (MANIFEST) {
+		if (optind != argc)
+			parse_error("too many arguments");
+		if (OUTPUT_FILE || OUTPUT_POS || SEGMENTS > 1 || CACHE_DIR ||
+		    RECORD_FILE)
+			parse_error("-o, -c, -n, -D, and -R can't be used with -i");
+		return;
+	}
+
+	if (STATS_FILE && OUTPUT_FILE && strcmp(STATS_FILE, "-") == 0 &&
+	    strcmp(OUTPUT_FILE, "-") == 0)
+		parse_error("-o and -T can't both use standard output");
+
+	if (CACHE_DIR && (OUTPUT_POS || SEGMENTS > 1))
+		parse_error("-c and -n can't be used with -D");
+
+	if (RECORD_FILE && SEGMENTS > 1)
+		parse_error("-n can't be used with -R");
+
 	if (optind == argc)
 		parse_error("URL missing");
 	if (optind != argc - 1)
@@ -177,9 +441,8 @@ static void __fail(int err, const char *fmt, ...)
 	if (err) {
 		char buf[64];
 
-		strerror_r(err, buf, sizeof(buf));
 		fputs(": ", stderr);
-		fputs(buf, stderr);
+		fputs(strerror_r(err, buf, sizeof(buf)), stderr);
 	}
 
 	fputc('\n', stderr);
@@ -238,7 +501,8 @@ static void detect_output_pos(void)
 
 static void open_output_file(void)
 {
-	int open_flags = O_WRONLY|O_CREAT;
+	/* Writable shared mappings need read access, see map_output() */
+	int open_flags = (MMAP ? O_RDWR : O_WRONLY)|O_CREAT;
 
 	if (strcmp(OUTPUT_FILE, "-") == 0) {
 		output_fd = STDOUT_FILENO;
@@ -273,21 +537,313 @@ static void close_output_file(void)
 		close(output_fd);
 }
 
-static void output(const char *buf, size_t size)
+static void open_stats_file(void)
 {
-	while (size > 0) {
-		ssize_t n;
+	if (strcmp(STATS_FILE, "-") == 0) {
+		stats_file = stdout;
+		return;
+	}
+
+	stats_file = fopen(STATS_FILE, "a");
+	if (!stats_file)
+		fail_errno("Failed to open statistics file");
+}
+
+static void open_record_file(void)
+{
+	record_file = fopen(RECORD_FILE, "w");
+	if (!record_file)
+		fail_errno("Failed to open record file");
+}
+
+static void close_record_file(void)
+{
+	if (fclose(record_file) != 0)
+		fail_errno("Failed to write record file");
+}
+
+static void report_stats(const struct http_response *resp, const char *error)
+{
+	if (stats_file)
+		stats_print_json(stats_file, URL, resp, error);
+}
+
+/*
+ * Per-thread state for moving a response body to the output file.
+ */
+struct xfer {
+	struct writer writer;	/* for bodies received to user space */
+	int direct_fd;		/* output file opened with O_DIRECT; -1 if
+				   none */
+	struct uring ring;
+	bool use_ring;		/* @ring is initialized */
+
+	/* Mapped window of the output file, see map_output() */
+	char *map;		/* %NULL if none */
+	off_t map_start;	/* file offset of @map */
+	size_t map_len;
+	bool no_map;		/* mapping failed, don't try again */
+
+	/* Writeback of the output file, see writeback() */
+	off_t wb_pos;		/* end of the body moved so far */
+	off_t wb_start;		/* start of the window being filled */
+	off_t wb_prev;		/* start of the window being written back */
+};
+
+/*
+ * Return %true if the output is a regular file opened by us, so that we know
+ * where in the file the document goes.
+ */
+static bool output_regular(void)
+{
+	struct stat st;
+
+	return output_fd != STDOUT_FILENO &&
+		fstat(output_fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/*
+ * Reserve disk space for @len bytes of the document to be written at @pos,
+ * so that the file isn't fragmented and we fail early if there's not enough
+ * space. The file size isn't changed, see detect_output_pos().
+ *
+ * The output file is only mapped with -M if the space has been reserved:
+ * otherwise the mapping would sit over a sparse file, and running out of
+ * disk space would raise SIGBUS instead of failing a write.
+ */
+static void preallocate_output(off_t pos, size_t len)
+{
+	if (!output_regular() || !len)
+		return;
+
+	if (fallocate(output_fd, FALLOC_FL_KEEP_SIZE, pos, len) == 0) {
+		output_reserved = true;
+		return;
+	}
+
+	/* Not supported by the file system? Never mind. */
+	if (errno == ENOSPC || errno == EFBIG)
+		fail_errno("Failed to allocate space for output file");
+}
+
+/*
+ * Open another file description for the output file with O_DIRECT set.
+ * Return -1 if the file system doesn't support it.
+ */
+static int open_direct(void)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", output_fd);
+	return open(path, O_WRONLY | O_DIRECT);
+}
+
+static void init_xfer(struct xfer *xfer)
+{
+	xfer->direct_fd = DIRECT && output_regular() ? open_direct() : -1;
+	if (!writer_init(&xfer->writer, output_fd, xfer->direct_fd,
+			 WRITER_BUFS, BUF_SIZE))
+		fail_errno("Failed to start writer thread");
+	/* Silently fall back on splice if io_uring isn't available */
+	xfer->use_ring = URING &&
+		uring_init(&xfer->ring, URING_BUFS, URING_BUF_SIZE);
+	xfer->map = NULL;
+	xfer->no_map = !output_reserved;	/* see preallocate_output() */
+	xfer->wb_pos = -1;
+}
+
+static void unmap_output(struct xfer *xfer)
+{
+	if (xfer->map) {
+		munmap(xfer->map, xfer->map_len);
+		xfer->map = NULL;
+	}
+}
+
+/*
+ * Make the output file at least @size bytes long, so that it can be mapped
+ * up to there. Segment threads may call this concurrently, so the file must
+ * never be shrunk here.
+ */
+static bool extend_output(off_t size)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct stat st;
+	bool ok;
+
+	pthread_mutex_lock(&lock);
+	ok = fstat(output_fd, &st) == 0 &&
+		(st.st_size >= size || ftruncate(output_fd, size) == 0);
+	pthread_mutex_unlock(&lock);
+	return ok;
+}
+
+/*
+ * Map the window of the output file that covers @pos, but doesn't go beyond
+ * @end, unless it is mapped already. The file is extended to the end of the
+ * window. Return %false on failure.
+ */
+static bool map_output(struct xfer *xfer, off_t pos, off_t end)
+{
+	off_t start;
+	char *map;
+
+	if (xfer->map && pos >= xfer->map_start &&
+	    pos < xfer->map_start + xfer->map_len)
+		return true;
+
+	unmap_output(xfer);
+
+	start = pos - pos % HUGE_PAGE_SIZE;
+	end = min(end, start + MMAP_WINDOW);
+	if (!extend_output(end))
+		return false;
+
+	map = mmap(NULL, end - start, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   output_fd, start);
+	if (map == MAP_FAILED)
+		return false;
+
+	/* Just hints, which may well be unsupported */
+	madvise(map, end - start, MADV_SEQUENTIAL);
+	madvise(map, end - start, MADV_HUGEPAGE);
+
+	xfer->map = map;
+	xfer->map_start = start;
+	xfer->map_len = end - start;
+	return true;
+}
+
+/*
+ * Must be called before the output file is closed, because some of the body
+ * may still be waiting to be written.
+ */
+static void destroy_xfer(struct xfer *xfer)
+{
+	if (!writer_flush(&xfer->writer))
+		fail_errno("Failed to write to output file");
+	writer_destroy(&xfer->writer);
+	unmap_output(xfer);
+	if (xfer->direct_fd >= 0)
+		close(xfer->direct_fd);
+	if (xfer->use_ring)
+		uring_destroy(&xfer->ring);
+}
+
+/*
+ * Called after @len bytes of the body have been moved to the output file at
+ * @pos. With -B, keeps the amount of dirty and cached data bounded: once a
+ * window of WRITEBACK_WINDOW bytes has been filled, start writing it back,
+ * wait for the previous window, which must be on disk by then, and drop the
+ * latter from the page cache.
+ */
+static void writeback(struct xfer *xfer, off_t pos, size_t len)
+{
+	off_t end;
+
+	if (!WRITEBACK || xfer->direct_fd >= 0)
+		return;
+
+	/* Switched to another segment? Start over. */
+	if (pos != xfer->wb_pos)
+		xfer->wb_start = xfer->wb_prev = pos;
+	xfer->wb_pos = pos + len;
+
+	/* The last XFER_SIZE bytes may still be queued in the writer */
+	end = xfer->wb_pos - XFER_SIZE;
+	if (end - xfer->wb_start < WRITEBACK_WINDOW)
+		return;
+
+	/* Errors are not fatal here, the data will be written anyway */
+	sync_file_range(output_fd, xfer->wb_start, end - xfer->wb_start,
+			SYNC_FILE_RANGE_WRITE);
+	if (xfer->wb_prev < xfer->wb_start) {
+		sync_file_range(output_fd, xfer->wb_prev,
+				xfer->wb_start - xfer->wb_prev,
+				SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(output_fd, xfer->wb_prev,
+			      xfer->wb_start - xfer->wb_prev,
+			      POSIX_FADV_DONTNEED);
+	}
+	xfer->wb_prev = xfer->wb_start;
+	xfer->wb_start = end;
+}
 
-		n = write(output_fd, buf, size);
-		if (n < 0)
-			fail_errno("Failed to write to output file");
+/*
+ * Move the next piece of the response body, max @len bytes, to the output
+ * file at *@pos, which is then advanced, or, if @pos is %NULL, at the file
+ * offset. Returns the same as http_response_read().
+ *
+ * A plain body is moved without copying it to user space, unless -W is given.
+ * Chunked encoding and compression have to be decoded, so that is not an
+ * option for such a body. With -M, a plain body of known size is received
+ * right into the output file mapped to memory.
+ *
+ * A body received to user space is written to the output file by the writer
+ * thread, so receiving goes on while the disk is busy. Note that the data
+ * may be still in flight when this function returns, see destroy_xfer().
+ * Each buffer is filled up before it is passed to the writer, which makes
+ * for fewer writes, all but the first and the last one aligned in the file
+ * as O_DIRECT requires.
+ */
+static ssize_t xfer_body(struct xfer *xfer, struct http_response *resp,
+			 size_t len, off_t *pos)
+{
+	size_t size, done = 0;
+	char *buf;
+	ssize_t n = 0;
+	off_t off;
+
+	if (MMAP && pos && !xfer->no_map && resp->sized &&
+	    resp->body_read < resp->body_size &&
+	    !resp->chunked && !resp->decoder) {
+		if (map_output(xfer, *pos,
+			       *pos + resp->body_size - resp->body_read)) {
+			off = *pos - xfer->map_start;
+			n = http_response_read(resp, xfer->map + off,
+					       min(len, xfer->map_len - off));
+			if (n > 0) {
+				writeback(xfer, *pos, n);
+				*pos += n;
+			}
+			return n;
+		}
+		xfer->no_map = true;	/* fall back on writing */
+	}
 
-		assert(n > 0);
-		assert(n <= size);
+	if (!resp->chunked && !resp->decoder && !WRITER) {
+		n = xfer->use_ring ?
+			http_response_uring(resp, &xfer->ring,
+					    output_fd, pos, len) :
+			http_response_splice(resp, output_fd, pos, len);
+		if (n > 0 && pos)
+			writeback(xfer, *pos - n, n);
+		return n;
+	}
 
-		buf += n;
-		size -= n;
+	size = min(len, (size_t)BUF_SIZE);
+	if (pos && *pos % WRITER_ALIGN)
+		size = min(size, (size_t)(WRITER_ALIGN - *pos % WRITER_ALIGN));
+
+	buf = writer_buf(&xfer->writer);
+	while (done < size) {
+		n = http_response_read(resp, buf + done, size - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	if (!done)
+		return n;
+
+	if (!writer_put(&xfer->writer, done, pos ? *pos : -1))
+		fail_errno("Failed to write to output file");
+	if (pos) {
+		writeback(xfer, *pos, done);
+		*pos += done;
 	}
+	return done;
 }
 
 /* Print @c @n times */
@@ -352,6 +908,282 @@ static void print_progress(size_t read, size_t total, bool done)
 		fflush(stderr);
 }
 
+/*
+ * Segmented download.
+ *
+ * The rest of the file is split into byte ranges (segments), each of which is
+ * fetched by its own thread over its own connection. A thread that is done
+ * with its segment takes over the second half of the largest remaining one,
+ * so that a slow connection can't stall the whole download.
+ *
+ * A segment is only advanced by its owner, but its end may be moved by any
+ * thread, so all accesses go under @segments_lock.
+ */
+struct segment {
+	size_t pos;		/* next byte to fetch */
+	size_t end;		/* the byte following the last one to fetch */
+	struct http_response *resp;	/* response to start with, if any */
+	pthread_t thread;
+};
+
+static struct segment *segments;
+static int nr_segments;
+static int nr_segments_running;
+static size_t segments_read;	/* total number of bytes written */
+static char segments_error[256];	/* set if any of the threads failed */
+static pthread_mutex_t segments_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t segments_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Hand the second half of the largest remaining segment over to @seg.
+ * Returns %false if there's nothing worth stealing.
+ *
+ * Must be called with @segments_lock held.
+ */
+static bool steal_segment(struct segment *seg)
+{
+	struct segment *victim = NULL;
+	size_t left, max_left = 0;
+	int i;
+
+	for (i = 0; i < nr_segments; i++) {
+		left = segments[i].end - segments[i].pos;
+		if (left > max_left) {
+			victim = &segments[i];
+			max_left = left;
+		}
+	}
+
+	/*
+	 * The split point must be far enough from the current position of the
+	 * victim, which may be reading up to XFER_SIZE bytes right now.
+	 */
+	if (!victim || max_left < 2 * SEGMENT_MIN)
+		return false;
+
+	seg->pos = victim->pos + max_left / 2;
+	seg->end = victim->end;
+	victim->end = seg->pos;
+	return true;
+}
+
+static void segment_failed(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&segments_lock);
+	if (!segments_error[0]) {
+		va_start(ap, fmt);
+		vsnprintf(segments_error, sizeof(segments_error), fmt, ap);
+		va_end(ap);
+	}
+	pthread_mutex_unlock(&segments_lock);
+}
+
+/*
+ * Fetch the range of the file defined by @seg. Returns %false on failure.
+ * If @seg shrinks while we are at it, stop at its new end.
+ */
+static bool fetch_segment(struct segment *seg, struct http_response *resp,
+			  struct xfer *xfer)
+{
+	while (1) {
+		size_t len;
+		off_t pos;
+		ssize_t n;
+
+		pthread_mutex_lock(&segments_lock);
+		len = min(XFER_SIZE, seg->end - seg->pos);
+		if (segments_error[0])
+			len = 0;
+		pthread_mutex_unlock(&segments_lock);
+
+		if (!len)
+			return true;
+
+		pos = seg->pos;
+		n = xfer_body(xfer, resp, len, &pos);
+		if (n < 0) {
+			segment_failed("%s", http_last_error());
+			return false;
+		}
+		if (!n) {
+			segment_failed("Response body shorter than requested");
+			return false;
+		}
+
+		pthread_mutex_lock(&segments_lock);
+		seg->pos += n;
+		segments_read += n;
+		pthread_mutex_unlock(&segments_lock);
+	}
+}
+
+static void *segment_thread(void *arg)
+{
+	struct segment *seg = arg;
+	struct http_request_info info = {
+		.host		= url.host,
+		.port		= url.port,
+		.command	= "GET",
+		.path		= url.path,
+		.max_redirections = MAX_REDIRECTIONS,
+		.creds		= CREDS,
+		.trusted_location = TRUSTED_LOCATION,
+		.timeouts	= TIMEOUTS,
+		.sockopts	= SOCKOPTS,
+		.max_retries	= MAX_RETRIES,
+		.want_range	= 1,
+	};
+	struct http_response resp;
+	struct xfer xfer;
+
+	init_xfer(&xfer);
+
+	/* The first segment is served by the initial response */
+	if (seg->resp) {
+		fetch_segment(seg, seg->resp, &xfer);
+		report_stats(seg->resp, NULL);
+		http_response_destroy(seg->resp);
+	}
+
+	while (1) {
+		bool done;
+
+		pthread_mutex_lock(&segments_lock);
+		done = segments_error[0] ||
+			(seg->pos == seg->end && !steal_segment(seg));
+		info.range_first = seg->pos;
+		info.range_last = seg->end - 1;
+		pthread_mutex_unlock(&segments_lock);
+
+		if (done)
+			break;
+
+		if (!http_simple_request(&info, &resp)) {
+			segment_failed("%s", http_last_error());
+			break;
+		}
+		if (!HTTP_STATUS_OK(resp.status) || !resp.ranged)
+			segment_failed("Error %d: %s", resp.status, resp.reason);
+		else
+			fetch_segment(seg, &resp, &xfer);
+		http_response_destroy(&resp);
+	}
+
+	destroy_xfer(&xfer);
+
+	pthread_mutex_lock(&segments_lock);
+	nr_segments_running--;
+	pthread_cond_signal(&segments_cond);
+	pthread_mutex_unlock(&segments_lock);
+	return NULL;
+}
+
+/*
+ * Called after a segmented download has failed. Segments that went on past
+ * the failed one have left a gap of zeros in the output file, and the file
+ * size is beyond it, so `-c -' would skip the gap. With -M, mapped windows
+ * may also have extended the file past the data written. Cut the file at
+ * the first byte not fetched, so that it can be resumed from there.
+ */
+static void truncate_segments(void)
+{
+	size_t end = SIZE_MAX;
+	int i;
+
+	for (i = 0; i < nr_segments; i++) {
+		if (segments[i].pos < segments[i].end)
+			end = min(end, segments[i].pos);
+	}
+
+	if (end != SIZE_MAX && output_regular() &&
+	    ftruncate(output_fd, end) != 0)
+		fail_errno("Failed to truncate output file");
+}
+
+/*
+ * Fetch the rest of the file in segments. @resp is the response to the
+ * initial request, which must be ranged. It is destroyed by this function.
+ */
+static void download_segmented(struct http_response *resp)
+{
+	size_t first = resp->range_first;
+	size_t total = resp->range_total - first;
+	size_t size;
+	int i;
+
+	nr_segments = min((size_t)SEGMENTS, total / SEGMENT_MIN);
+	nr_segments = max(nr_segments, 1);
+	size = total / nr_segments;
+
+	segments = xmalloc(nr_segments * sizeof(*segments));
+	memset(segments, 0, nr_segments * sizeof(*segments));
+
+	for (i = 0; i < nr_segments; i++) {
+		segments[i].pos = first + i * size;
+		segments[i].end = first + (i + 1) * size;
+	}
+	segments[nr_segments - 1].end = resp->range_total;
+	segments[0].resp = resp;
+
+	nr_segments_running = nr_segments;
+	for (i = 0; i < nr_segments; i++) {
+		errno = pthread_create(&segments[i].thread, NULL,
+				       segment_thread, &segments[i]);
+		if (errno)
+			fail_errno("Failed to create thread");
+	}
+
+	pthread_mutex_lock(&segments_lock);
+	while (nr_segments_running > 0) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&segments_cond, &segments_lock, &ts);
+		print_progress(segments_read, total, false);
+	}
+	pthread_mutex_unlock(&segments_lock);
+
+	for (i = 0; i < nr_segments; i++)
+		pthread_join(segments[i].thread, NULL);
+
+	print_progress(segments_read, total, true);
+
+	if (segments_error[0]) {
+		truncate_segments();
+		fail("%s", segments_error);
+	}
+
+	free(segments);
+}
+
+/*
+ * Cache errors are not fatal: the document is downloaded all the same.
+ */
+static void cache_warning(const char *msg)
+{
+	if (!QUIET)
+		fprintf(stderr, "Warning: %s: %s\n", msg, strerror(errno));
+}
+
+/*
+ * Called on exit. If we fail before a document stored in the cache is
+ * committed, remove the partial body rather than leave it behind.
+ */
+static void abort_cache(void)
+{
+	if (cache_stored)
+		cache_abort(cache_stored);
+}
+
+static void output_cached(struct cache_entry *cache)
+{
+	if (!cache_copy_body(cache, output_fd))
+		fail_errno("Failed to copy document from cache");
+}
+
 static void download_http(void)
 {
 	struct http_request_info info = {
@@ -362,46 +1194,162 @@ static void download_http(void)
 		.max_redirections = MAX_REDIRECTIONS,
 		.creds		= CREDS,
 		.trusted_location = TRUSTED_LOCATION,
+		.timeouts	= TIMEOUTS,
+		.sockopts	= SOCKOPTS,
+		.max_retries	= MAX_RETRIES,
+		.record		= record_file,
 	};
 	struct http_response resp;
-	char *buf;
+	struct cache_entry cache;
+	int cache_fd = -1;
+	size_t stored = 0;
+	struct xfer xfer;
+	off_t pos, *ppos = NULL;
 	ssize_t n;
 
 	detect_output_file();
 	detect_output_pos();
+	pos = OUTPUT_POS;
 
-	if (OUTPUT_POS > 0) {
+	if (SEGMENTS > 1 && strcmp(OUTPUT_FILE, "-") == 0)
+		fail("Cannot download in segments to standard output");
+
+	/* Segmented download needs to know the file size, so ask for
+	 * a range even if we start from the beginning */
+	if (OUTPUT_POS > 0 || SEGMENTS > 1) {
 		info.want_range = 1;
 		info.range_first = OUTPUT_POS;
 		info.range_last = SIZE_MAX;
+	} else
+		info.want_compression = COMPRESSION;
+
+	if (CACHE_DIR) {
+		cache_open(&cache, CACHE_DIR, URL);
+		if (cache_fresh(&cache)) {
+			if (!QUIET)
+				fprintf(stderr, "Using cached copy\n");
+			open_output_file();
+			output_cached(&cache);
+			close_output_file();
+			cache_close(&cache);
+			return;
+		}
+		if (cache.valid)
+			cache_set_validators(&cache, &info);
 	}
 
-	buf = xmalloc(BUF_SIZE);
-
-	if (!http_simple_request(&info, &resp))
+	if (!http_simple_request(&info, &resp)) {
+		report_stats(NULL, http_last_error());
 		fail("%s", http_last_error());
+	}
+
+	if (CACHE_DIR && cache.valid && resp.status == 304) {
+		if (!QUIET)
+			fprintf(stderr, "Not modified, using cached copy\n");
+		if (!cache_commit(&cache, &resp, 0))
+			cache_warning("Failed to update cache");
+		report_stats(&resp, NULL);
+		http_response_destroy(&resp);
+		open_output_file();
+		output_cached(&cache);
+		close_output_file();
+		cache_close(&cache);
+		return;
+	}
 
-	if (!HTTP_STATUS_OK(resp.status))
+	if (!HTTP_STATUS_OK(resp.status)) {
+		report_stats(&resp, NULL);
 		fail("Error %d: %s", resp.status, resp.reason);
+	}
 
-	if (info.want_range && !resp.ranged)
+	if (OUTPUT_POS > 0 && !resp.ranged)
 		fail("HTTP server does not seem to support byte ranges. "
 		     "Cannot resume.");
 
+	if (SEGMENTS > 1 && resp.ranged) {
+		open_output_file();
+		preallocate_output(OUTPUT_POS, resp.body_size);
+		download_segmented(&resp);
+		close_output_file();
+		return;
+	}
+
 	open_output_file();
+
+	/*
+	 * A cacheable document is stored in the cache first, then copied to
+	 * the output file, so that it can be stored with a single rename.
+	 */
+	if (CACHE_DIR && cache_storable(&resp)) {
+		cache_fd = cache_begin(&cache);
+		if (cache_fd >= 0) {
+			swap(output_fd, cache_fd);
+			cache_stored = &cache;
+		} else
+			cache_warning("Failed to store document in cache");
+	}
+
+	/* Compressed size tells nothing about the size of the document */
+	if (resp.sized && !resp.decoder)
+		preallocate_output(OUTPUT_POS, resp.body_size);
+
+	/* Explicit file positions are needed for writeback and O_DIRECT */
+	if (output_regular())
+		ppos = &pos;
+
+	init_xfer(&xfer);
 	while (1) {
-		n = http_response_read(&resp, buf, BUF_SIZE);
+		n = xfer_body(&xfer, &resp, XFER_SIZE, ppos);
 		print_progress(resp.body_read, resp.body_size, n <= 0);
-		if (n < 0)
+		if (n < 0) {
+			destroy_xfer(&xfer);	/* keep what we got to resume */
+			/* a mapped window might have extended the file */
+			if (MMAP && ppos && ftruncate(output_fd, pos) != 0)
+				fail_errno("Failed to truncate output file");
+			report_stats(&resp, http_last_error());
 			fail("%s", http_last_error());
+		}
 		if (!n)
 			break;
-		output(buf, n);
+		stored += n;
+	}
+	destroy_xfer(&xfer);
+
+	if (cache_fd >= 0) {
+		swap(output_fd, cache_fd);
+		close(cache_fd);
+		output_cached(&cache);
+		if (!cache_commit(&cache, &resp, stored))
+			cache_warning("Failed to store document in cache");
 	}
 	close_output_file();
 
+	report_stats(&resp, NULL);
 	http_response_destroy(&resp);
-	free(buf);
+	cache_stored = NULL;
+	if (CACHE_DIR)
+		cache_close(&cache);
+}
+
+static void download_batch(void)
+{
+	struct batch_options opts = {
+		.manifest	= MANIFEST,
+		.jobs		= JOBS,
+		.jobs_per_host	= JOBS_PER_HOST,
+		.max_redirections = MAX_REDIRECTIONS,
+		.creds		= CREDS,
+		.trusted_location = TRUSTED_LOCATION,
+		.timeouts	= TIMEOUTS,
+		.sockopts	= SOCKOPTS,
+		.max_retries	= MAX_RETRIES,
+		.want_compression = COMPRESSION,
+		.quiet		= QUIET,
+		.stats		= stats_file,
+	};
+
+	if (!batch_download(&opts))
+		exit(1);
 }
 
 static void download(void)
@@ -422,6 +1370,16 @@ static void download(void)
 int main(int argc, char *argv[])
 {
 	parse_args(argc, argv);
-	download();
+	atexit(abort_cache);
+	if (STATS_FILE)
+		open_stats_file();
+	if (RECORD_FILE)
+		open_record_file();
+	if (MANIFEST)
+		download_batch();
+	else
+		download();
+	if (RECORD_FILE)
+		close_record_file();
 	exit(0);
 }
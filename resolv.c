@@ -0,0 +1,339 @@
+/*
+ * Caching host name resolver.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "resolv.h"
+
+/* How long to keep resolved addresses, in ms */
+#define RESOLV_TTL		60000
+
+/* Max number of cached entries */
+#define RESOLV_CACHE_MAX	256
+
+#define RESOLV_HASH_BITS	6
+#define RESOLV_HASH_SIZE	(1 << RESOLV_HASH_BITS)
+
+/* Number of threads serving resolv_prefetch() */
+#define RESOLV_THREADS		4
+
+/* resolv_entry::state */
+enum {
+	RESOLV_QUEUED,		/* waiting for a resolver thread */
+	RESOLV_RUNNING,		/* getaddrinfo() in progress */
+	RESOLV_DONE,
+};
+
+/*
+ * The cache is a hash table of entries keyed by host and port. It holds
+ * a reference to each entry it contains, and so does the queue of entries
+ * waiting for a resolver thread. Everything is protected by @resolv_lock.
+ */
+static struct resolv_entry *resolv_hash[RESOLV_HASH_SIZE];
+static int nr_cached;
+
+static struct resolv_entry *queue_head;
+static struct resolv_entry **queue_tail = &queue_head;
+
+static pthread_mutex_t resolv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolved_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+
+/* FNV-1a */
+static unsigned hash_fn(const char *host, int port)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *host; host++)
+		h = (h ^ (unsigned char)*host) * 16777619u;
+	h = (h ^ port) * 16777619u;
+	return h >> (32 - RESOLV_HASH_BITS);
+}
+
+static void free_entry(struct resolv_entry *entry)
+{
+	if (entry->ai)
+		freeaddrinfo(entry->ai);
+	free(entry->host);
+	free(entry);
+}
+
+static void put_entry(struct resolv_entry *entry)
+{
+	if (--entry->refcnt == 0)
+		free_entry(entry);
+}
+
+static bool entry_expired(struct resolv_entry *entry, int64_t now)
+{
+	return entry->state == RESOLV_DONE && entry->expires <= now;
+}
+
+static struct resolv_entry *find_entry(const char *host, int port)
+{
+	struct resolv_entry *entry;
+
+	for (entry = resolv_hash[hash_fn(host, port)]; entry;
+	     entry = entry->hash_next) {
+		if (entry->port == port && strcmp(entry->host, host) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static void unhash_entry(struct resolv_entry *entry)
+{
+	struct resolv_entry **p;
+
+	for (p = &resolv_hash[hash_fn(entry->host, entry->port)]; *p;
+	     p = &(*p)->hash_next) {
+		if (*p == entry) {
+			*p = entry->hash_next;
+			nr_cached--;
+			put_entry(entry);
+			return;
+		}
+	}
+}
+
+/*
+ * Make room for a new entry by dropping expired entries or, if there's
+ * none, the one to expire first. Entries being resolved are never dropped.
+ */
+static void shrink_cache(int64_t now)
+{
+	struct resolv_entry *entry, *next, *oldest = NULL;
+	int i;
+
+	if (nr_cached < RESOLV_CACHE_MAX)
+		return;
+
+	for (i = 0; i < RESOLV_HASH_SIZE; i++) {
+		for (entry = resolv_hash[i]; entry; entry = next) {
+			next = entry->hash_next;
+			if (entry_expired(entry, now))
+				unhash_entry(entry);
+			else if (entry->state == RESOLV_DONE &&
+				 (!oldest || entry->expires < oldest->expires))
+				oldest = entry;
+		}
+	}
+
+	if (nr_cached >= RESOLV_CACHE_MAX && oldest)
+		unhash_entry(oldest);
+}
+
+/*
+ * Add a new entry for @host:@port to the cache. Returns the entry with one
+ * reference owned by the cache.
+ */
+static struct resolv_entry *new_entry(const char *host, int port, int state)
+{
+	struct resolv_entry *entry;
+	unsigned h = hash_fn(host, port);
+
+	shrink_cache(now_ms());
+
+	entry = xmalloc(sizeof(*entry));
+	memset(entry, 0, sizeof(*entry));
+	entry->host = xstrdup(host);
+	entry->port = port;
+	entry->state = state;
+	entry->refcnt = 1;
+
+	entry->hash_next = resolv_hash[h];
+	resolv_hash[h] = entry;
+	nr_cached++;
+	return entry;
+}
+
+static void dequeue_entry(struct resolv_entry *entry)
+{
+	struct resolv_entry **p;
+
+	for (p = &queue_head; *p != entry; p = &(*p)->queue_next)
+		;
+	*p = entry->queue_next;
+	if (queue_tail == &entry->queue_next)
+		queue_tail = p;
+	entry->queue_next = NULL;
+}
+
+/*
+ * Resolve a RESOLV_RUNNING entry and wake up those waiting for it. Called
+ * without @resolv_lock held.
+ */
+static void do_resolve(struct resolv_entry *entry)
+{
+	struct addrinfo ai_hint;
+	struct addrinfo *ai = NULL;
+	char port_str[16];
+	int err;
+
+	memset(&ai_hint, 0, sizeof(ai_hint));
+	ai_hint.ai_flags = AI_CANONNAME;
+	ai_hint.ai_family = AF_UNSPEC;
+	ai_hint.ai_socktype = SOCK_STREAM;
+
+	snprintf(port_str, sizeof(port_str), "%d", entry->port);
+
+	err = getaddrinfo(entry->host, port_str, &ai_hint, &ai);
+
+	pthread_mutex_lock(&resolv_lock);
+	entry->ai = err ? NULL : ai;
+	entry->err = err;
+	entry->expires = now_ms() + RESOLV_TTL;
+	entry->state = RESOLV_DONE;
+	if (err)
+		unhash_entry(entry);	/* don't cache failures */
+	pthread_cond_broadcast(&resolved_cond);
+	pthread_mutex_unlock(&resolv_lock);
+}
+
+static void *resolv_thread(void *arg)
+{
+	struct resolv_entry *entry;
+
+	while (1) {
+		pthread_mutex_lock(&resolv_lock);
+		while (!queue_head)
+			pthread_cond_wait(&queued_cond, &resolv_lock);
+		entry = queue_head;
+		dequeue_entry(entry);
+		entry->state = RESOLV_RUNNING;
+		pthread_mutex_unlock(&resolv_lock);
+
+		do_resolve(entry);
+		resolv_put(entry);	/* the queue's reference */
+	}
+	return NULL;
+}
+
+/*
+ * Failing to start threads is not fatal: queued entries are resolved by
+ * resolv_lookup() then.
+ */
+static void start_threads(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < RESOLV_THREADS; i++)
+		pthread_create(&thread, &attr, resolv_thread, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+struct resolv_entry *resolv_lookup(const char *host, int port)
+{
+	struct resolv_entry *entry;
+
+	pthread_mutex_lock(&resolv_lock);
+
+	entry = find_entry(host, port);
+	if (entry && entry_expired(entry, now_ms())) {
+		unhash_entry(entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		entry = new_entry(host, port, RESOLV_RUNNING);
+		entry->refcnt++;
+		pthread_mutex_unlock(&resolv_lock);
+		do_resolve(entry);
+		return entry;
+	}
+
+	entry->refcnt++;
+
+	if (entry->state == RESOLV_QUEUED) {
+		/* don't wait for a resolver thread, do it ourselves */
+		dequeue_entry(entry);
+		put_entry(entry);	/* the queue's reference */
+		entry->state = RESOLV_RUNNING;
+		pthread_mutex_unlock(&resolv_lock);
+		do_resolve(entry);
+		return entry;
+	}
+
+	while (entry->state != RESOLV_DONE)
+		pthread_cond_wait(&resolved_cond, &resolv_lock);
+	pthread_mutex_unlock(&resolv_lock);
+	return entry;
+}
+
+void resolv_put(struct resolv_entry *entry)
+{
+	pthread_mutex_lock(&resolv_lock);
+	put_entry(entry);
+	pthread_mutex_unlock(&resolv_lock);
+}
+
+void resolv_prefetch(const char *host, int port)
+{
+	struct resolv_entry *entry;
+
+	pthread_once(&threads_once, start_threads);
+
+	pthread_mutex_lock(&resolv_lock);
+
+	entry = find_entry(host, port);
+	if (entry && entry_expired(entry, now_ms())) {
+		unhash_entry(entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		entry = new_entry(host, port, RESOLV_QUEUED);
+		entry->refcnt++;
+		*queue_tail = entry;
+		queue_tail = &entry->queue_next;
+		pthread_cond_signal(&queued_cond);
+	}
+
+	pthread_mutex_unlock(&resolv_lock);
+}
+
+void resolv_flush(void)
+{
+	struct resolv_entry *entry, *next;
+	int i;
+
+	pthread_mutex_lock(&resolv_lock);
+	for (i = 0; i < RESOLV_HASH_SIZE; i++) {
+		for (entry = resolv_hash[i]; entry; entry = next) {
+			next = entry->hash_next;
+			if (entry->state == RESOLV_DONE)
+				unhash_entry(entry);
+		}
+	}
+	pthread_mutex_unlock(&resolv_lock);
+}
@@ -0,0 +1,84 @@
+/*
+ * Caching host name resolver.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RESOLV_H
+#define _RESOLV_H
+
+#include <stdint.h>
+
+struct addrinfo;
+
+/*
+ * A cached result of host name resolution. Entries are reference counted,
+ * so that one can be used after it has expired and left the cache.
+ */
+struct resolv_entry {
+	struct addrinfo *ai;	/* getaddrinfo() result; %NULL on failure */
+	int err;		/* getaddrinfo() error code on failure */
+
+	/* private */
+	char *host;
+	int port;
+	int state;
+	int refcnt;
+	int64_t expires;	/* when to drop from the cache, see now_ms() */
+	struct resolv_entry *hash_next;
+	struct resolv_entry *queue_next;
+};
+
+/**
+ * resolv_lookup - translate a host name to a list of addresses
+ * @host: the host name
+ * @port: the port to put in the addresses
+ *
+ * Returns a cached entry if there is one, waiting for it if it is being
+ * resolved by another thread; otherwise calls getaddrinfo(). Addresses are
+ * cached for a fixed time, since getaddrinfo() doesn't report DNS record
+ * TTLs, while failures are not cached at all.
+ *
+ * Returns an entry, possibly a failed one, which must be released with
+ * resolv_put() when done.
+ */
+struct resolv_entry *resolv_lookup(const char *host, int port);
+
+/**
+ * resolv_put - release an entry returned by resolv_lookup()
+ * @entry: the entry
+ */
+void resolv_put(struct resolv_entry *entry);
+
+/**
+ * resolv_prefetch - start resolving a host name in background
+ * @host: the host name
+ * @port: the port to put in the addresses
+ *
+ * Queues @host:@port to a pool of resolver threads, unless it is cached or
+ * queued already, so that resolv_lookup() finds it ready when it's time to
+ * connect.
+ */
+void resolv_prefetch(const char *host, int port);
+
+/**
+ * resolv_flush - drop all cached entries
+ *
+ * Entries still being resolved are not affected.
+ */
+void resolv_flush(void);
+
+#endif /* _RESOLV_H */
@@ -0,0 +1,114 @@
+/*
+ * Fast scanning of http head lines.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+static const char *scan_line_tail(const char *p, const char *end,
+				  const char **colon)
+{
+	for (; p < end; p++) {
+		if (*p == '\n')
+			return p;
+		if (*p == ':' && !*colon)
+			*colon = p;
+	}
+	return NULL;
+}
+
+#ifdef __x86_64__
+
+/*
+ * Given bit masks of newlines and colons found in a block at @p, return
+ * the position of the first newline, if any, and set *@colon to the first
+ * colon preceding it, unless set already.
+ */
+static inline const char *scan_masks(const char *p, unsigned nl_mask,
+				     unsigned colon_mask, const char **colon)
+{
+	/* ignore colons following the newline */
+	if (nl_mask)
+		colon_mask &= (nl_mask & -nl_mask) - 1;
+	if (colon_mask && !*colon)
+		*colon = p + __builtin_ctz(colon_mask);
+	return nl_mask ? p + __builtin_ctz(nl_mask) : NULL;
+}
+
+static const char *scan_line_sse2(const char *p, const char *end,
+				  const char **colon)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i cl = _mm_set1_epi8(':');
+	const char *ret;
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+		ret = scan_masks(p, _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)),
+				 _mm_movemask_epi8(_mm_cmpeq_epi8(v, cl)),
+				 colon);
+		if (ret)
+			return ret;
+	}
+	return scan_line_tail(p, end, colon);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_line_avx2(const char *p, const char *end,
+				  const char **colon)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i cl = _mm256_set1_epi8(':');
+	const char *ret;
+
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+		ret = scan_masks(p,
+				 _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)),
+				 _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cl)),
+				 colon);
+		if (ret)
+			return ret;
+	}
+	return scan_line_sse2(p, end, colon);
+}
+
+const char *scan_line(const char *p, const char *end, const char **colon)
+{
+	*colon = NULL;
+	if (__builtin_cpu_supports("avx2"))
+		return scan_line_avx2(p, end, colon);
+	return scan_line_sse2(p, end, colon);
+}
+
+#else /* !__x86_64__ */
+
+const char *scan_line(const char *p, const char *end, const char **colon)
+{
+	*colon = NULL;
+	return scan_line_tail(p, end, colon);
+}
+
+#endif /* __x86_64__ */
@@ -0,0 +1,38 @@
+/*
+ * Fast scanning of http head lines.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+/**
+ * scan_line - find the end of a line and the first colon in it
+ * @p: the beginning of the line
+ * @end: the end of the data available
+ * @colon: location to store the position of the first `:' in the line;
+ *         set to %NULL if there's none
+ *
+ * Returns the position of the first `\n' in [@p, @end), or %NULL if there's
+ * none, in which case *@colon is undefined.
+ *
+ * Uses SSE2 or AVX2, whichever is the best supported by the CPU, examining
+ * 16 or 32 bytes at a time, and plain C on other architectures.
+ */
+const char *scan_line(const char *p, const char *end, const char **colon);
+
+#endif /* _SCAN_H */
@@ -0,0 +1,115 @@
+/*
+ * Request statistics report.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "stats.h"
+
+static void print_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/* Print the interval between two timestamps, unless any of them is unset */
+static void print_interval(FILE *f, const char *name,
+			   int64_t begin, int64_t end)
+{
+	if (begin && end)
+		fprintf(f, "\"%s\":%.3f,", name, (end - begin) / 1000.0);
+	else
+		fprintf(f, "\"%s\":null,", name);
+}
+
+static void print_tcp(FILE *f, const struct http_tcp_stats *t)
+{
+	fprintf(f, "\"tcp\":{\"rtt\":%.3f,\"rcv_rtt\":%.3f,\"cwnd\":%u,"
+		"\"rate\":%zu,\"bdp\":%zu,\"rcvbuf\":%d,\"fast_open\":%s}",
+		t->rtt / 1000.0, t->rcv_rtt / 1000.0, t->snd_cwnd,
+		t->rate, t->bdp, t->rcvbuf, t->fast_open ? "true" : "false");
+}
+
+static void print_timing(FILE *f, const struct http_timing *t)
+{
+	int64_t connect_begin = t->resolved ? t->resolved : t->start;
+
+	print_interval(f, "dns", t->start, t->resolved);
+	print_interval(f, "connect", t->reused ? 0 : connect_begin,
+		       t->connected);
+	print_interval(f, "send", t->connected, t->sent);
+	print_interval(f, "wait", t->sent, t->first_byte);
+	print_interval(f, "head", t->first_byte, t->head_done);
+	print_interval(f, "body", t->head_done, t->body_done);
+	print_interval(f, "ttfb", t->start, t->first_byte);
+	print_interval(f, "total", t->start, t->body_done);
+	fprintf(f, "\"reused\":%s", t->reused ? "true" : "false");
+}
+
+void stats_print_json(FILE *f, const char *url,
+		      const struct http_response *resp, const char *error)
+{
+	const struct http_stats *stats;
+	int i;
+
+	/* Reports may come from different threads */
+	flockfile(f);
+
+	fputs("{\"url\":", f);
+	print_string(f, url);
+	if (error) {
+		fputs(",\"error\":", f);
+		print_string(f, error);
+	}
+
+	if (resp) {
+		stats = &resp->stats;
+		fprintf(f, ",\"status\":%d,", resp->status);
+		print_timing(f, &stats->timing);
+		fprintf(f, ",\"redirects\":%d,\"resumes\":%d,"
+			"\"bytes_sent\":%zu,\"bytes_received\":%zu,"
+			"\"body_bytes\":%zu,\"recv_calls\":%lu,\"hops\":[",
+			stats->redirects, stats->resumes,
+			stats->bytes_sent, stats->bytes_received,
+			resp->body_read, stats->recv_calls);
+		for (i = 0; i < stats->redirects && i < HTTP_STATS_HOPS; i++) {
+			fputs(i ? ",{" : "{", f);
+			print_timing(f, &stats->hops[i]);
+			fputc('}', f);
+		}
+		fputs("],", f);
+		print_tcp(f, &stats->tcp);
+	}
+
+	fputs("}\n", f);
+	fflush(f);
+	funlockfile(f);
+}
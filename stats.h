@@ -0,0 +1,56 @@
+/*
+ * Request statistics report.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+
+#include "http.h"
+
+/**
+ * stats_print_json - report the statistics of a request
+ * @f: the stream to write to
+ * @url: the URL requested
+ * @resp: the response; %NULL if the request failed before getting one
+ * @error: the error message if the request or the transfer failed;
+ *         %NULL on success
+ *
+ * Prints a JSON object on a single line, so that the reports of many
+ * requests make a JSON Lines file. Durations of the request phases are
+ * given in milliseconds, %null for phases the request hasn't been through:
+ *
+ *  - dns: host name resolution
+ *  - connect: tcp handshake
+ *  - send: sending the request
+ *  - wait: waiting for the first byte of the response
+ *  - head: receiving the rest of the response head
+ *  - body: receiving the body
+ *  - ttfb: from the start to the first byte of the response
+ *  - total: from the start to the end of the body
+ *
+ * The same durations are reported for each redirection in `hops'.
+ *
+ * The state of the tcp connection, see struct http_tcp_stats, is reported
+ * in `tcp', round trip times in milliseconds too.
+ */
+void stats_print_json(FILE *f, const char *url,
+		      const struct http_response *resp, const char *error);
+
+#endif /* _STATS_H */
@@ -0,0 +1,293 @@
+/*
+ * Minimal io_uring wrapper.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "util.h"
+#include "uring.h"
+
+/*
+ * Features we can't do without:
+ *
+ *  - IORING_FEAT_NODROP: completions are never lost;
+ *  - IORING_FEAT_RW_CUR_POS: offset -1 means the current file position;
+ *  - IORING_FEAT_FAST_POLL: recv on a socket with no data doesn't tie up
+ *    a kernel worker thread.
+ *
+ * Besides, a short MSG_WAITALL receive must fail the link, which is checked
+ * by probe_short_recv().
+ */
+#define URING_FEATURES	(IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS | \
+			 IORING_FEAT_FAST_POLL)
+
+/*
+ * There's no glibc wrappers for io_uring syscalls.
+ */
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+			     unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool map_rings(struct uring *ring, struct io_uring_params *p)
+{
+	char *sq, *cq;
+
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Since 5.4 both rings may be mapped with a single mmap() call */
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_size = ring->cq_ring_size =
+			max(ring->sq_ring_size, ring->cq_ring_size);
+
+	sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return false;
+	ring->sq_ring = sq;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return false;
+	}
+	ring->cq_ring = cq;
+
+	ring->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return false;
+	}
+
+	ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+	ring->sq_entries = p->sq_entries;
+
+	ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return true;
+}
+
+static bool register_buffers(struct uring *ring)
+{
+	struct iovec *iov;
+	int i, ret;
+
+	iov = xmalloc(sizeof(*iov) * ring->nr_bufs);
+	for (i = 0; i < ring->nr_bufs; i++) {
+		iov[i].iov_base = uring_buf(ring, i);
+		iov[i].iov_len = ring->buf_size;
+	}
+	ret = io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+				iov, ring->nr_bufs);
+	free(iov);
+	return ret == 0;
+}
+
+/*
+ * http_response_uring() links each receive to the write of its buffer and
+ * relies on a short MSG_WAITALL receive failing the link, so that the write
+ * is cancelled rather than storing the stale tail of the buffer. None of
+ * the feature flags tells whether the kernel does that, so try it: receive
+ * two bytes from a socket that has only one, followed by a linked no-op.
+ */
+static bool probe_short_recv(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int sv[2], res[2] = {0, 0};
+	int i, err;
+	bool ok;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+		return false;
+	if (write(sv[1], "x", 1) != 1 || shutdown(sv[1], SHUT_WR) != 0) {
+		ok = false;
+		goto out;
+	}
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = sv[0];
+	sqe->addr = (unsigned long)uring_buf(ring, 0);
+	sqe->len = 2;
+	sqe->msg_flags = MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = 0;
+
+	sqe = uring_get_sqe(ring);
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 1;
+
+	ok = uring_submit(ring, 2);
+	if (ok) {
+		for (i = 0; i < 2; i++) {
+			cqe = uring_peek_cqe(ring);
+			res[cqe->user_data] = cqe->res;
+			uring_cqe_seen(ring);
+		}
+		ok = res[0] == 1 && res[1] == -ECANCELED;
+		if (!ok)
+			errno = ENOTSUP;
+	}
+out:
+	err = errno;
+	close(sv[0]);
+	close(sv[1]);
+	errno = err;
+	return ok;
+}
+
+bool uring_init(struct uring *ring, int nr_bufs, size_t buf_size)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = io_uring_setup(3 * nr_bufs, &p);
+	if (ring->fd < 0)
+		return false;
+
+	if ((p.features & URING_FEATURES) != URING_FEATURES) {
+		close(ring->fd);
+		errno = ENOTSUP;
+		return false;
+	}
+
+	ring->nr_bufs = nr_bufs;
+	ring->buf_size = buf_size;
+	ring->bufs = xmalloc(buf_size * nr_bufs);
+
+	if (!map_rings(ring, &p) || !register_buffers(ring) ||
+	    !probe_short_recv(ring)) {
+		err = errno;
+		uring_destroy(ring);
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+void uring_destroy(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes,
+		       ring->sq_entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);	/* unregisters buffers */
+	free(ring->bufs);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned head, tail;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail + ring->sq_pending;
+	if (tail - head >= ring->sq_entries)
+		return NULL;
+
+	sqe = &ring->sqes[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	ring->sq_pending++;
+	return sqe;
+}
+
+bool uring_submit(struct uring *ring, unsigned wait_nr)
+{
+	unsigned to_submit;
+	int ret;
+
+	/* Make the entries visible to the kernel before the new tail */
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending,
+			 __ATOMIC_RELEASE);
+	ring->sq_pending = 0;
+
+	/*
+	 * Either of submission and waiting may be interrupted by a signal,
+	 * so loop until everything is submitted and enough has completed.
+	 */
+	while (1) {
+		to_submit = *ring->sq_tail -
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (!to_submit &&
+		    __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) -
+		    *ring->cq_head >= wait_nr)
+			return true;
+
+		ret = io_uring_enter(ring->fd, to_submit, wait_nr,
+				     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0 && errno != EINTR)
+			return false;
+	}
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
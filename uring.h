@@ -0,0 +1,128 @@
+/*
+ * Minimal io_uring wrapper.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+/*
+ * An io_uring instance along with a set of buffers registered with it, so
+ * that they can be used with IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED.
+ *
+ * A ring must not be used by more than one thread at a time.
+ */
+struct uring {
+	int fd;			/* io_uring file descriptor */
+
+	/* submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	unsigned sq_pending;	/* number of sqes queued, but not submitted */
+
+	/* completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;		/* mmapped rings, see io_uring_setup(2) */
+	size_t sq_ring_size;
+	void *cq_ring;		/* equals @sq_ring if mapped at once */
+	size_t cq_ring_size;
+
+	char *bufs;		/* registered buffers, @nr_bufs of them
+				   @buf_size bytes each, one after another */
+	size_t buf_size;
+	int nr_bufs;
+};
+
+/**
+ * uring_init - create an io_uring instance
+ * @ring: the ring
+ * @nr_bufs: number of buffers to register
+ * @buf_size: size of each buffer
+ *
+ * The submission queue is made large enough to hold three requests per
+ * buffer, e.g. a receive, a write, and a linked timeout.
+ *
+ * Returns %true on success. On failure, including the case when the kernel
+ * doesn't support io_uring or lacks any of the features we rely on, returns
+ * %false and sets errno.
+ */
+bool uring_init(struct uring *ring, int nr_bufs, size_t buf_size);
+
+/**
+ * uring_destroy - destroy an io_uring instance
+ * @ring: the ring
+ *
+ * All submitted requests must have completed.
+ */
+void uring_destroy(struct uring *ring);
+
+/**
+ * uring_buf - return a registered buffer
+ * @ring: the ring
+ * @i: buffer index
+ */
+static inline char *uring_buf(struct uring *ring, int i)
+{
+	return ring->bufs + ring->buf_size * i;
+}
+
+/**
+ * uring_get_sqe - get a submission queue entry
+ * @ring: the ring
+ *
+ * Returns a zeroed entry to be filled in by the caller, or %NULL if the
+ * submission queue is full. The entry is submitted by uring_submit().
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * uring_submit - submit queued entries and wait for completions
+ * @ring: the ring
+ * @wait_nr: number of completions to wait for
+ *
+ * Returns %true on success. On failure returns %false and sets errno.
+ */
+bool uring_submit(struct uring *ring, unsigned wait_nr);
+
+/**
+ * uring_peek_cqe - return the next completion queue entry
+ * @ring: the ring
+ *
+ * Returns %NULL if there's no completions. The entry must be released with
+ * uring_cqe_seen() once processed.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/**
+ * uring_cqe_seen - release the entry returned by uring_peek_cqe()
+ * @ring: the ring
+ */
+void uring_cqe_seen(struct uring *ring);
+
+#endif /* _URING_H */
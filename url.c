@@ -54,7 +54,7 @@ static bool parse_scheme(const char **str_ptr, struct url_struct *url)
 
 	end = s;
 
-	url->scheme = xmalloc(end - begin + 1);
+	url->scheme = allocator_alloc(url->allocator, end - begin + 1);
 	url->scheme[end - begin] = '\0';
 
 	for (s = begin, out = url->scheme; s != end; s++, out++)
@@ -82,10 +82,7 @@ static bool parse_host(const char **str_ptr, struct url_struct *url)
 
 	end = s;
 
-	url->host = xmalloc(end - begin + 1);
-	url->host[end - begin] = '\0';
-
-	memcpy(url->host, begin, end - begin);
+	url->host = allocator_strndup(url->allocator, begin, end - begin);
 
 	*str_ptr = end;
 	return true;
@@ -117,6 +114,15 @@ static bool parse_port(const char **str_ptr, struct url_struct *url)
 	return true;
 }
 
+static void set_name(struct url_struct *url)
+{
+	url->name = strrchr(url->path, '/');
+	if (url->name)
+		url->name += 1;
+	else
+		url->name = ""; /* we never free name so it's OK */
+}
+
 static bool parse_path(const char **str_ptr, struct url_struct *url)
 {
 	const char *s = *str_ptr;
@@ -135,22 +141,20 @@ static bool parse_path(const char **str_ptr, struct url_struct *url)
 		return false;
 
 	/* TODO: check path for invalid characters */
-	url->path = xstrdup(s);
+	url->path = allocator_strdup(url->allocator, s);
 
 success:
-	url->name = strrchr(url->path, '/');
-	if (url->name)
-		url->name += 1;
-	else
-		url->name = ""; /* we never free name so it's OK */
+	set_name(url);
 	return true;
 }
 
-bool url_parse(const char *str, struct url_struct *url)
+bool url_parse_in(const char *str, struct url_struct *url,
+		  struct allocator *a)
 {
 	bool ret;
 
 	memset(url, 0, sizeof(*url));
+	url->allocator = a;
 	ret = (parse_scheme(&str, url) &&
 	       parse_host(&str, url) &&
 	       parse_port(&str, url) &&
@@ -160,30 +164,59 @@ bool url_parse(const char *str, struct url_struct *url)
 	return ret;
 }
 
+bool url_parse(const char *str, struct url_struct *url)
+{
+	return url_parse_in(str, url, &heap_allocator);
+}
+
 void url_destroy(struct url_struct *url)
 {
-	free(url->scheme);
-	free(url->host);
-	if (url->path != slash_str)
-		free(url->path);
+	if (url->scheme)
+		allocator_free(url->allocator, url->scheme);
+	if (url->host)
+		allocator_free(url->allocator, url->host);
+	if (url->path && url->path != slash_str)
+		allocator_free(url->allocator, url->path);
 }
 
-struct url_struct *url_alloc(const char *str)
+struct url_struct *url_alloc_in(const char *str, struct allocator *a)
 {
 	struct url_struct *url;
 
-	url = xmalloc(sizeof(*url));
-	if (!url_parse(str, url)) {
-		free(url);
+	url = allocator_alloc(a, sizeof(*url));
+	if (!url_parse_in(str, url, a)) {
+		allocator_free(a, url);
 		return NULL;
 	}
 	return url;
 }
 
+struct url_struct *url_alloc(const char *str)
+{
+	return url_alloc_in(str, &heap_allocator);
+}
+
+struct url_struct *url_dup(const struct url_struct *url)
+{
+	struct url_struct *copy;
+
+	copy = xmalloc(sizeof(*copy));
+	*copy = *url;
+	copy->allocator = &heap_allocator;
+	if (url->scheme)
+		copy->scheme = xstrdup(url->scheme);
+	if (url->host)
+		copy->host = xstrdup(url->host);
+	if (url->path != slash_str)
+		copy->path = xstrdup(url->path);
+	set_name(copy);
+	return copy;
+}
+
 void url_free(struct url_struct *url)
 {
 	if (url) {
 		url_destroy(url);
-		free(url);
+		allocator_free(url->allocator, url);
 	}
 }
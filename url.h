@@ -22,6 +22,8 @@
 
 #include <stdbool.h>
 
+struct allocator;
+
 /*
  * We assume that a valid URL looks like:
  *
@@ -45,6 +47,9 @@ struct url_struct {
 	char *name;	/* last path component;
 			   empty string if path ends with `/' */
 	int port;	/* -1 if not specified */
+
+	struct allocator *allocator;	/* memory for the strings
+					   is taken from here */
 };
 
 /**
@@ -61,6 +66,17 @@ struct url_struct {
  */
 bool url_parse(const char *str, struct url_struct *url);
 
+/**
+ * url_parse_in - parse a URL string using an allocator
+ * @str: the string
+ * @url: where to store the result
+ * @a: the allocator to take memory from
+ *
+ * Same as url_parse(), but memory is allocated with @a instead of the heap.
+ */
+bool url_parse_in(const char *str, struct url_struct *url,
+		  struct allocator *a);
+
 /**
  * url_destroy - destroy a URL returned by url_parse()
  * @url: the url to destroy
@@ -77,6 +93,25 @@ void url_destroy(struct url_struct *url);
  */
 struct url_struct *url_alloc(const char *str);
 
+/**
+ * url_alloc_in - alloc url_struct using an allocator
+ * @str: the string
+ * @a: the allocator to take memory from
+ *
+ * Same as url_alloc(), but the url_struct and its fields are allocated with
+ * @a instead of the heap.
+ */
+struct url_struct *url_alloc_in(const char *str, struct allocator *a);
+
+/**
+ * url_dup - copy a url_struct
+ * @url: the url to copy
+ *
+ * Returns a copy of @url allocated on the heap. The copy must be freed
+ * using url_free().
+ */
+struct url_struct *url_dup(const struct url_struct *url);
+
 /**
  * url_free - free url_struct allocated by url_alloc()
  * @url: the url to free
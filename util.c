@@ -26,6 +26,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <time.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -93,6 +94,22 @@ char *str_seconds(unsigned int seconds, char *buf, size_t size)
 	return buf;
 }
 
+int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void __xalloc_failed(const char *file, int line, size_t size)
 {
 	fprintf(stderr, "%s:%d: Failed to allocate memory block of size %zu\n",
@@ -111,11 +128,139 @@ void *__xmalloc(const char *_file, int _line, size_t size)
 	__XALLOC(malloc, size, size);
 }
 
+void *__xrealloc(const char *_file, int _line, void *ptr, size_t size)
+{
+	__XALLOC(realloc, size, ptr, size);
+}
+
 void *__xstrdup(const char *_file, int _line, const char *s)
 {
 	__XALLOC(strdup, strlen(s) + 1, s);
 }
 
+static void *heap_alloc(struct allocator *a, size_t size)
+{
+	return xmalloc(size);
+}
+
+static void *heap_realloc(struct allocator *a, void *ptr,
+			  size_t old_size, size_t size)
+{
+	return xrealloc(ptr, size);
+}
+
+static void heap_free(struct allocator *a, void *ptr)
+{
+	free(ptr);
+}
+
+struct allocator heap_allocator = {
+	.alloc		= heap_alloc,
+	.realloc	= heap_realloc,
+	.free		= heap_free,
+};
+
+char *allocator_strndup(struct allocator *a, const char *s, size_t n)
+{
+	char *p;
+
+	n = strnlen(s, n);
+	p = allocator_alloc(a, n + 1);
+	memcpy(p, s, n);
+	p[n] = '\0';
+	return p;
+}
+
+/* Alignment of blocks allocated from an arena, enough for any type */
+#define ARENA_ALIGN		16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static size_t arena_align(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static void *arena_alloc(struct allocator *a, size_t size)
+{
+	struct arena *arena = (struct arena *)a;
+	struct arena_chunk *chunk;
+
+	size = arena_align(size);
+
+	if (size <= arena->end - arena->pos) {
+		arena->last = arena->pos;
+		arena->pos += size;
+		return arena->last;
+	}
+
+	/*
+	 * A big block gets a chunk of its own, which is linked behind the
+	 * current one, so that the space left in the latter isn't wasted.
+	 */
+	if (size > arena->chunk_size / 4 && arena->chunks) {
+		chunk = xmalloc(sizeof(*chunk) + size);
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+		return chunk->data;
+	}
+
+	chunk = xmalloc(sizeof(*chunk) + max(size, arena->chunk_size));
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->pos = chunk->data + size;
+	arena->end = chunk->data + max(size, arena->chunk_size);
+	arena->last = chunk->data;
+	return chunk->data;
+}
+
+static void *arena_realloc(struct allocator *a, void *ptr,
+			   size_t old_size, size_t size)
+{
+	struct arena *arena = (struct arena *)a;
+	void *p;
+
+	/* The last block may be grown in place */
+	if (ptr && ptr == arena->last &&
+	    arena_align(size) <= arena->end - arena->last) {
+		arena->pos = arena->last + arena_align(size);
+		return ptr;
+	}
+
+	p = arena_alloc(a, size);
+	if (ptr)
+		memcpy(p, ptr, min(old_size, size));
+	return p;
+}
+
+static void arena_free(struct allocator *a, void *ptr)
+{
+}
+
+void arena_init(struct arena *arena, size_t chunk_size)
+{
+	arena->allocator.alloc = arena_alloc;
+	arena->allocator.realloc = arena_realloc;
+	arena->allocator.free = arena_free;
+	arena->chunks = NULL;
+	arena->pos = arena->end = arena->last = NULL;
+	arena->chunk_size = chunk_size;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena_init(arena, arena->chunk_size);
+}
+
 bool addrinfo_addr_port(struct addrinfo *ai,
 			char *addr, size_t len, int *port)
 {
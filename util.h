@@ -22,6 +22,8 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 #define min(x, y) ({				\
 	typeof(x) _min1 = (x);			\
@@ -35,6 +37,11 @@
 	(void) (&_max1 == &_max2);		\
 	_max1 > _max2 ? _max1 : _max2; })
 
+#define swap(a, b) do {				\
+	typeof(a) _swap = (a);			\
+	(a) = (b);				\
+	(b) = _swap; } while (0)
+
 static inline bool strempty(const char *str)
 {
 	return !*str;
@@ -91,17 +98,122 @@ bool strict_strtoll(const char *str, int base, long long *result);
  */
 char *str_seconds(unsigned int seconds, char *buf, size_t size);
 
+/**
+ * now_ms - return the current time, in milliseconds
+ *
+ * The time is taken from a monotonic clock, so it is only good for
+ * measuring intervals.
+ */
+int64_t now_ms(void);
+
+/**
+ * now_us - same as now_ms(), but in microseconds
+ */
+int64_t now_us(void);
+
+#define container_of(ptr, type, member) ({			\
+	const typeof(((type *)0)->member) *_mptr = (ptr);	\
+	(type *)((char *)_mptr - offsetof(type, member)); })
+
 /*
  * x versions of memory allocation functions never return NULL,
  * instead they terminate the program on failure
  */
 
 void *__xmalloc(const char *, int, size_t);
+void *__xrealloc(const char *, int, void *, size_t);
 void *__xstrdup(const char *, int, const char *);
 
 #define xmalloc(size)		__xmalloc(__FILE__, __LINE__, (size))
+#define xrealloc(ptr, size)	__xrealloc(__FILE__, __LINE__, (ptr), (size))
 #define xstrdup(s)		__xstrdup(__FILE__, __LINE__, (s))
 
+/*
+ * Memory allocator interface, so that a module can be told where to take
+ * memory from. Allocation never fails, like with xmalloc().
+ *
+ * @realloc is passed the current size of the block, because some allocators
+ * don't keep track of it.
+ */
+struct allocator {
+	void *(*alloc)(struct allocator *a, size_t size);
+	void *(*realloc)(struct allocator *a, void *ptr,
+			 size_t old_size, size_t size);
+	void (*free)(struct allocator *a, void *ptr);
+};
+
+/* Allocator backed by xmalloc() and friends */
+extern struct allocator heap_allocator;
+
+static inline void *allocator_alloc(struct allocator *a, size_t size)
+{
+	return a->alloc(a, size);
+}
+
+static inline void *allocator_realloc(struct allocator *a, void *ptr,
+				      size_t old_size, size_t size)
+{
+	return a->realloc(a, ptr, old_size, size);
+}
+
+static inline void allocator_free(struct allocator *a, void *ptr)
+{
+	a->free(a, ptr);
+}
+
+/**
+ * allocator_strndup - duplicate a string using an allocator
+ * @a: the allocator
+ * @s: the string
+ * @n: max number of characters to copy
+ *
+ * The result is always nul-terminated.
+ */
+char *allocator_strndup(struct allocator *a, const char *s, size_t n);
+
+static inline char *allocator_strdup(struct allocator *a, const char *s)
+{
+	return allocator_strndup(a, s, strlen(s));
+}
+
+struct arena_chunk;
+
+/*
+ * Arena allocator. Blocks are carved out of big chunks one after another and
+ * can't be freed separately: freeing a block is a no-op, and all memory is
+ * released at once when the arena is destroyed. The last allocated block can
+ * be grown in place, if there's enough room left in the chunk.
+ *
+ * An arena is used through its @allocator member.
+ */
+struct arena {
+	struct allocator allocator;	/* must be first */
+	struct arena_chunk *chunks;	/* allocated chunks, the current one
+					   first */
+	char *pos;		/* free space left in the current chunk */
+	char *end;
+	char *last;		/* last allocated block */
+	size_t chunk_size;	/* default chunk size */
+};
+
+/**
+ * arena_init - initialize an arena allocator
+ * @arena: the arena
+ * @chunk_size: size of memory chunks to allocate
+ *
+ * Nothing is allocated until the first request. Requests that don't fit in
+ * a quarter of a chunk get a chunk of their own.
+ */
+void arena_init(struct arena *arena, size_t chunk_size);
+
+/**
+ * arena_destroy - free all memory allocated from an arena
+ * @arena: the arena
+ *
+ * The arena is left initialized and empty, so it can be reused.
+ */
+void arena_destroy(struct arena *arena);
+
 /**
  * addrinfo_addr_port - extract address and port from addrinfo struct
  * @ai: the addrinfo struct
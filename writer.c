@@ -0,0 +1,245 @@
+/*
+ * Writing to a file from a background thread.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE		/* for IOV_MAX */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "util.h"
+#include "writer.h"
+
+static struct writer_slot *slot(struct writer *w, unsigned i)
+{
+	return &w->slots[i % w->nr_bufs];
+}
+
+static char *slot_buf(struct writer *w, unsigned i)
+{
+	return w->bufs + w->buf_size * (i % w->nr_bufs);
+}
+
+/*
+ * Return %true if slot @s may be written with O_DIRECT.
+ */
+static bool slot_direct(struct writer *w, struct writer_slot *s)
+{
+	return w->direct_fd >= 0 && s->pos >= 0 &&
+		s->pos % WRITER_ALIGN == 0 && s->len % WRITER_ALIGN == 0;
+}
+
+static void sem_wait_nointr(sem_t *sem)
+{
+	while (sem_wait(sem) != 0)
+		assert(errno == EINTR);
+}
+
+/*
+ * Write @nr buffers described by @iov at @pos, or at the file offset if @pos
+ * is -1. Return 0 on success, errno on failure.
+ */
+static int write_iov(int fd, struct iovec *iov, int nr, off_t pos)
+{
+	ssize_t n;
+
+	while (nr > 0) {
+		if (pos < 0)
+			n = writev(fd, iov, nr);
+		else
+			n = pwritev(fd, iov, nr, pos);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		assert(n > 0);
+
+		if (pos >= 0)
+			pos += n;
+
+		/* Skip what's been written, which may end mid-buffer */
+		while (nr > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	int max_nr = min(w->nr_bufs, IOV_MAX);
+	struct iovec iov[max_nr];
+	struct writer_slot *first, *next;
+	bool direct;
+	off_t end;
+	int nr, i, err;
+
+	while (1) {
+		sem_wait_nointr(&w->filled);
+		first = slot(w, w->tail);
+		if (!first->len)
+			break;
+
+		iov[0].iov_base = slot_buf(w, w->tail);
+		iov[0].iov_len = first->len;
+		end = first->pos < 0 ? -1 : first->pos + first->len;
+		direct = slot_direct(w, first);
+		nr = 1;
+
+		/* Append whatever else is queued and follows in the file */
+		while (nr < max_nr && sem_trywait(&w->filled) == 0) {
+			next = slot(w, w->tail + nr);
+			if (!next->len || (end < 0) != (next->pos < 0) ||
+			    (end >= 0 && next->pos != end) ||
+			    slot_direct(w, next) != direct) {
+				sem_post(&w->filled);	/* leave it for later */
+				break;
+			}
+			iov[nr].iov_base = slot_buf(w, w->tail + nr);
+			iov[nr].iov_len = next->len;
+			if (end >= 0)
+				end += next->len;
+			nr++;
+		}
+
+		if (!__atomic_load_n(&w->error, __ATOMIC_RELAXED)) {
+			err = write_iov(direct ? w->direct_fd : w->fd,
+					iov, nr, first->pos);
+			if (err)
+				__atomic_store_n(&w->error, err,
+						 __ATOMIC_RELAXED);
+		}
+
+		w->tail += nr;
+		for (i = 0; i < nr; i++)
+			sem_post(&w->free);
+	}
+	return NULL;
+}
+
+bool writer_init(struct writer *w, int fd, int direct_fd,
+		 int nr_bufs, size_t buf_size)
+{
+	void *bufs;
+	int err;
+
+	assert(buf_size % WRITER_ALIGN == 0);
+
+	err = posix_memalign(&bufs, WRITER_ALIGN, buf_size * nr_bufs);
+	if (err) {
+		errno = err;
+		return false;
+	}
+
+	w->fd = fd;
+	w->direct_fd = direct_fd;
+	w->buf_size = buf_size;
+	w->nr_bufs = nr_bufs;
+	w->bufs = bufs;
+	w->slots = xmalloc(sizeof(*w->slots) * nr_bufs);
+	w->head = w->tail = 0;
+	w->reserved = false;
+	w->error = 0;
+	sem_init(&w->filled, 0, 0);
+	sem_init(&w->free, 0, nr_bufs);
+
+	err = pthread_create(&w->thread, NULL, writer_thread, w);
+	if (err) {
+		sem_destroy(&w->filled);
+		sem_destroy(&w->free);
+		free(w->slots);
+		free(w->bufs);
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+void writer_destroy(struct writer *w)
+{
+	writer_buf(w);
+	slot(w, w->head)->len = 0;
+	sem_post(&w->filled);
+	pthread_join(w->thread, NULL);
+
+	sem_destroy(&w->filled);
+	sem_destroy(&w->free);
+	free(w->slots);
+	free(w->bufs);
+}
+
+char *writer_buf(struct writer *w)
+{
+	if (!w->reserved) {
+		sem_wait_nointr(&w->free);
+		w->reserved = true;
+	}
+	return slot_buf(w, w->head);
+}
+
+static bool writer_ok(struct writer *w)
+{
+	int err = __atomic_load_n(&w->error, __ATOMIC_RELAXED);
+
+	if (err) {
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+bool writer_put(struct writer *w, size_t len, off_t pos)
+{
+	struct writer_slot *s = slot(w, w->head);
+
+	assert(w->reserved);
+	assert(len > 0 && len <= w->buf_size);
+
+	s->len = len;
+	s->pos = pos;
+	w->head++;
+	w->reserved = false;
+	sem_post(&w->filled);	/* publishes the slot */
+	return writer_ok(w);
+}
+
+bool writer_flush(struct writer *w)
+{
+	int nr = w->nr_bufs - w->reserved;
+	int i;
+
+	/* All slots are free once the thread is done with them */
+	for (i = 0; i < nr; i++)
+		sem_wait_nointr(&w->free);
+	for (i = 0; i < nr; i++)
+		sem_post(&w->free);
+	return writer_ok(w);
+}
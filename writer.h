@@ -0,0 +1,126 @@
+/*
+ * Writing to a file from a background thread.
+ *
+ * Copyright (C) 2016  Vladimir Davydov
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WRITER_H
+#define _WRITER_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/*
+ * Alignment of the buffers, which is enough for O_DIRECT on any device.
+ */
+#define WRITER_ALIGN		4096
+
+struct writer_slot {
+	size_t len;		/* 0 tells the thread to stop */
+	off_t pos;		/* -1 to write at the file offset */
+};
+
+/*
+ * A ring of buffers filled by one thread and written to a file by another,
+ * so that the producer doesn't have to wait for the disk. Buffers ready for
+ * writing at once are written with a single pwritev(2) if contiguous.
+ *
+ * Each ring index is advanced by one side only. The semaphores count slots
+ * available to either side; they only enter the kernel to put a side to
+ * sleep on an empty or a full ring.
+ *
+ * If the file is also opened with O_DIRECT, buffers that start and end at
+ * WRITER_ALIGN boundaries in the file are written bypassing the page cache,
+ * the rest goes through the page cache as usual.
+ *
+ * Only one thread may fill a writer.
+ */
+struct writer {
+	int fd;			/* file to write to */
+	int direct_fd;		/* same file opened with O_DIRECT; -1 if none */
+
+	char *bufs;		/* @nr_bufs buffers @buf_size bytes each */
+	size_t buf_size;
+	int nr_bufs;
+	struct writer_slot *slots;	/* one per buffer */
+
+	unsigned head;		/* next slot to fill, producer's */
+	unsigned tail;		/* next slot to write, consumer's */
+	bool reserved;		/* slot @head taken by writer_buf() */
+	sem_t filled;		/* number of slots to write */
+	sem_t free;		/* number of slots to fill */
+
+	int error;		/* errno of the first failed write, 0 if none;
+				   data queued after a failure are dropped */
+	pthread_t thread;
+};
+
+/**
+ * writer_init - start a writer
+ * @w: the writer
+ * @fd: file to write to
+ * @direct_fd: the same file opened with O_DIRECT, or -1
+ * @nr_bufs: number of buffers
+ * @buf_size: size of each buffer, a multiple of WRITER_ALIGN
+ *
+ * Returns %true on success. On failure returns %false and sets errno.
+ */
+bool writer_init(struct writer *w, int fd, int direct_fd,
+		 int nr_bufs, size_t buf_size);
+
+/**
+ * writer_destroy - stop a writer
+ * @w: the writer
+ *
+ * Waits for all queued data to be written. Errors are not reported, use
+ * writer_flush() for that.
+ */
+void writer_destroy(struct writer *w);
+
+/**
+ * writer_buf - get a buffer to fill
+ * @w: the writer
+ *
+ * Waits for a buffer to become free if all are queued. The buffer, @buf_size
+ * bytes long and aligned to WRITER_ALIGN, is passed to the writer by
+ * writer_put(). Until then, calling this function again returns the same
+ * buffer.
+ */
+char *writer_buf(struct writer *w);
+
+/**
+ * writer_put - queue the buffer returned by writer_buf() for writing
+ * @w: the writer
+ * @len: number of bytes to write, must be > 0
+ * @pos: file offset to write at, -1 for the current file offset
+ *
+ * Returns %true unless a write has failed so far, in which case returns
+ * %false and sets errno to the error.
+ */
+bool writer_put(struct writer *w, size_t len, off_t pos);
+
+/**
+ * writer_flush - wait for all queued data to be written
+ * @w: the writer
+ *
+ * Returns the same as writer_put().
+ */
+bool writer_flush(struct writer *w);
+
+#endif /* _WRITER_H */